@@ -18,8 +18,9 @@ static Window *tab_menu_window;
 // A list of stops by section
 static StopList *stop_list;
 
-static StopSection *current_section;
-static Stop *current_stop;
+// The selected stop, by index, since the stop list may move as it grows
+static uint16_t current_section_index;
+static uint16_t current_stop_index;
 
 /*
  * Called when the user selects the "NEARBY" menu item.
@@ -38,12 +39,20 @@ static void on_saved_selected(void) {
 }
 
 /*
- * When bluetooth connection is available, initialize data sync
+ * Called when stops have been loaded from the phone
+ */
+static void on_stops_loaded(StopList *loaded_stop_list) {
+    stop_list = loaded_stop_list;
+}
+
+/*
+ * When bluetooth connection is available, request fresh stop data from the phone.
+ * Any cached stops stay on screen until the new list has loaded. A sync cut off when the
+ * connection dropped carries on from where it got to, if the phone's list hasn't changed.
  */
 static void on_bluetooth_connection(bool connected) {
-    // Initialize sync and request stop data from phone
-    // init_sync();
-    // sync_get_stops(on_stops_loaded);
+    if (connected)
+        sync_get_stops(on_stops_loaded);
 }
 
 /*
@@ -65,17 +74,20 @@ static void init(void) {
     // APP_LOG(APP_LOG_LEVEL_DEBUG, "Creating stop window");
     // stop_window = init_stop_window();
 
-    // Require bluetooth connection
+    // Initialize sync and show the stops cached by the last launch, with their predictions, if any
+    init_sync();
+    stop_list = sync_load_cached_stops();
+
+    // Require bluetooth connection, and sync again whenever it comes back
+    bluetooth_connection_service_subscribe(on_bluetooth_connection);
     if (bluetooth_connection_service_peek()) {
         // Bluetooth is connected now
         on_bluetooth_connection(true);
-    } else {
-        // Wait for connection
-        bluetooth_connection_service_subscribe(on_bluetooth_connection);
     }
 }
 
 static void deinit(void) {
+    deinit_sync();
     window_destroy(tab_menu_window);
     // window_destroy(stops_menu_window);
     // window_destroy(stop_window);
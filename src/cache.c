@@ -0,0 +1,238 @@
+#include <pebble.h>
+#include "cache.h"
+#include "checksum.h"
+#include "snapshot.h"
+
+/*
+ * The cache is a header, stored under CACHE_HEADER_KEY, and the regions of the stop list
+ * streamed through chunks of PERSIST_DATA_MAX_LENGTH bytes, stored under consecutive keys
+ * from CACHE_CHUNK_KEY. The header is written last, so a save interrupted part way fails
+ * the checksum of the header it leaves behind.
+ */
+
+// Bump whenever the layout of StopSection, Stop or CacheHeader changes
+#define CACHE_VERSION 4
+
+#define CACHE_HEADER_KEY 100
+#define CACHE_CHUNK_KEY 101
+
+// Persistent storage is 4 KB per app; leave room for everything else
+#define CACHE_SIZE_BUDGET 3072
+#define CACHE_MAX_CHUNKS (CACHE_SIZE_BUDGET / PERSIST_DATA_MAX_LENGTH)
+
+typedef struct CacheHeader {
+    uint8_t version;
+    // Generation of the list from the phone
+    uint32_t generation;
+    uint16_t section_count;
+    uint16_t stop_count;
+    uint16_t string_size;
+    uint8_t chunk_count;
+    // Adler-32 of the saved regions
+    uint32_t checksum;
+} CacheHeader;
+
+// Staging buffer for one chunk, so the list is never copied as a whole
+static uint8_t chunk[PERSIST_DATA_MAX_LENGTH];
+
+/*
+ * Read the saved header. Return false if there is none or it is from another version.
+ */
+static bool read_header(CacheHeader *header) {
+    if (persist_read_data(CACHE_HEADER_KEY, header, sizeof(CacheHeader)) != sizeof(CacheHeader))
+        return false;
+    return header->version == CACHE_VERSION;
+}
+
+bool cache_save(StopList *stop_list) {
+    StopListRegion regions[STOP_LIST_REGION_COUNT];
+    stop_list_get_regions(stop_list, regions);
+
+    size_t total_size = 0;
+    for (int i = 0; i < STOP_LIST_REGION_COUNT; i++)
+        total_size += regions[i].size;
+    if (total_size > CACHE_SIZE_BUDGET) {
+        APP_LOG(APP_LOG_LEVEL_INFO, "Not caching stop list: %d bytes is over budget", (int) total_size);
+        return false;
+    }
+
+    CacheHeader previous;
+    bool has_previous = read_header(&previous);
+
+    // Stream the regions through the chunk buffer
+    uint32_t checksum = CHECKSUM_INITIAL;
+    uint8_t chunk_count = 0;
+    size_t chunk_size = 0;
+    for (int i = 0; i < STOP_LIST_REGION_COUNT; i++) {
+        const uint8_t *data = regions[i].data;
+        size_t remaining = regions[i].size;
+        checksum = checksum_update(checksum, data, remaining);
+        while (remaining > 0) {
+            size_t size = PERSIST_DATA_MAX_LENGTH - chunk_size;
+            if (size > remaining)
+                size = remaining;
+            memcpy(chunk + chunk_size, data, size);
+            chunk_size += size;
+            data += size;
+            remaining -= size;
+            if (chunk_size == PERSIST_DATA_MAX_LENGTH) {
+                if (persist_write_data(CACHE_CHUNK_KEY + chunk_count++, chunk, chunk_size) < 0)
+                    goto failed;
+                chunk_size = 0;
+            }
+        }
+    }
+    if (chunk_size > 0 && persist_write_data(CACHE_CHUNK_KEY + chunk_count++, chunk, chunk_size) < 0)
+        goto failed;
+
+    // Free chunks left over from a larger list
+    if (has_previous) {
+        for (int i = chunk_count; i < previous.chunk_count; i++)
+            persist_delete(CACHE_CHUNK_KEY + i);
+    }
+
+    CacheHeader header = {
+        .version = CACHE_VERSION,
+        .generation = stop_list->generation,
+        .section_count = stop_list->section_count,
+        .stop_count = stop_list->stop_count,
+        .string_size = stop_list->string_size,
+        .chunk_count = chunk_count,
+        .checksum = checksum
+    };
+    if (persist_write_data(CACHE_HEADER_KEY, &header, sizeof(CacheHeader)) < 0)
+        goto failed;
+
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Cached stop list generation %lu in %d chunks",
+            (unsigned long) header.generation, chunk_count);
+    return true;
+
+failed:
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Failed to write stop list cache");
+    cache_clear();
+    return false;
+}
+
+StopList *cache_load(void) {
+    CacheHeader header;
+    if (!read_header(&header))
+        return NULL;
+    if (header.chunk_count > CACHE_MAX_CHUNKS) {
+        cache_clear();
+        return NULL;
+    }
+
+    StopList *stop_list = stop_list_begin_restore(header.section_count, header.stop_count, header.string_size);
+    if (stop_list == NULL)
+        return NULL;
+
+    // Stream the chunks straight into the regions of the new list
+    StopListRegion regions[STOP_LIST_REGION_COUNT];
+    stop_list_get_regions(stop_list, regions);
+    uint32_t checksum = CHECKSUM_INITIAL;
+    uint8_t chunk_index = 0;
+    size_t chunk_size = 0;
+    size_t chunk_offset = 0;
+    for (int i = 0; i < STOP_LIST_REGION_COUNT; i++) {
+        uint8_t *data = regions[i].data;
+        size_t remaining = regions[i].size;
+        while (remaining > 0) {
+            if (chunk_offset == chunk_size) {
+                if (chunk_index >= header.chunk_count)
+                    goto corrupt;
+                int size = persist_read_data(CACHE_CHUNK_KEY + chunk_index++, chunk, PERSIST_DATA_MAX_LENGTH);
+                if (size <= 0)
+                    goto corrupt;
+                chunk_size = size;
+                chunk_offset = 0;
+            }
+            size_t size = chunk_size - chunk_offset;
+            if (size > remaining)
+                size = remaining;
+            memcpy(data, chunk + chunk_offset, size);
+            chunk_offset += size;
+            data += size;
+            remaining -= size;
+        }
+        checksum = checksum_update(checksum, regions[i].data, regions[i].size);
+    }
+
+    if (checksum != header.checksum || !stop_list_finish_restore(&stop_list))
+        goto corrupt;
+    stop_list->generation = header.generation;
+
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Loaded cached stop list generation %lu", (unsigned long) header.generation);
+    return stop_list;
+
+corrupt:
+    APP_LOG(APP_LOG_LEVEL_WARNING, "Discarding corrupt stop list cache");
+    stop_list_destroy(stop_list);
+    cache_clear();
+    return NULL;
+}
+
+void cache_clear(void) {
+    CacheHeader header;
+    uint8_t chunk_count = read_header(&header) ? header.chunk_count : CACHE_MAX_CHUNKS;
+    persist_delete(CACHE_HEADER_KEY);
+    for (int i = 0; i < chunk_count && i < CACHE_MAX_CHUNKS; i++)
+        persist_delete(CACHE_CHUNK_KEY + i);
+}
+
+bool cache_save_predictions(StopList *stop_list) {
+    if (stop_list == NULL || stop_list->generation == 0)
+        return false;
+    SnapshotRecord *records = malloc(SNAPSHOT_MAX_RECORDS * sizeof(SnapshotRecord));
+    if (records == NULL)
+        return false;
+
+    // Take the stops in list order until the snapshot is full
+    time_t now = time(NULL);
+    uint16_t record_count = 0;
+    for (uint16_t i = 0; i < stop_list->section_count && record_count < SNAPSHOT_MAX_RECORDS; i++) {
+        StopSection *section = stop_list_get_section(stop_list, i);
+        for (uint16_t j = 0; section != NULL && j < section->stop_count && record_count < SNAPSHOT_MAX_RECORDS; j++) {
+            Stop *stop = stop_list_get_stop(stop_list, i, j);
+            if (stop == NULL || stop->prediction.arrival_time == 0)
+                continue;
+            uint32_t age = now - stop->prediction.predicted_time;
+            records[record_count++] = (SnapshotRecord) {
+                .section_index = i,
+                .stop_index = j,
+                .arrival_time = stop->prediction.arrival_time,
+                .age = age > UINT16_MAX ? UINT16_MAX : age,
+                .confidence = stop->prediction.confidence
+            };
+        }
+    }
+    record_count = snapshot_prune(records, record_count, now);
+    bool saved = snapshot_write(stop_list->generation, now, records, record_count);
+    free(records);
+
+    if (!saved)
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Failed to write predictions snapshot");
+    return saved;
+}
+
+void cache_load_predictions(StopList *stop_list) {
+    SnapshotRecord *records = malloc(SNAPSHOT_MAX_RECORDS * sizeof(SnapshotRecord));
+    if (records == NULL)
+        return;
+
+    SnapshotHeader header;
+    uint16_t record_count = snapshot_read(&header, records);
+    if (record_count > 0 && header.generation == stop_list->generation) {
+        record_count = snapshot_prune(records, record_count, time(NULL));
+        for (uint16_t i = 0; i < record_count; i++) {
+            SnapshotRecord *record = &records[i];
+            Prediction prediction = {
+                .arrival_time = record->arrival_time,
+                .predicted_time = header.written_time - record->age,
+                .confidence = record->confidence
+            };
+            stop_set_prediction(stop_list, record->section_index, record->stop_index, &prediction);
+        }
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "Loaded %d predictions from snapshot", record_count);
+    }
+    free(records);
+}
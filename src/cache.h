@@ -0,0 +1,34 @@
+#pragma once
+
+#include "data.h"
+
+/*
+ * Save the stop list to persistent storage, so it can be shown at the next launch before
+ * the phone is reachable. Lists larger than the cache budget are not saved.
+ * Return true if the list was saved.
+ */
+bool cache_save(StopList *stop_list);
+
+/*
+ * Load the stop list saved by cache_save. Return NULL if there is no saved list, or if it
+ * is from an older version of the app or fails its checksum.
+ */
+StopList *cache_load(void);
+
+/*
+ * Delete the saved stop list.
+ */
+void cache_clear(void);
+
+/*
+ * Save the predictions of the stops of the list, those whose bus is still to come, as the
+ * predictions snapshot (see snapshot.h). Lists without a generation can't be matched to the
+ * cache, so nothing is saved for them. Return true if the snapshot was saved.
+ */
+bool cache_save_predictions(StopList *stop_list);
+
+/*
+ * Restore the predictions saved by cache_save_predictions into the list, if it is the list
+ * they were saved from and their bus is still to come.
+ */
+void cache_load_predictions(StopList *stop_list);
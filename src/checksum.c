@@ -0,0 +1,15 @@
+#include <pebble.h>
+#include "checksum.h"
+
+// Largest prime below 2^16
+#define ADLER_MODULUS 65521
+
+uint32_t checksum_update(uint32_t checksum, const uint8_t *data, size_t size) {
+    uint32_t a = checksum & 0xffff;
+    uint32_t b = checksum >> 16;
+    for (size_t i = 0; i < size; i++) {
+        a = (a + data[i]) % ADLER_MODULUS;
+        b = (b + a) % ADLER_MODULUS;
+    }
+    return (b << 16) | a;
+}
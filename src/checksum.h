@@ -0,0 +1,12 @@
+#pragma once
+
+#include <pebble.h>
+
+// Checksum to start from, before any bytes
+#define CHECKSUM_INITIAL 1
+
+/*
+ * Update an Adler-32 checksum with the given bytes. Data saved to persistent storage in several
+ * pieces, such as the stop list cache and the predictions snapshot, is checksummed piece by piece.
+ */
+uint32_t checksum_update(uint32_t checksum, const uint8_t *data, size_t size);
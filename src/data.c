@@ -1,88 +1,923 @@
 #include "data.h"
 
-void stop_list_destroy(StopList *stop_list) {
-    if (stop_list == NULL)
-        return;
+// Estimates used to size a stop list when the phone doesn't send the total stop count
+#define ESTIMATED_STOPS_PER_SECTION 6
+#define ESTIMATED_STOP_STRING_BYTES 32
+#define ESTIMATED_SECTION_STRING_BYTES 32
+// Estimated average length of an interned string, used to size the intern table
+#define ESTIMATED_STRING_LENGTH 8
+#define MIN_INTERN_CAPACITY 16
+#define MAX_INTERN_CAPACITY 0x8000
+// The tag index is kept at most 3/4 full of the stop capacity
+#define MIN_INDEX_CAPACITY 16
+#define MAX_INDEX_CAPACITY 0x8000
 
-    for (int i = 0; i < stop_list->section_count; i++) {
-        StopSection *section = stop_list->sections[i];
-        for (int j = 0; j < section->stop_count; j++) {
-            Stop *stop = section->stops[j];
-            free(stop->route_tag);
-            free(stop->route_title);
-            free(stop->direction_tag);
-            free(stop->direction_title);
-            free(stop->prediction);
-            free(stop->minutes_label);
-            free(stop);
+// Heap left free for the rest of the app by default when a stop list grows
+#define DEFAULT_MIN_HEAP_FREE 1024
+
+// Bounds on the memory of all stop lists together; see stop_list_set_memory_budget
+static uint32_t memory_budget = UINT32_MAX;
+static uint32_t min_heap_free = DEFAULT_MIN_HEAP_FREE;
+
+// Memory held by all stop lists, with its high-water marks
+static StopListMemory memory = { .heap_free_low = UINT32_MAX };
+
+/*
+ * Return the capacity of the tag index of a list of stop_capacity stops
+ */
+static uint16_t index_capacity_for(uint16_t stop_capacity) {
+    uint16_t index_capacity = MIN_INDEX_CAPACITY;
+    while (index_capacity < MAX_INDEX_CAPACITY && (uint32_t) index_capacity * 3 < (uint32_t) stop_capacity * 4)
+        index_capacity *= 2;
+    return index_capacity;
+}
+
+/*
+ * Return the capacity of the intern table of a string blob of string_capacity bytes
+ */
+static uint16_t intern_capacity_for(uint16_t string_capacity) {
+    uint16_t intern_capacity = MIN_INTERN_CAPACITY;
+    while (intern_capacity < MAX_INTERN_CAPACITY && intern_capacity * ESTIMATED_STRING_LENGTH < string_capacity)
+        intern_capacity *= 2;
+    return intern_capacity;
+}
+
+/*
+ * Return the offset of the string blob in a stop list with the given capacities
+ */
+static size_t stop_list_strings_offset(uint16_t section_count, uint16_t stop_capacity, uint16_t intern_capacity) {
+    return sizeof(StopList) + section_count * sizeof(StopSection) + stop_capacity * sizeof(Stop) +
+           intern_capacity * sizeof(StringRef) + index_capacity_for(stop_capacity) * sizeof(StopIndexSlot);
+}
+
+/*
+ * Point the section, stop, intern table, tag index and string arrays at their place in the allocation
+ */
+static void stop_list_layout(StopList *stop_list) {
+    stop_list->sections = (StopSection *) (stop_list + 1);
+    stop_list->stops = (Stop *) (stop_list->sections + stop_list->section_count);
+    stop_list->intern_slots = (StringRef *) (stop_list->stops + stop_list->stop_capacity);
+    stop_list->index_slots = (StopIndexSlot *) (stop_list->intern_slots + stop_list->intern_capacity);
+    stop_list->strings = (char *) (stop_list->index_slots + stop_list->index_capacity);
+}
+
+/*
+ * Return the size of the allocation of a stop list
+ */
+static size_t stop_list_allocation_size(StopList *stop_list) {
+    return stop_list_strings_offset(stop_list->section_count, stop_list->stop_capacity, stop_list->intern_capacity) +
+           stop_list->string_capacity;
+}
+
+/*
+ * Return true if the stop lists may grow by growth bytes without going over the memory budget,
+ * or leaving less than min_heap_free bytes of heap.
+ */
+static bool memory_available(size_t growth) {
+    return memory.allocated + growth <= memory_budget && heap_bytes_free() >= growth + min_heap_free;
+}
+
+/*
+ * Account for a stop list allocation going from old_size to new_size bytes
+ */
+static void memory_account(size_t old_size, size_t new_size) {
+    memory.allocated = memory.allocated - old_size + new_size;
+    if (new_size > 0)
+        memory.allocations++;
+    if (memory.allocated > memory.allocated_peak)
+        memory.allocated_peak = memory.allocated;
+    uint32_t heap_free = heap_bytes_free();
+    if (heap_free < memory.heap_free_low)
+        memory.heap_free_low = heap_free;
+}
+
+/*
+ * Clamp a capacity to what a uint16_t offset can address
+ */
+static uint16_t clamp_capacity(uint32_t capacity) {
+    return capacity > UINT16_MAX ? UINT16_MAX : capacity;
+}
+
+/*
+ * FNV-1a hash of the given bytes
+ */
+static uint32_t hash_string(const char *string, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) string[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Return the intern table slot holding the given string, or the empty slot where it belongs
+ */
+static uint16_t stop_list_find_slot(StopList *stop_list, const char *string, size_t length) {
+    uint16_t mask = stop_list->intern_capacity - 1;
+    uint16_t slot = hash_string(string, length) & mask;
+    while (stop_list->intern_slots[slot] != STRING_NONE) {
+        const char *interned = stop_list->strings + stop_list->intern_slots[slot];
+        if (strncmp(interned, string, length) == 0 && interned[length] == '\0')
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/*
+ * Return the interned offset of the given string, or STRING_NONE if the list doesn't hold it
+ */
+static StringRef stop_list_find_string(StopList *stop_list, const char *string) {
+    return stop_list->intern_slots[stop_list_find_slot(stop_list, string, strlen(string))];
+}
+
+/*
+ * Return the first tag index slot of a stop by the offsets of its tags
+ */
+static uint16_t index_hash(StopList *stop_list, StringRef stop_tag, StringRef route_tag) {
+    uint32_t key = ((uint32_t) stop_tag << 16) | route_tag;
+    return ((key * 2654435761u) >> 16) & (stop_list->index_capacity - 1);
+}
+
+/*
+ * Return true if the stop in the given tag index slot has the given tags
+ */
+static bool index_slot_matches(StopList *stop_list, StopIndexSlot *slot, StringRef stop_tag, StringRef route_tag) {
+    StopSection *section = &stop_list->sections[slot->section_index];
+    return section->stop_tag == stop_tag && stop_list->stops[section->first_stop + slot->stop_index].route_tag == route_tag;
+}
+
+/*
+ * Add the stop at stop_index in the section at section_index to the tag index
+ */
+static void stop_list_index_stop(StopList *stop_list, uint16_t section_index, uint16_t stop_index) {
+    StopSection *section = &stop_list->sections[section_index];
+    uint16_t mask = stop_list->index_capacity - 1;
+    uint16_t slot = index_hash(stop_list, section->stop_tag, stop_list->stops[section->first_stop + stop_index].route_tag);
+    for (uint16_t i = 0; i < stop_list->index_capacity; i++, slot = (slot + 1) & mask) {
+        if (stop_list->index_slots[slot].section_index == STOP_INDEX_EMPTY) {
+            stop_list->index_slots[slot] = (StopIndexSlot) { section_index, stop_index };
+            return;
+        }
+    }
+}
+
+/*
+ * Rebuild the tag index from the received stops. Sections whose stops aren't all within the
+ * list, such as those left behind by a failed resize, are skipped.
+ */
+static void stop_list_reindex(StopList *stop_list) {
+    memset(stop_list->index_slots, 0xff, stop_list->index_capacity * sizeof(StopIndexSlot));
+    for (uint16_t i = 0; i < stop_list->section_count; i++) {
+        StopSection *section = &stop_list->sections[i];
+        if (!section->received || (uint32_t) section->first_stop + section->stop_count > stop_list->stop_count)
+            continue;
+        for (uint16_t j = 0; j < section->stop_count; j++) {
+            if (stop_list->stops[section->first_stop + j].received)
+                stop_list_index_stop(stop_list, i, j);
+        }
+    }
+}
+
+/*
+ * Rebuild the intern table from the strings in the string blob, and the tag index, which is
+ * keyed by their offsets
+ */
+static void stop_list_rehash(StopList *stop_list) {
+    memset(stop_list->intern_slots, 0, stop_list->intern_capacity * sizeof(StringRef));
+    StringRef ref = 1;
+    while (ref < stop_list->string_size) {
+        size_t length = strlen(stop_list->strings + ref);
+        stop_list->intern_slots[stop_list_find_slot(stop_list, stop_list->strings + ref, length)] = ref;
+        ref += length + 1;
+    }
+    stop_list_reindex(stop_list);
+}
+
+/*
+ * Reallocate the list with the given section count and capacities, moving the stops and the
+ * string blob to their new place and rebuilding the intern table and the tag index. Records of
+ * new sections are not yet received, for the caller to fill. Return false if the list could
+ * not be reallocated; if the section count was to shrink, the records of the sections past it
+ * are then lost.
+ */
+static bool stop_list_resize(StopList **stop_list, uint16_t section_count, uint16_t stop_capacity, uint16_t intern_capacity, uint16_t string_capacity) {
+    StopList *list = *stop_list;
+    char *base = (char *) list;
+    size_t stops_size = list->stop_count * sizeof(Stop);
+    size_t old_stops_offset = (char *) list->stops - base;
+    size_t old_strings_offset = list->strings - base;
+    size_t stops_offset = sizeof(StopList) + section_count * sizeof(StopSection);
+    size_t strings_offset = stop_list_strings_offset(section_count, stop_capacity, intern_capacity);
+    size_t old_size = stop_list_allocation_size(list);
+    if (strings_offset + string_capacity > old_size && !memory_available(strings_offset + string_capacity - old_size))
+        return false;
+
+    // Regions moving down must move before the end of the allocation goes away, lowest first
+    if (stops_offset < old_stops_offset)
+        memmove(base + stops_offset, base + old_stops_offset, stops_size);
+    if (strings_offset < old_strings_offset)
+        memmove(base + strings_offset, base + old_strings_offset, list->string_size);
+
+    StopList *resized = realloc(list, strings_offset + string_capacity);
+    if (resized == NULL) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory resizing stop list to %d stops, %d bytes of strings",
+                stop_capacity, string_capacity);
+        // Put everything back, highest first
+        if (strings_offset < old_strings_offset)
+            memmove(base + old_strings_offset, base + strings_offset, list->string_size);
+        if (stops_offset < old_stops_offset)
+            memmove(base + old_stops_offset, base + stops_offset, stops_size);
+        stop_list_rehash(list);
+        return false;
+    }
+
+    memory_account(old_size, strings_offset + string_capacity);
+
+    // Regions moving up move once the allocation has grown, highest first
+    base = (char *) resized;
+    if (strings_offset > old_strings_offset)
+        memmove(base + strings_offset, base + old_strings_offset, resized->string_size);
+    if (stops_offset > old_stops_offset)
+        memmove(base + stops_offset, base + old_stops_offset, stops_size);
+
+    uint16_t old_section_count = resized->section_count;
+    resized->section_count = section_count;
+    resized->stop_capacity = stop_capacity;
+    resized->intern_capacity = intern_capacity;
+    resized->index_capacity = index_capacity_for(stop_capacity);
+    resized->string_capacity = string_capacity;
+    stop_list_layout(resized);
+
+    // Section records past the old count, and stop records past stop_count, are not yet received
+    if (section_count > old_section_count)
+        memset(resized->sections + old_section_count, 0, (section_count - old_section_count) * sizeof(StopSection));
+    memset(resized->stops + resized->stop_count, 0, (stop_capacity - resized->stop_count) * sizeof(Stop));
+    stop_list_rehash(resized);
+
+    *stop_list = resized;
+    return true;
+}
+
+/*
+ * Make room for stop_count more stops, growing the list if necessary.
+ * Return false if the list could not be grown.
+ */
+static bool stop_list_reserve_stops(StopList **stop_list, uint16_t stop_count) {
+    StopList *list = *stop_list;
+    uint32_t stops_needed = (uint32_t) list->stop_count + stop_count;
+    if (stops_needed <= list->stop_capacity)
+        return true;
+    if (stops_needed > UINT16_MAX) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Stop list is too large");
+        return false;
+    }
+
+    // Grow by half again as much as needed, so a list of unknown size grows only a few times,
+    // or by just as much as needed if memory is short
+    return stop_list_resize(stop_list, list->section_count, clamp_capacity(stops_needed + stops_needed / 2),
+                            list->intern_capacity, list->string_capacity) ||
+           stop_list_resize(stop_list, list->section_count, stops_needed, list->intern_capacity, list->string_capacity);
+}
+
+/*
+ * Store the given string (of the given length, not necessarily NUL-terminated) once in the
+ * string blob, and set ref to its offset. Strings which are already stored are shared.
+ * Return false if there is no room for the string.
+ */
+static bool stop_list_intern(StopList **stop_list, const char *string, size_t length, StringRef *ref) {
+    StopList *list = *stop_list;
+    list->string_requested += length + 1;
+    if (length == 0) {
+        *ref = STRING_NONE;
+        return true;
+    }
+
+    uint16_t slot = stop_list_find_slot(list, string, length);
+    if (list->intern_slots[slot] != STRING_NONE) {
+        *ref = list->intern_slots[slot];
+        return true;
+    }
+
+    // Make room in the string blob, and keep the intern table at most 3/4 full
+    uint32_t strings_needed = (uint32_t) list->string_size + length + 1;
+    bool table_full = (uint32_t) (list->string_count + 1) * 4 > (uint32_t) list->intern_capacity * 3;
+    if (strings_needed > list->string_capacity || table_full) {
+        if (strings_needed > UINT16_MAX || (table_full && list->intern_capacity >= MAX_INTERN_CAPACITY)) {
+            APP_LOG(APP_LOG_LEVEL_ERROR, "Stop list strings are too large");
+            return false;
         }
-        free(section->stops);
-        free(section->stop_tag);
-        free(section->stop_title);
-        free(section);
+        uint16_t string_capacity = list->string_capacity;
+        if (strings_needed > string_capacity)
+            string_capacity = clamp_capacity(strings_needed + strings_needed / 2);
+        uint16_t intern_capacity = table_full ? list->intern_capacity * 2 : list->intern_capacity;
+        // Fall back to just as much as needed if memory is short
+        if (!stop_list_resize(stop_list, list->section_count, list->stop_capacity, intern_capacity, string_capacity) &&
+                (string_capacity <= strings_needed ||
+                 !stop_list_resize(stop_list, list->section_count, list->stop_capacity, intern_capacity, strings_needed)))
+            return false;
+        list = *stop_list;
+        slot = stop_list_find_slot(list, string, length);
     }
-    free(stop_list->sections);
+
+    *ref = list->string_size;
+    memcpy(list->strings + *ref, string, length);
+    list->strings[*ref + length] = '\0';
+    list->string_size += length + 1;
+    list->string_count++;
+    list->intern_slots[slot] = *ref;
+    return true;
+}
+
+void stop_list_destroy(StopList *stop_list) {
+    if (stop_list == NULL)
+        return;
+    memory_account(stop_list_allocation_size(stop_list), 0);
     free(stop_list);
 }
 
-StopList *stop_list_create(uint16_t section_count) {
-    StopList *stop_list = malloc(sizeof(StopList));
+StopList *stop_list_create(uint16_t section_count, uint16_t stop_count) {
+    if (stop_count == 0)
+        stop_count = clamp_capacity((uint32_t) section_count * ESTIMATED_STOPS_PER_SECTION);
+    uint16_t string_capacity = clamp_capacity(1 + (uint32_t) stop_count * ESTIMATED_STOP_STRING_BYTES +
+                                              (uint32_t) section_count * ESTIMATED_SECTION_STRING_BYTES);
+    uint16_t intern_capacity = intern_capacity_for(string_capacity);
+    size_t strings_offset = stop_list_strings_offset(section_count, stop_count, intern_capacity);
+
+    // The string blob and its intern table grow as needed, so start with smaller ones if memory is short
+    uint16_t min_string_capacity = clamp_capacity(1 + (uint32_t) section_count * ESTIMATED_SECTION_STRING_BYTES);
+    while (string_capacity / 2 >= min_string_capacity && !memory_available(strings_offset + string_capacity)) {
+        string_capacity /= 2;
+        intern_capacity = intern_capacity_for(string_capacity);
+        strings_offset = stop_list_strings_offset(section_count, stop_count, intern_capacity);
+    }
+
+    StopList *stop_list = NULL;
+    if (memory_available(strings_offset + string_capacity))
+        stop_list = malloc(strings_offset + string_capacity);
+    if (stop_list == NULL) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory creating stop list with %d stops", stop_count);
+        return NULL;
+    }
+
+    stop_list->generation = 0;
     stop_list->section_count = section_count;
-    stop_list->sections = malloc(section_count * sizeof(StopSection *));
+    stop_list->stop_count = 0;
+    stop_list->stop_capacity = stop_count;
+    stop_list->intern_capacity = intern_capacity;
+    stop_list->string_count = 0;
+    stop_list->index_capacity = index_capacity_for(stop_count);
+    stop_list->string_capacity = string_capacity;
+    stop_list->string_requested = 0;
+    stop_list_layout(stop_list);
+    memset(stop_list->sections, 0, strings_offset - sizeof(StopList));
+    stop_list_reindex(stop_list);
+
+    // Offset 0 is the empty string
+    stop_list->strings[0] = '\0';
+    stop_list->string_size = 1;
+    memory_account(0, strings_offset + string_capacity);
     return stop_list;
 }
 
-StopSection *stop_list_add_section(StopList *stop_list, uint16_t section_index, char *stop_tag, char *stop_title, uint16_t stop_count) {
-    StopSection *section = stop_list->sections[section_index] = malloc(sizeof(StopSection));
-    section->stop_tag = malloc(strlen(stop_tag) + 1);
-    strcpy(section->stop_tag, stop_tag);
-    section->stop_title = malloc(strlen(stop_title) + 1);
-    strcpy(section->stop_title, stop_title);
+StopList *stop_list_copy(StopList *stop_list) {
+    size_t size = stop_list_allocation_size(stop_list);
+    StopList *copy = memory_available(size) ? malloc(size) : NULL;
+    if (copy == NULL) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "Out of memory copying stop list");
+        return NULL;
+    }
+    memcpy(copy, stop_list, size);
+    stop_list_layout(copy);
+    memory_account(0, size);
+    return copy;
+}
+
+StopSection *stop_list_add_section(StopList **stop_list, uint16_t section_index, char *stop_tag, char *stop_title, uint16_t stop_count) {
+    StringSlice stop_tag_slice = { stop_tag, strlen(stop_tag) };
+    StringSlice stop_title_slice = { stop_title, strlen(stop_title) };
+    return stop_list_add_section_slices(stop_list, section_index, stop_tag_slice, stop_title_slice, stop_count);
+}
+
+StopSection *stop_list_add_section_slices(StopList **stop_list, uint16_t section_index, StringSlice stop_tag, StringSlice stop_title, uint16_t stop_count) {
+    if (section_index >= (*stop_list)->section_count)
+        return NULL;
+
+    // A section may be received twice if its request was retried
+    if ((*stop_list)->sections[section_index].received)
+        return &(*stop_list)->sections[section_index];
+
+    // Reserve the section's stop records and store its strings first, since they may move the list
+    StringRef stop_tag_ref, stop_title_ref;
+    if (!stop_list_reserve_stops(stop_list, stop_count) ||
+            !stop_list_intern(stop_list, stop_tag.data, stop_tag.length, &stop_tag_ref) ||
+            !stop_list_intern(stop_list, stop_title.data, stop_title.length, &stop_title_ref))
+        return NULL;
+
+    StopList *list = *stop_list;
+    StopSection *section = &list->sections[section_index];
+    section->stop_tag = stop_tag_ref;
+    section->stop_title = stop_title_ref;
     section->stop_count = stop_count;
-    section->stops = malloc(stop_count * sizeof(Stop *));
+    section->loaded_count = 0;
+    section->first_stop = list->stop_count;
+    section->received = true;
+    list->stop_count += stop_count;
     return section;
 }
 
-Stop *section_add_stop(StopSection *section, uint16_t stop_index, char *route_tag, char *route_title, char *direction_tag, char *direction_title) {
-    Stop *stop = section->stops[stop_index] = malloc(sizeof(Stop));
-    stop->route_tag = malloc(strlen(route_tag) + 1);
-    strcpy(stop->route_tag, route_tag);
-    stop->route_title = malloc(strlen(route_title) + 1);
-    strcpy(stop->route_title, route_title);
-    stop->direction_tag = malloc(strlen(direction_tag) + 1);
-    strcpy(stop->direction_tag, direction_tag);
-    stop->direction_title = malloc(strlen(direction_title) + 1);
-    strcpy(stop->direction_title, direction_title);
+Stop *section_add_stop(StopList **stop_list, uint16_t section_index, uint16_t stop_index, char *route_tag, char *route_title, char *direction_tag, char *direction_title) {
+    StringSlice strings[STOP_STRING_COUNT] = {
+        { route_tag, strlen(route_tag) },
+        { route_title, strlen(route_title) },
+        { direction_tag, strlen(direction_tag) },
+        { direction_title, strlen(direction_title) }
+    };
+    return section_add_stop_slices(stop_list, section_index, stop_index, strings);
+}
+
+Stop *section_add_stop_slices(StopList **stop_list, uint16_t section_index, uint16_t stop_index, const StringSlice strings[STOP_STRING_COUNT]) {
+    StopSection *section = stop_list_get_section(*stop_list, section_index);
+    if (section == NULL || stop_index >= section->stop_count)
+        return NULL;
+
+    // A stop may be received twice if its request was retried
+    Stop *stop = &(*stop_list)->stops[section->first_stop + stop_index];
+    if (stop->received)
+        return stop;
+
+    // Store the strings first, since they may move the list
+    StringRef refs[STOP_STRING_COUNT];
+    for (int i = 0; i < STOP_STRING_COUNT; i++) {
+        if (!stop_list_intern(stop_list, strings[i].data, strings[i].length, &refs[i]))
+            return NULL;
+    }
+
+    StopList *list = *stop_list;
+    section = &list->sections[section_index];
+    stop = &list->stops[section->first_stop + stop_index];
+    *stop = (Stop) {
+        .route_tag = refs[0],
+        .route_title = refs[1],
+        .direction_tag = refs[2],
+        .direction_title = refs[3],
+        .received = true,
+        .revision = stop->revision + 1
+    };
+    section->loaded_count++;
+    stop_list_index_stop(list, section_index, stop_index);
     return stop;
 }
 
-Stop *stop_set_prediction(Stop *stop, char *prediction, char *minutes_label) {
-    stop->prediction = malloc(strlen(prediction) + 1);
-    strcpy(stop->prediction, prediction);
-    stop->prediction = prediction;
-    stop->minutes_label = malloc(strlen(minutes_label) + 1);
-    strcpy(stop->minutes_label, minutes_label);
+Stop *stop_set_prediction(StopList *stop_list, uint16_t section_index, uint16_t stop_index, const Prediction *prediction) {
+    Stop *stop = stop_list_get_stop(stop_list, section_index, stop_index);
+    if (stop == NULL)
+        return NULL;
+
+    // Only a changed arrival needs to be redrawn
+    if (prediction->arrival_time != stop->prediction.arrival_time || prediction->confidence != stop->prediction.confidence)
+        stop->revision++;
+    stop->prediction = *prediction;
     return stop;
 }
 
-void dump_stop_list(StopList *stop_list) {
+bool stop_list_find_stop(StopList *stop_list, const char *stop_tag, const char *route_tag, uint16_t *section_index, uint16_t *stop_index) {
+    StringRef stop_tag_ref = stop_list_find_string(stop_list, stop_tag);
+    StringRef route_tag_ref = stop_list_find_string(stop_list, route_tag);
+    if ((stop_tag_ref == STRING_NONE && stop_tag[0] != '\0') || (route_tag_ref == STRING_NONE && route_tag[0] != '\0'))
+        return false;
+
+    uint16_t mask = stop_list->index_capacity - 1;
+    uint16_t slot = index_hash(stop_list, stop_tag_ref, route_tag_ref);
+    for (uint16_t i = 0; i < stop_list->index_capacity; i++, slot = (slot + 1) & mask) {
+        StopIndexSlot *index_slot = &stop_list->index_slots[slot];
+        if (index_slot->section_index == STOP_INDEX_EMPTY)
+            return false;
+        if (index_slot_matches(stop_list, index_slot, stop_tag_ref, route_tag_ref)) {
+            *section_index = index_slot->section_index;
+            *stop_index = index_slot->stop_index;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint16_t stop_list_set_prediction_by_tags(StopList *stop_list, const char *stop_tag, const char *route_tag, const Prediction *prediction) {
+    StringRef stop_tag_ref = stop_list_find_string(stop_list, stop_tag);
+    StringRef route_tag_ref = stop_list_find_string(stop_list, route_tag);
+    if ((stop_tag_ref == STRING_NONE && stop_tag[0] != '\0') || (route_tag_ref == STRING_NONE && route_tag[0] != '\0'))
+        return 0;
+
+    // A route may serve a stop in more than one direction; every match is in the same probe run
+    uint16_t updated = 0;
+    uint16_t mask = stop_list->index_capacity - 1;
+    uint16_t slot = index_hash(stop_list, stop_tag_ref, route_tag_ref);
+    for (uint16_t i = 0; i < stop_list->index_capacity; i++, slot = (slot + 1) & mask) {
+        StopIndexSlot *index_slot = &stop_list->index_slots[slot];
+        if (index_slot->section_index == STOP_INDEX_EMPTY)
+            break;
+        if (index_slot_matches(stop_list, index_slot, stop_tag_ref, route_tag_ref) &&
+                stop_set_prediction(stop_list, index_slot->section_index, index_slot->stop_index, prediction) != NULL)
+            updated++;
+    }
+    return updated;
+}
+
+bool stop_format_prediction(const Stop *stop, time_t now, char prediction[STOP_PREDICTION_LENGTH], char minutes_label[STOP_MINUTES_LABEL_LENGTH]) {
+    prediction[0] = '\0';
+    minutes_label[0] = '\0';
+
+    // Nothing to show before the first prediction, or once the bus has come
+    const Prediction *next = &stop->prediction;
+    int32_t seconds = (int32_t) (next->arrival_time - now);
+    if (next->arrival_time == 0 || seconds <= -PREDICTION_DUE_SECONDS)
+        return false;
+
+    int32_t minutes = seconds > 0 ? seconds / 60 : 0;
+    if (minutes > PREDICTION_MAX_MINUTES)
+        minutes = PREDICTION_MAX_MINUTES;
+    if (minutes == 0) {
+        strncpy(prediction, "Due", STOP_PREDICTION_LENGTH);
+        return true;
+    }
+    bool approximate = next->confidence != 0 && next->confidence < PREDICTION_LOW_CONFIDENCE;
+    snprintf(prediction, STOP_PREDICTION_LENGTH, "%s%ld", approximate ? "~" : "", (long) minutes);
+    strncpy(minutes_label, minutes == 1 ? "minute" : "minutes", STOP_MINUTES_LABEL_LENGTH);
+    return true;
+}
+
+bool stop_prediction_is_stale(const Stop *stop, time_t now) {
+    const Prediction *next = &stop->prediction;
+    if (next->predicted_time == 0)
+        return true;
+    int32_t age = (int32_t) (now - next->predicted_time);
+    if (age >= PREDICTION_TTL_SECONDS)
+        return true;
+
+    // Once the bus is due, find out whether it has come, and when the next one will
+    return next->arrival_time != 0 && (int32_t) (next->arrival_time - now) < PREDICTION_DUE_SECONDS &&
+            age >= PREDICTION_DUE_TTL_SECONDS;
+}
+
+/*
+ * Call visit with each string reference held by the sections and stops of a list
+ */
+static void stop_list_visit_refs(StopList *stop_list, void (*visit)(StopList *, StringRef *, uint16_t), uint16_t count) {
+    for (int i = 0; i < stop_list->section_count; i++) {
+        StopSection *section = &stop_list->sections[i];
+        visit(stop_list, &section->stop_tag, count);
+        visit(stop_list, &section->stop_title, count);
+    }
+    for (int i = 0; i < stop_list->stop_count; i++) {
+        Stop *stop = &stop_list->stops[i];
+        visit(stop_list, &stop->route_tag, count);
+        visit(stop_list, &stop->route_title, count);
+        visit(stop_list, &stop->direction_tag, count);
+        visit(stop_list, &stop->direction_title, count);
+    }
+}
+
+// Put a referenced string in the intern table, which ends up holding just those
+static void mark_ref(StopList *stop_list, StringRef *ref, uint16_t count) {
+    if (*ref == STRING_NONE) return;
+    const char *string = stop_list->strings + *ref;
+    stop_list->intern_slots[stop_list_find_slot(stop_list, string, strlen(string))] = *ref;
+}
+
+// Replace a reference by 1 + its index in the first count intern slots, which are sorted
+static void index_ref(StopList *stop_list, StringRef *ref, uint16_t count) {
+    if (*ref == STRING_NONE) return;
+    uint16_t low = 0, high = count;
+    while (low < high) {
+        uint16_t middle = low + (high - low) / 2;
+        if (stop_list->intern_slots[middle] < *ref)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    *ref = low + 1;
+}
+
+// Replace 1 + an index in the intern slots by the offset the slot now holds
+static void unindex_ref(StopList *stop_list, StringRef *ref, uint16_t count) {
+    if (*ref == STRING_NONE) return;
+    *ref = stop_list->intern_slots[*ref - 1];
+}
+
+/*
+ * Drop strings which are no longer referenced, such as the titles of removed sections, and
+ * rebuild the tag index, since the stops may have moved. This works in place, with the intern
+ * table as scratch space, so it needs no memory when memory is shortest: the referenced offsets
+ * are gathered into the table and sorted, each reference is replaced by its position among
+ * them, the strings are slid down in order, and the references are mapped to where they went.
+ */
+static void stop_list_compact_strings(StopList *stop_list) {
+    StringRef *slots = stop_list->intern_slots;
+    memset(slots, 0, stop_list->intern_capacity * sizeof(StringRef));
+    stop_list_visit_refs(stop_list, mark_ref, 0);
+
+    uint16_t count = 0;
+    for (int i = 0; i < stop_list->intern_capacity; i++) {
+        if (slots[i] != STRING_NONE)
+            slots[count++] = slots[i];
+    }
+
+    // Shell sort; the table holds at most a few thousand strings
+    for (uint16_t gap = count / 2; gap > 0; gap /= 2) {
+        for (uint16_t i = gap; i < count; i++) {
+            StringRef ref = slots[i];
+            uint16_t j = i;
+            for (; j >= gap && slots[j - gap] > ref; j -= gap)
+                slots[j] = slots[j - gap];
+            slots[j] = ref;
+        }
+    }
+
+    stop_list_visit_refs(stop_list, index_ref, count);
+    uint16_t string_size = 1;
+    for (uint16_t i = 0; i < count; i++) {
+        size_t length = strlen(stop_list->strings + slots[i]);
+        memmove(stop_list->strings + string_size, stop_list->strings + slots[i], length + 1);
+        slots[i] = string_size;
+        string_size += length + 1;
+    }
+    stop_list_visit_refs(stop_list, unindex_ref, count);
+    stop_list->string_size = string_size;
+    stop_list->string_count = count;
+
+    // Intern the strings left again
+    memset(slots, 0, stop_list->intern_capacity * sizeof(StringRef));
+    for (uint16_t offset = 1; offset < string_size; offset += strlen(stop_list->strings + offset) + 1) {
+        const char *string = stop_list->strings + offset;
+        slots[stop_list_find_slot(stop_list, string, strlen(string))] = offset;
+    }
+    stop_list_reindex(stop_list);
+}
+
+bool stop_list_splice(StopList **stop_list, uint16_t section_count, const uint32_t *generations) {
+    StopList *list = *stop_list;
+    StopSection *sections = malloc(section_count * sizeof(StopSection) + list->section_count * sizeof(bool));
+    if (sections == NULL && section_count + list->section_count > 0)
+        return false;
+    bool *kept = (bool *) (sections + section_count);
+    if (list->section_count > 0)
+        memset(kept, 0, list->section_count * sizeof(bool));
+
+    // Match each new section to a received section with the same generation
+    for (int i = 0; i < section_count; i++) {
+        sections[i] = (StopSection) { .generation = generations[i] };
+        if (generations[i] == 0)
+            continue;
+        for (int j = 0; j < list->section_count; j++) {
+            if (!kept[j] && list->sections[j].received && list->sections[j].generation == generations[i]) {
+                sections[i] = list->sections[j];
+                kept[j] = true;
+                break;
+            }
+        }
+    }
+
+    // Make room for the new section records
+    if (section_count != list->section_count &&
+            !stop_list_resize(stop_list, section_count, list->stop_capacity, list->intern_capacity, list->string_capacity)) {
+        free(sections);
+        return false;
+    }
+    list = *stop_list;
+
+    // Release the stops of dropped sections by sliding the kept ranges down, lowest first.
+    // Ranges not yet moved all start at or after stop_count.
+    uint16_t stop_count = 0;
+    while (true) {
+        StopSection *next = NULL;
+        for (int i = 0; i < section_count; i++) {
+            StopSection *section = &sections[i];
+            if (section->received && section->stop_count > 0 && section->first_stop >= stop_count &&
+                    (next == NULL || section->first_stop < next->first_stop))
+                next = section;
+        }
+        if (next == NULL)
+            break;
+        memmove(&list->stops[stop_count], &list->stops[next->first_stop], next->stop_count * sizeof(Stop));
+        next->first_stop = stop_count;
+        stop_count += next->stop_count;
+    }
+    memset(&list->stops[stop_count], 0, (list->stop_count - stop_count) * sizeof(Stop));
+    list->stop_count = stop_count;
+
+    if (section_count > 0)
+        memcpy(list->sections, sections, section_count * sizeof(StopSection));
+    free(sections);
+
+    stop_list_compact_strings(list);
+    return true;
+}
+
+void stop_list_evict_section(StopList *stop_list, uint16_t section_index) {
+    StopSection *section = stop_list_get_section(stop_list, section_index);
+    if (section == NULL || section->loaded_count == 0)
+        return;
+    memset(&stop_list->stops[section->first_stop], 0, section->stop_count * sizeof(Stop));
+    section->loaded_count = 0;
+    stop_list_compact_strings(stop_list);
+    memory.evictions++;
+}
+
+uint16_t stop_list_received_prefix(StopList *stop_list) {
+    uint16_t count = 0;
+    while (count < stop_list->section_count && stop_list->sections[count].received)
+        count++;
+    return count;
+}
+
+uint16_t stop_list_complete_prefix(StopList *stop_list) {
+    uint16_t count = 0;
+    while (count < stop_list->section_count) {
+        StopSection *section = &stop_list->sections[count];
+        if (!section->received || section->loaded_count < section->stop_count)
+            break;
+        count++;
+    }
+    return count;
+}
+
+bool stop_list_is_complete(StopList *stop_list) {
+    return stop_list_complete_prefix(stop_list) == stop_list->section_count;
+}
+
+StopSection *stop_list_get_section(StopList *stop_list, uint16_t section_index) {
+    if (section_index >= stop_list->section_count || !stop_list->sections[section_index].received)
+        return NULL;
+    return &stop_list->sections[section_index];
+}
+
+Stop *stop_list_get_stop(StopList *stop_list, uint16_t section_index, uint16_t stop_index) {
+    StopSection *section = stop_list_get_section(stop_list, section_index);
+    if (section == NULL || stop_index >= section->stop_count)
+        return NULL;
+    Stop *stop = &stop_list->stops[section->first_stop + stop_index];
+    return stop->received ? stop : NULL;
+}
+
+const char *stop_list_string(StopList *stop_list, StringRef ref) {
+    return ref < stop_list->string_size ? stop_list->strings + ref : "";
+}
+
+void stop_list_get_regions(StopList *stop_list, StopListRegion regions[STOP_LIST_REGION_COUNT]) {
+    regions[0] = (StopListRegion) { stop_list->sections, stop_list->section_count * sizeof(StopSection) };
+    regions[1] = (StopListRegion) { stop_list->stops, stop_list->stop_count * sizeof(Stop) };
+    regions[2] = (StopListRegion) { stop_list->strings, stop_list->string_size };
+}
+
+StopList *stop_list_begin_restore(uint16_t section_count, uint16_t stop_count, uint16_t string_size) {
+    if (string_size == 0)
+        return NULL;
+
+    StopList *stop_list = stop_list_create(section_count, stop_count);
     if (stop_list == NULL)
+        return NULL;
+    if (string_size > stop_list->string_capacity &&
+            !stop_list_resize(&stop_list, section_count, stop_list->stop_capacity, stop_list->intern_capacity, string_size)) {
+        stop_list_destroy(stop_list);
+        return NULL;
+    }
+    stop_list->stop_count = stop_count;
+    stop_list->string_size = string_size;
+    return stop_list;
+}
+
+bool stop_list_finish_restore(StopList **restored_list) {
+    StopList *stop_list = *restored_list;
+
+    // Every string must be terminated within the blob
+    if (stop_list->strings[0] != '\0' || stop_list->strings[stop_list->string_size - 1] != '\0')
+        return false;
+
+    // Every section must refer to its own stops, and every record to a string in the blob
+    uint32_t reserved_stops = 0;
+    for (int i = 0; i < stop_list->section_count; i++) {
+        StopSection *section = &stop_list->sections[i];
+        if (!section->received)
+            continue;
+        if ((uint32_t) section->first_stop + section->stop_count > stop_list->stop_count ||
+                section->loaded_count > section->stop_count ||
+                section->stop_tag >= stop_list->string_size || section->stop_title >= stop_list->string_size)
+            return false;
+        reserved_stops += section->stop_count;
+    }
+    if (reserved_stops != stop_list->stop_count)
+        return false;
+
+    // ...and their ranges must follow one another from the first stop, in the order the sections
+    // were received, so no stop belongs to two of them
+    uint16_t next_stop = 0;
+    while (next_stop < stop_list->stop_count) {
+        int i = 0;
+        while (i < stop_list->section_count && !(stop_list->sections[i].received && stop_list->sections[i].stop_count > 0 &&
+                                                stop_list->sections[i].first_stop == next_stop))
+            i++;
+        if (i == stop_list->section_count)
+            return false;
+        next_stop += stop_list->sections[i].stop_count;
+    }
+
+    for (int i = 0; i < stop_list->stop_count; i++) {
+        Stop *stop = &stop_list->stops[i];
+        if (stop->route_tag >= stop_list->string_size || stop->route_title >= stop_list->string_size ||
+                stop->direction_tag >= stop_list->string_size || stop->direction_title >= stop_list->string_size)
+            return false;
+        stop->prediction = (Prediction) { 0 };
+    }
+
+    // Count the strings and rebuild the intern table, growing it if the estimate was low
+    stop_list->string_requested = stop_list->string_size;
+    stop_list->string_count = 0;
+    for (StringRef ref = 1; ref < stop_list->string_size; ref += strlen(stop_list->strings + ref) + 1)
+        stop_list->string_count++;
+    uint16_t intern_capacity = stop_list->intern_capacity;
+    while ((uint32_t) stop_list->string_count * 4 > (uint32_t) intern_capacity * 3) {
+        if (intern_capacity >= MAX_INTERN_CAPACITY)
+            return false;
+        intern_capacity *= 2;
+    }
+    if (intern_capacity != stop_list->intern_capacity)
+        return stop_list_resize(restored_list, stop_list->section_count, stop_list->stop_capacity, intern_capacity, stop_list->string_capacity);
+    stop_list_rehash(stop_list);
+    return true;
+}
+
+uint16_t stop_list_dedup_ratio(StopList *stop_list) {
+    if (stop_list->string_size == 0)
+        return 100;
+    return (stop_list->string_requested * 100) / stop_list->string_size;
+}
+
+void stop_list_set_memory_budget(uint32_t max_bytes, uint32_t min_heap_free_bytes) {
+    memory_budget = max_bytes;
+    min_heap_free = min_heap_free_bytes;
+}
+
+const StopListMemory *stop_list_memory(void) {
+    return &memory;
+}
+
+uint32_t stop_list_section_bytes(StopList *stop_list, uint16_t section_index) {
+    StopSection *section = stop_list_get_section(stop_list, section_index);
+    if (section == NULL)
+        return 0;
+    uint32_t bytes = section->stop_count * sizeof(Stop);
+    for (int i = 0; i < section->stop_count; i++) {
+        Stop *stop = &stop_list->stops[section->first_stop + i];
+        if (!stop->received)
+            continue;
+        StringRef refs[STOP_STRING_COUNT] = { stop->route_tag, stop->route_title, stop->direction_tag, stop->direction_title };
+        for (int j = 0; j < STOP_STRING_COUNT; j++) {
+            if (refs[j] != STRING_NONE)
+                bytes += strlen(stop_list->strings + refs[j]) + 1;
+        }
+    }
+    return bytes;
+}
+
+void dump_stop_list_memory(void) {
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Stop lists hold %lu bytes, at most %lu, in %lu allocations; heap free at least %lu bytes; %d sections evicted",
+            (unsigned long) memory.allocated, (unsigned long) memory.allocated_peak, (unsigned long) memory.allocations,
+            (unsigned long) memory.heap_free_low, memory.evictions);
+}
+
+void dump_stop_list(StopList *stop_list) {
+    if (stop_list == NULL) {
         APP_LOG(APP_LOG_LEVEL_DEBUG, "Can't dump NULL stop_list");
+        return;
+    }
 
     APP_LOG(APP_LOG_LEVEL_DEBUG, "====== Dumping stop_list ======");
 
     for (int i = 0; i < stop_list->section_count; i++) {
-        StopSection *section = stop_list->sections[i];
-        APP_LOG(APP_LOG_LEVEL_DEBUG, "sections[%d]: {stop_tag: \"%s\", stop_title: \"%s\"}",
-                i, section->stop_tag, section->stop_title);
+        StopSection *section = stop_list_get_section(stop_list, i);
+        if (section == NULL)
+            continue;
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "sections[%d]: {stop_tag: \"%s\", stop_title: \"%s\", bytes: %lu}",
+                i, stop_list_string(stop_list, section->stop_tag), stop_list_string(stop_list, section->stop_title),
+                (unsigned long) stop_list_section_bytes(stop_list, i));
         for (int j = 0; j < section->stop_count; j++) {
-            Stop *stop = section->stops[j];
+            Stop *stop = stop_list_get_stop(stop_list, i, j);
+            if (stop == NULL)
+                continue;
             APP_LOG(APP_LOG_LEVEL_DEBUG, "stops[%d]: {route_tag: \"%s\", route_title: \"%s\",",
-                    j, stop->route_tag, stop->route_title);
+                    j, stop_list_string(stop_list, stop->route_tag), stop_list_string(stop_list, stop->route_title));
             APP_LOG(APP_LOG_LEVEL_DEBUG, "direction_tag: \"%s\", direction_title: \"%s\"}",
-                    stop->direction_tag, stop->direction_title);
+                    stop_list_string(stop_list, stop->direction_tag), stop_list_string(stop_list, stop->direction_title));
         }
     }
 
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "%d stops and %d bytes of strings in %d bytes",
+            stop_list->stop_count, stop_list->string_size,
+            (int) (stop_list->strings - (char *) stop_list) + stop_list->string_capacity);
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "%d distinct strings, %lu bytes interned into %d (dedup ratio %d%%)",
+            stop_list->string_count, (unsigned long) stop_list->string_requested, stop_list->string_size,
+            stop_list_dedup_ratio(stop_list));
+    dump_stop_list_memory();
     APP_LOG(APP_LOG_LEVEL_DEBUG, "======== End stop_list ========");
 }
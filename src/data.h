@@ -2,36 +2,300 @@
 
 #include <pebble.h>
 
+// Offset of a string in the string blob of a StopList. Offset 0 is always the empty string.
+typedef uint16_t StringRef;
+#define STRING_NONE 0
+
+// Room for a formatted prediction ("~12", "Due") and its label ("minutes"), including the NUL
+#define STOP_PREDICTION_LENGTH 6
+#define STOP_MINUTES_LABEL_LENGTH 8
+
+// Longer countdowns are shown as this many minutes, so they always fit STOP_PREDICTION_LENGTH
+#define PREDICTION_MAX_MINUTES 999
+
+// A prediction is refreshed once it is older than PREDICTION_TTL_SECONDS, or once its bus is due
+// within PREDICTION_DUE_SECONDS and it is older than PREDICTION_DUE_TTL_SECONDS
+#define PREDICTION_TTL_SECONDS 180
+#define PREDICTION_DUE_SECONDS 60
+#define PREDICTION_DUE_TTL_SECONDS 30
+
+// Predictions the phone is less confident of than this, in percent, are shown as approximate
+#define PREDICTION_LOW_CONFIDENCE 50
+
+/*
+ * The next arrival at a stop. It is kept as an absolute time, so the countdown to it can be
+ * shown without asking the phone again.
+ */
+typedef struct Prediction {
+    // Predicted arrival, as a UTC time; 0 if there is no prediction
+    time_t arrival_time;
+    // When the prediction was received, as a UTC time; 0 if it never was
+    time_t predicted_time;
+    // Confidence of the phone in arrival_time, in percent; 0 if unknown
+    uint8_t confidence;
+} Prediction;
+
 typedef struct Stop {
-    char *route_tag;
-    char *route_title;
-    char *direction_tag;
-    char *direction_title;
-    char *prediction;
-    char *minutes_label;
+    StringRef route_tag;
+    StringRef route_title;
+    StringRef direction_tag;
+    StringRef direction_title;
+    // Predictions change all the time, so they are kept in place rather than in the string blob
+    Prediction prediction;
+    // False until the stop has been received
+    bool received;
+    // Changed whenever the stop or its prediction changes, so views of it can be cached
+    uint8_t revision;
 } Stop;
 
 typedef struct StopSection {
     // stop_tag and stop_title are equivalent for each stop in the section
-    char *stop_tag;
-    char *stop_title;
+    StringRef stop_tag;
+    StringRef stop_title;
     uint16_t stop_count;
-    Stop **stops;
+    // Number of stops received so far
+    uint16_t loaded_count;
+    // Index of the first stop of the section in the stop records of the list
+    uint16_t first_stop;
+    // Generation (content hash) of the section from the phone; 0 if unknown
+    uint32_t generation;
+    // False until the section has been received
+    bool received;
 } StopSection;
 
+/*
+ * A slot of the tag index of a StopList: the position of a stop in the list, or
+ * STOP_INDEX_EMPTY in section_index if the slot is free
+ */
+typedef struct StopIndexSlot {
+    uint16_t section_index;
+    uint16_t stop_index;
+} StopIndexSlot;
+#define STOP_INDEX_EMPTY UINT16_MAX
+
+/*
+ * A list of stops by section, held in a single allocation:
+ *
+ *   StopList | sections[section_count] | stops[stop_capacity] | intern_slots[intern_capacity] |
+ *   index_slots[index_capacity] | strings[string_capacity]
+ *
+ * Records refer to strings by offset into the string blob, so the whole list can be moved by
+ * realloc when it grows. Functions which may grow the list take a StopList ** and update it;
+ * pointers to sections and stops are invalidated by any such call.
+ *
+ * Each distinct string is stored once: intern_slots is an open-addressing hash table of the
+ * offsets of the strings in the blob, so a route or direction title shared by many stops
+ * costs its bytes only once.
+ *
+ * index_slots is an open-addressing hash table of the received stops by the stop tag of their
+ * section and their route tag, so a prediction which names its stop finds it without a scan of
+ * the list. Since strings are interned, it is keyed by the pair of their offsets. Its capacity
+ * follows the stop capacity, and it is rebuilt whenever the strings move.
+ */
 typedef struct StopList {
+    // Generation of the whole list from the phone; 0 if unknown
+    uint32_t generation;
     uint16_t section_count;
-    StopSection **sections;
+    // Stop records reserved by received sections, and stop records allocated
+    uint16_t stop_count;
+    uint16_t stop_capacity;
+    // Slots in the intern table (a power of two), and distinct strings stored
+    uint16_t intern_capacity;
+    uint16_t string_count;
+    // Slots in the tag index (a power of two)
+    uint16_t index_capacity;
+    // Bytes of the string blob in use, and bytes allocated
+    uint16_t string_size;
+    uint16_t string_capacity;
+    // Bytes of strings stored into the list, before deduplication
+    uint32_t string_requested;
+    StopSection *sections;
+    Stop *stops;
+    StringRef *intern_slots;
+    StopIndexSlot *index_slots;
+    char *strings;
 } StopList;
 
+/*
+ * A contiguous part of a stop list. A list is saved and restored as the regions given by
+ * stop_list_get_regions, so it never needs to be copied.
+ */
+typedef struct StopListRegion {
+    void *data;
+    uint16_t size;
+} StopListRegion;
+#define STOP_LIST_REGION_COUNT 3
+
 void stop_list_destroy(StopList *stop_list);
 
-StopList *stop_list_create(uint16_t section_count);
+/*
+ * Create a stop list with section_count sections, sized for stop_count stops in total.
+ * If stop_count is 0, it is estimated from section_count. Return NULL if out of memory.
+ */
+StopList *stop_list_create(uint16_t section_count, uint16_t stop_count);
+
+/*
+ * Return a copy of the list, or NULL if out of memory.
+ */
+StopList *stop_list_copy(StopList *stop_list);
+
+/*
+ * A string given by its bytes and length, not necessarily NUL-terminated
+ */
+typedef struct StringSlice {
+    const char *data;
+    uint16_t length;
+} StringSlice;
+#define STOP_STRING_COUNT 4
+
+StopSection *stop_list_add_section(StopList **stop_list, uint16_t section_index, char *stop_tag, char *stop_title, uint16_t stop_count);
+
+/*
+ * Same as stop_list_add_section, with the stop tag and title given as slices.
+ */
+StopSection *stop_list_add_section_slices(StopList **stop_list, uint16_t section_index, StringSlice stop_tag, StringSlice stop_title, uint16_t stop_count);
+
+Stop *section_add_stop(StopList **stop_list, uint16_t section_index, uint16_t stop_index, char *route_tag, char *route_title, char *direction_tag, char *direction_title);
+
+/*
+ * Same as section_add_stop, with the route tag, route title, direction tag and direction title
+ * given as slices, in that order, so they can be copied straight out of a message.
+ */
+Stop *section_add_stop_slices(StopList **stop_list, uint16_t section_index, uint16_t stop_index, const StringSlice strings[STOP_STRING_COUNT]);
+
+/*
+ * Copy a prediction into the stop at stop_index in the section at section_index, and change its
+ * revision if its arrival differs. This never allocates or moves the list.
+ * Return NULL if the stop has not been received.
+ */
+Stop *stop_set_prediction(StopList *stop_list, uint16_t section_index, uint16_t stop_index, const Prediction *prediction);
+
+/*
+ * Find the first received stop with the given route tag in a section with the given stop tag,
+ * in constant time, and set section_index and stop_index to its position.
+ * Return false if there is none.
+ */
+bool stop_list_find_stop(StopList *stop_list, const char *stop_tag, const char *route_tag, uint16_t *section_index, uint16_t *stop_index);
+
+/*
+ * Copy a prediction into every received stop with the given route tag in a section with the
+ * given stop tag, as stop_set_prediction does. Return the number of stops updated.
+ */
+uint16_t stop_list_set_prediction_by_tags(StopList *stop_list, const char *stop_tag, const char *route_tag, const Prediction *prediction);
+
+/*
+ * Format the countdown to the predicted arrival at the stop as of now, such as "12" "minutes",
+ * "~3" "minutes" for a prediction of low confidence, or "Due" "". Return false, with both
+ * empty, if there is no prediction or the bus has already come.
+ */
+bool stop_format_prediction(const Stop *stop, time_t now, char prediction[STOP_PREDICTION_LENGTH], char minutes_label[STOP_MINUTES_LABEL_LENGTH]);
+
+/*
+ * Return true if the prediction of the stop should be requested again as of now: it has never
+ * been received, it has outlived PREDICTION_TTL_SECONDS, or its bus is due.
+ */
+bool stop_prediction_is_stale(const Stop *stop, time_t now);
+
+/*
+ * Rearrange the list into section_count sections with the given generations. A new section
+ * whose generation (if not 0) matches a received section takes over that section, with its
+ * stops and strings, wherever it was; the other new sections are not yet received. The stops
+ * and strings of sections which are dropped are released. This may move the list.
+ * Return false if out of memory; the list must then be destroyed.
+ */
+bool stop_list_splice(StopList **stop_list, uint16_t section_count, const uint32_t *generations);
+
+/*
+ * Forget the stops of the section at section_index, keeping the section itself, so they can be
+ * received again later. Their strings are released into the string blob for other stops to use;
+ * the stop records stay reserved. This never moves the list.
+ */
+void stop_list_evict_section(StopList *stop_list, uint16_t section_index);
+
+/*
+ * Return the number of leading sections of the list which have been received, with or without their stops.
+ */
+uint16_t stop_list_received_prefix(StopList *stop_list);
+
+/*
+ * Return the number of leading sections of the list which have been received with all their stops.
+ */
+uint16_t stop_list_complete_prefix(StopList *stop_list);
+
+/*
+ * Return true if every section and every stop of the stop list has been received.
+ */
+bool stop_list_is_complete(StopList *stop_list);
+
+/*
+ * Return the section at section_index, or NULL if it has not been received.
+ */
+StopSection *stop_list_get_section(StopList *stop_list, uint16_t section_index);
+
+/*
+ * Return the stop at stop_index in the section at section_index, or NULL if it has not been received.
+ */
+Stop *stop_list_get_stop(StopList *stop_list, uint16_t section_index, uint16_t stop_index);
+
+/*
+ * Return the string referenced by ref.
+ */
+const char *stop_list_string(StopList *stop_list, StringRef ref);
+
+/*
+ * Return the bytes of strings stored into the list per byte of string blob used, in percent.
+ * 100 means no string was repeated; 300 means interning saved two thirds of the string bytes.
+ */
+uint16_t stop_list_dedup_ratio(StopList *stop_list);
+
+/*
+ * Fill regions with the sections, stops and strings of the list, in that order.
+ */
+void stop_list_get_regions(StopList *stop_list, StopListRegion regions[STOP_LIST_REGION_COUNT]);
+
+/*
+ * Create a list with exactly the given counts, whose regions are to be filled by the caller
+ * and then checked by stop_list_finish_restore. Return NULL if out of memory.
+ */
+StopList *stop_list_begin_restore(uint16_t section_count, uint16_t stop_count, uint16_t string_size);
+
+/*
+ * Check that a list filled after stop_list_begin_restore is consistent, and rebuild its
+ * intern table. Predictions are stale once restored, so they are cleared.
+ * This may move the list. Return false if the list is inconsistent; it must then be destroyed.
+ */
+bool stop_list_finish_restore(StopList **stop_list);
+
+/*
+ * Memory held by all stop lists together, for sizing lists per watch model
+ */
+typedef struct StopListMemory {
+    // Bytes allocated now, and at most so far
+    uint32_t allocated;
+    uint32_t allocated_peak;
+    // Least heap_bytes_free() seen after a stop list allocation
+    uint32_t heap_free_low;
+    // Stop list allocations and reallocations made so far
+    uint32_t allocations;
+    // Sections whose stops were evicted by stop_list_evict_section
+    uint16_t evictions;
+} StopListMemory;
+
+/*
+ * Bound the memory of all stop lists together: a list never grows past max_bytes in total, or
+ * so that less than min_heap_free_bytes of heap would be left. Growth past either fails like
+ * running out of memory. By default there is no byte budget, and 1 KB of heap is left free.
+ */
+void stop_list_set_memory_budget(uint32_t max_bytes, uint32_t min_heap_free_bytes);
 
-StopSection *stop_list_add_section(StopList *stop_list, uint16_t section_index, char *stop_tag, char *stop_title, uint16_t stop_count);
+const StopListMemory *stop_list_memory(void);
 
-Stop *section_add_stop(StopSection *section, uint16_t stop_index, char *route_tag, char *route_title, char *direction_tag, char *direction_title);
+/*
+ * Return the bytes of stop records and strings used by the section at section_index. Strings
+ * shared with other sections are counted in each. Evicting the section releases its strings.
+ */
+uint32_t stop_list_section_bytes(StopList *stop_list, uint16_t section_index);
 
-Stop *stop_set_prediction(Stop *stop, char *prediction, char *minutes_label);
+void dump_stop_list_memory(void);
 
 void dump_stop_list(StopList *stop_list);
@@ -0,0 +1,1129 @@
+/*
+ * The phone side of the protocol in src/protocol.h: answers the requests of the watch with the
+ * stops near the phone and their predictions, fetched from an upstream prediction server.
+ *
+ * Upstream requests are the slow part, so each is made as rarely as possible: the predictions
+ * of a stop are fetched once for all of its routes, responses are cached for a few seconds, and
+ * watch requests which arrive while a fetch is in flight wait for that fetch rather than making
+ * their own. Replies are packed with as many records as fit the inbox of the watch.
+ *
+ * The companion runs under PebbleKit JS, and also under Node, where the transport, clock and
+ * send function are injected (see Companion), so it can be run against a local mock server; its
+ * tests are in test/js.
+ *
+ * The upstream server is expected to answer:
+ *
+ *   GET {upstream}/stops?lat={lat}&lon={lon}
+ *     { "sections": [ { "tag", "title", "stops": [ { "route_tag", "route_title",
+ *                                                    "direction_tag", "direction_title" } ] } ] }
+ *   GET {upstream}/predictions?stop_tag={tag}
+ *     { "predictions": [ { "route_tag", "direction_tag", "arrival_time", "confidence" } ] }
+ *
+ * where arrival_time is a UTC time in seconds and confidence is in percent, and may be left out.
+ * The upstream server is set on the configuration page of the app, opened from the Pebble app.
+ */
+
+/****
+ ** PROTOCOL
+ ****/
+
+// Message fields; see MESSAGE_FIELDS in protocol.h
+var Key = {
+    MESSAGE_TYPE: 0,
+    SECTION_INDEX: 1,
+    SECTION_COUNT: 2,
+    SECTION_STOP_TAG: 3,
+    SECTION_STOP_TITLE: 4,
+    SECTION_STOP_COUNT: 5,
+    SECTION_STOP_INDEX: 6,
+    STOP_ROUTE_TAG: 7,
+    STOP_ROUTE_TITLE: 8,
+    STOP_DIRECTION_TAG: 9,
+    STOP_DIRECTION_TITLE: 10,
+    STOP_PREDICTION: 11,
+    STOP_MINUTES_LABEL: 12,
+    PROTOCOL_CAPABILITIES: 13,
+    INBOX_SIZE: 14,
+    STOP_RECORD_COUNT: 15,
+    REQUEST_SEQUENCE: 16,
+    LIST_GENERATION: 17,
+    SECTION_GENERATIONS: 18,
+    PREDICTION_INTERVAL: 19,
+    METRICS_SYNC: 20,
+    STOP_RECORDS: 21,
+    SECTION_HEADERS: 22,
+    ARRIVALS: 23
+};
+
+// Message types; see MESSAGE_TYPES in protocol.h
+var MessageType = {
+    REQUEST_SECTIONS_METADATA: 0,
+    REQUEST_SECTION_DATA: 1,
+    REQUEST_STOP_DATA: 2,
+    REQUEST_STOP_PREDICTION: 3,
+    SECTIONS_METADATA: 4,
+    SECTION_DATA: 5,
+    STOP_DATA: 6,
+    STOP_PREDICTION: 7,
+    SUBSCRIBE_STOP_PREDICTION: 8,
+    UNSUBSCRIBE_STOP_PREDICTION: 9,
+    REQUEST_SECTION_PREDICTIONS: 10,
+    SECTION_PREDICTIONS: 11,
+    REQUEST_METRICS: 12,
+    METRICS: 13
+};
+
+// Protocol capabilities; see protocol.h
+var Capability = {
+    BATCHED_STOPS: 1 << 0,
+    SEQUENCED_REQUESTS: 1 << 1,
+    SECTION_GENERATIONS: 1 << 2,
+    PREDICTION_SUBSCRIPTIONS: 1 << 3,
+    SECTION_PREDICTIONS: 1 << 4,
+    BINARY_RECORDS: 1 << 5,
+    SECTION_HEADERS: 1 << 6,
+    ARRIVAL_TIMES: 1 << 7
+};
+// Every capability is supported by the companion
+var SUPPORTED_CAPABILITIES = 0xff;
+
+// Batched stop records and prediction records; see protocol.h
+var STOP_RECORD_BASE = 1000;
+var STOP_RECORD_FIELD_COUNT = 4;
+var PREDICTION_RECORD_BASE = 2000;
+var PREDICTION_RECORD_FIELD_COUNT = 2;
+
+// Metrics records; see metrics.h
+var METRICS_RECORD_BASE = 3000;
+var METRICS_FAILURE_BASE = 3100;
+var METRICS_LATENCY_BUCKET_COUNT = 8;
+
+// Binary records; see records.h
+var RECORD_FORMAT_VERSION = 1;
+
+// APP_MESSAGE_INBOX_SIZE_MINIMUM, for watches which don't send INBOX_SIZE
+var DEFAULT_INBOX_SIZE = 124;
+
+// Bytes of a dictionary header, and of the header of each tuple
+var DICT_HEADER_SIZE = 1;
+var TUPLE_HEADER_SIZE = 7;
+
+/****
+ ** TUNING
+ ****/
+
+// Upstream server until another is set on the configuration page
+var DEFAULT_UPSTREAM_URL = 'http://localhost:8080';
+
+// How long upstream responses are reused, in ms
+var STOPS_TTL_MS = 60 * 1000;
+var PREDICTIONS_TTL_MS = 15 * 1000;
+
+// Subscribed stops are polled at the interval the watch asks for, but never more often than this, in s
+var MIN_PREDICTION_INTERVAL_SECONDS = 15;
+
+// Failed sends to the watch are retried this many times, after SEND_RETRY_MS times the attempt
+var MAX_SEND_ATTEMPTS = 3;
+var SEND_RETRY_MS = 500;
+
+// Predictions of buses which came longer ago than this, in s, are skipped
+var ARRIVAL_GRACE_SECONDS = 60;
+
+/****
+ ** ENCODING
+ ****/
+
+/*
+ * Return the UTF-8 bytes of a string, as an array of numbers
+ */
+function utf8Bytes(string) {
+    var encoded = unescape(encodeURIComponent(string));
+    var bytes = new Array(encoded.length);
+    for (var i = 0; i < encoded.length; i++)
+        bytes[i] = encoded.charCodeAt(i);
+    return bytes;
+}
+
+/*
+ * Return the size of the value of a tuple as sent to the watch: strings are sent with a NUL,
+ * and numbers as 32-bit integers
+ */
+function valueSize(value) {
+    if (typeof value === 'number')
+        return 4;
+    if (typeof value === 'string')
+        return utf8Bytes(value).length + 1;
+    return value.length;
+}
+
+/*
+ * Return the size of a dictionary as received by the watch, for packing messages into its inbox
+ */
+function dictionarySize(dict) {
+    var size = DICT_HEADER_SIZE;
+    for (var key in dict) {
+        if (dict.hasOwnProperty(key))
+            size += TUPLE_HEADER_SIZE + valueSize(dict[key]);
+    }
+    return size;
+}
+
+/*
+ * A byte array of binary records, written as in records.h
+ */
+function RecordWriter() {
+    this.bytes = [];
+}
+
+/*
+ * Write an unsigned LEB128 varint
+ */
+RecordWriter.prototype.writeVarint = function (value) {
+    value = Math.max(0, Math.floor(value));
+    while (value >= 0x80) {
+        this.bytes.push((value % 0x80) | 0x80);
+        value = Math.floor(value / 0x80);
+    }
+    this.bytes.push(value);
+    return this;
+};
+
+/*
+ * Write a string as a varint length followed by its UTF-8 bytes
+ */
+RecordWriter.prototype.writeString = function (string) {
+    var bytes = utf8Bytes(string || '');
+    this.writeVarint(bytes.length);
+    for (var i = 0; i < bytes.length; i++)
+        this.bytes.push(bytes[i]);
+    return this;
+};
+
+RecordWriter.prototype.length = function () {
+    return this.bytes.length;
+};
+
+/*
+ * Return the bytes of a uint32_t array, little-endian
+ */
+function uint32Bytes(values) {
+    var bytes = [];
+    for (var i = 0; i < values.length; i++) {
+        var value = values[i];
+        bytes.push(value & 0xff, (value >>> 8) & 0xff, (value >>> 16) & 0xff, (value >>> 24) & 0xff);
+    }
+    return bytes;
+}
+
+/*
+ * Read the uint32_t or uint16_t at offset of a byte array, little-endian
+ */
+function readUint32(bytes, offset) {
+    return (bytes[offset] | (bytes[offset + 1] << 8) | (bytes[offset + 2] << 16)) + bytes[offset + 3] * 0x1000000;
+}
+
+function readUint16(bytes, offset) {
+    return bytes[offset] | (bytes[offset + 1] << 8);
+}
+
+/*
+ * Return a generation for the given string: a 31-bit FNV-1a hash which is never 0. Generations
+ * are sent as integers, which PebbleKit JS sends signed, so they stay below 2^31.
+ */
+function generationOf(string) {
+    var hash = 0x811c9dc5;
+    for (var i = 0; i < string.length; i++) {
+        hash ^= string.charCodeAt(i);
+        hash = (hash + (hash << 1) + (hash << 4) + (hash << 7) + (hash << 8) + (hash << 24)) >>> 0;
+    }
+    return (hash & 0x7fffffff) || 1;
+}
+
+/****
+ ** UPSTREAM
+ ****/
+
+/*
+ * The default transport: GET url with XMLHttpRequest and pass the parsed JSON to callback
+ */
+function xhrTransport(url, callback) {
+    var request = new XMLHttpRequest();
+    request.onload = function () {
+        if (request.status !== 200)
+            return callback(new Error('HTTP ' + request.status + ' for ' + url));
+        var body;
+        try {
+            body = JSON.parse(request.responseText);
+        } catch (e) {
+            return callback(e);
+        }
+        callback(null, body);
+    };
+    request.onerror = function () {
+        callback(new Error('Request failed for ' + url));
+    };
+    request.open('GET', url, true);
+    request.send();
+}
+
+/*
+ * Fetches upstream responses through a cache. A response is reused for the ttl it was fetched
+ * with; fetches of a URL already in flight are coalesced with it, so concurrent requests for
+ * the same stop make a single upstream request. Failures are not cached.
+ */
+function Fetcher(transport, clock) {
+    this.transport = transport;
+    this.clock = clock;
+    this.cache = {};
+    this.inflight = {};
+    this.stats = { fetches: 0, hits: 0, coalesced: 0, failures: 0 };
+}
+
+/*
+ * Pass the response for url to callback(error, body), fetching it if there is none younger than ttl ms
+ */
+Fetcher.prototype.get = function (url, ttl, callback) {
+    var cached = this.cache[url];
+    if (cached && this.clock() - cached.fetched < ttl) {
+        this.stats.hits++;
+        return callback(null, cached.body);
+    }
+
+    var waiting = this.inflight[url];
+    if (waiting) {
+        this.stats.coalesced++;
+        waiting.push(callback);
+        return;
+    }
+    waiting = this.inflight[url] = [callback];
+    this.stats.fetches++;
+
+    var fetcher = this;
+    this.transport(url, function (error, body) {
+        delete fetcher.inflight[url];
+        if (error)
+            fetcher.stats.failures++;
+        else
+            fetcher.cache[url] = { fetched: fetcher.clock(), body: body };
+        for (var i = 0; i < waiting.length; i++)
+            waiting[i](error, body);
+    });
+};
+
+/*
+ * Drop the cached responses older than the longest ttl
+ */
+Fetcher.prototype.prune = function (ttl) {
+    var now = this.clock();
+    for (var url in this.cache) {
+        if (this.cache.hasOwnProperty(url) && now - this.cache[url].fetched >= ttl)
+            delete this.cache[url];
+    }
+};
+
+/****
+ ** OUTBOX
+ ****/
+
+/*
+ * Sends messages to the watch one at a time, in order, retrying those which fail. The watch
+ * inbox holds a single message, so the next goes out once the last is acknowledged.
+ */
+function Outbox(send, setTimer) {
+    this.send = send;
+    this.setTimer = setTimer;
+    this.queue = [];
+    this.busy = false;
+    this.stats = { sent: 0, failed: 0, bytes: 0 };
+}
+
+/*
+ * Queue dict, and call done, if given, once it has been sent
+ */
+Outbox.prototype.push = function (dict, done) {
+    this.queue.push({ dict: dict, attempts: 0, done: done });
+    this.pump();
+};
+
+Outbox.prototype.pump = function () {
+    if (this.busy || this.queue.length === 0)
+        return;
+    var outbox = this;
+    var message = this.queue[0];
+    this.busy = true;
+    message.attempts++;
+    this.send(message.dict, function () {
+        outbox.queue.shift();
+        outbox.busy = false;
+        outbox.stats.sent++;
+        outbox.stats.bytes += dictionarySize(message.dict);
+        if (message.done)
+            message.done();
+        outbox.pump();
+    }, function (error) {
+        outbox.stats.failed++;
+        if (message.attempts >= MAX_SEND_ATTEMPTS) {
+            console.log('Dropping message type ' + message.dict[Key.MESSAGE_TYPE] + ' after ' +
+                        message.attempts + ' attempts: ' + (error && error.error ? error.error.message : error));
+            outbox.queue.shift();
+            outbox.busy = false;
+            outbox.pump();
+            return;
+        }
+        outbox.setTimer(function () {
+            outbox.busy = false;
+            outbox.pump();
+        }, SEND_RETRY_MS * message.attempts);
+    });
+};
+
+/****
+ ** COMPANION
+ ****/
+
+/*
+ * The companion, with these options, each of which has a default under PebbleKit JS:
+ *
+ *   send(dict, onSuccess, onFailure)  sends a message to the watch
+ *   transport(url, callback)          GETs url, passing callback(error, json)
+ *   locate(callback)                  passes callback the { lat, lon } of the phone, or null
+ *   now()                             returns the time in ms
+ *   setTimeout, clearTimeout          schedule work
+ *   upstream                          base URL of the upstream server
+ */
+function Companion(options) {
+    options = options || {};
+    this.now = options.now || function () { return Date.now(); };
+    this.setTimer = options.setTimeout || function (f, ms) { return setTimeout(f, ms); };
+    this.clearTimer = options.clearTimeout || function (timer) { clearTimeout(timer); };
+    this.upstream = options.upstream || DEFAULT_UPSTREAM_URL;
+    this.locate = options.locate || locateWithGeolocation;
+
+    this.fetcher = new Fetcher(options.transport || xhrTransport, this.now);
+    this.outbox = new Outbox(options.send || sendWithPebble, this.setTimer);
+
+    // Negotiated with the last MESSAGE_REQUEST_SECTIONS_METADATA
+    this.capabilities = 0;
+    this.inboxSize = DEFAULT_INBOX_SIZE;
+
+    // The stop list the watch is syncing, as of the last MESSAGE_SECTIONS_METADATA sent, so
+    // indices stay stable through a sync even if the list upstream changes
+    this.list = null;
+
+    this.subscription = null;
+
+    // Whether the metrics of the sync of this.list have been asked for
+    this.metricsRequested = false;
+
+    // Latency from a request of the watch to its reply being sent, by request type, in ms
+    this.latency = {};
+    this.metrics = null;
+}
+
+/*
+ * Handle a message from the watch, by the payload of its appmessage event
+ */
+Companion.prototype.receive = function (payload) {
+    var message = {};
+    for (var key in payload) {
+        if (payload.hasOwnProperty(key))
+            message[Number(key)] = payload[key];
+    }
+    var type = message[Key.MESSAGE_TYPE];
+    var received = this.now();
+    var companion = this;
+    var reply = function (dict, done) {
+        companion.reply(message, dict, received, done);
+    };
+
+    switch (type) {
+        case MessageType.REQUEST_SECTIONS_METADATA:
+            return this.onRequestSectionsMetadata(message, reply);
+        case MessageType.REQUEST_SECTION_DATA:
+            return this.onRequestSectionData(message, reply);
+        case MessageType.REQUEST_STOP_DATA:
+            return this.onRequestStopData(message, reply);
+        case MessageType.REQUEST_STOP_PREDICTION:
+            return this.onRequestStopPrediction(message, reply);
+        case MessageType.SUBSCRIBE_STOP_PREDICTION:
+            return this.onSubscribe(message);
+        case MessageType.UNSUBSCRIBE_STOP_PREDICTION:
+            return this.unsubscribe();
+        case MessageType.REQUEST_SECTION_PREDICTIONS:
+            return this.onRequestSectionPredictions(message, reply);
+        case MessageType.METRICS:
+            return this.onMetrics(message);
+        default:
+            console.log('Unknown message type ' + type);
+    }
+};
+
+/*
+ * Send dict as the reply to message, echoing its sequence number if the watch matches replies
+ * by it, and count the latency of the reply once it has been sent
+ */
+Companion.prototype.reply = function (message, dict, received, done) {
+    if ((this.capabilities & Capability.SEQUENCED_REQUESTS) && message[Key.REQUEST_SEQUENCE] !== undefined)
+        dict[Key.REQUEST_SEQUENCE] = message[Key.REQUEST_SEQUENCE];
+    var companion = this;
+    var type = message[Key.MESSAGE_TYPE];
+    this.outbox.push(dict, function () {
+        var latency = companion.latency[type] || (companion.latency[type] = { count: 0, total: 0, max: 0 });
+        var ms = companion.now() - received;
+        latency.count++;
+        latency.total += ms;
+        latency.max = Math.max(latency.max, ms);
+        if (done)
+            done();
+    });
+};
+
+/*
+ * Return the size left in the inbox of the watch once dict, and the sequence number echoed
+ * by reply, are in it
+ */
+Companion.prototype.roomLeft = function (dict) {
+    var sequenceSize = (this.capabilities & Capability.SEQUENCED_REQUESTS) ? TUPLE_HEADER_SIZE + valueSize(0) : 0;
+    return this.inboxSize - dictionarySize(dict) - sequenceSize;
+};
+
+/****
+ ** STOP LIST
+ ****/
+
+/*
+ * Pass the stop list near the phone to callback(error, list), where list holds the sections of
+ * the upstream response along with their generations
+ */
+Companion.prototype.fetchStops = function (callback) {
+    var companion = this;
+    this.locate(function (position) {
+        var url = companion.upstream + '/stops';
+        if (position)
+            url += '?lat=' + position.lat.toFixed(3) + '&lon=' + position.lon.toFixed(3);
+        companion.fetcher.get(url, STOPS_TTL_MS, function (error, body) {
+            if (error || !body || !(body.sections instanceof Array))
+                return callback(error || new Error('Malformed stops from ' + url));
+            callback(null, listOf(body.sections));
+        });
+    });
+};
+
+/*
+ * Return the stop list of the given upstream sections, with a generation for each section and
+ * for the list
+ */
+function listOf(sections) {
+    var list = { sections: [], generations: [], stopCount: 0 };
+    var generations = '';
+    for (var i = 0; i < sections.length; i++) {
+        var section = {
+            tag: String(sections[i].tag),
+            title: String(sections[i].title || ''),
+            stops: (sections[i].stops || []).map(function (stop) {
+                return [String(stop.route_tag || ''), String(stop.route_title || ''),
+                        String(stop.direction_tag || ''), String(stop.direction_title || '')];
+            })
+        };
+        var generation = generationOf(JSON.stringify(section));
+        list.sections.push(section);
+        list.generations.push(generation);
+        list.stopCount += section.stops.length;
+        generations += generation + ',';
+    }
+    list.generation = generationOf(generations);
+    return list;
+}
+
+/*
+ * Negotiate capabilities and answer with the metadata of the stop list, and as many section
+ * headers as fit
+ */
+Companion.prototype.onRequestSectionsMetadata = function (message, reply) {
+    var capabilities = (message[Key.PROTOCOL_CAPABILITIES] || 0) & SUPPORTED_CAPABILITIES;
+    // Binary records are batches, which the watch only requests in batched mode
+    if (!(capabilities & Capability.BATCHED_STOPS))
+        capabilities &= ~Capability.BINARY_RECORDS;
+    this.capabilities = capabilities;
+    this.inboxSize = message[Key.INBOX_SIZE] || DEFAULT_INBOX_SIZE;
+    this.fetcher.prune(STOPS_TTL_MS);
+
+    var companion = this;
+    this.fetchStops(function (error, list) {
+        if (error) {
+            // Answer with an empty list rather than leave the watch to wait out its timeout. It has
+            // no generation or headers to send.
+            console.log('Could not fetch stops: ' + error.message);
+            var empty = {};
+            empty[Key.MESSAGE_TYPE] = MessageType.SECTIONS_METADATA;
+            empty[Key.SECTION_COUNT] = 0;
+            empty[Key.SECTION_STOP_COUNT] = 0;
+            empty[Key.PROTOCOL_CAPABILITIES] =
+                capabilities & ~(Capability.SECTION_GENERATIONS | Capability.SECTION_HEADERS);
+            companion.list = null;
+            return reply(empty);
+        }
+        companion.list = list;
+        companion.metricsRequested = false;
+
+        var dict = {};
+        dict[Key.MESSAGE_TYPE] = MessageType.SECTIONS_METADATA;
+        dict[Key.SECTION_COUNT] = list.sections.length;
+        dict[Key.SECTION_STOP_COUNT] = list.stopCount;
+        dict[Key.PROTOCOL_CAPABILITIES] = capabilities;
+        if (capabilities & Capability.SECTION_GENERATIONS) {
+            dict[Key.LIST_GENERATION] = list.generation;
+            dict[Key.SECTION_GENERATIONS] = uint32Bytes(list.generations);
+        }
+
+        // The watch already holds the sections of its last list which haven't changed, so
+        // headers are only worth sending when it syncs a new list
+        if ((capabilities & Capability.SECTION_HEADERS) && message[Key.LIST_GENERATION] !== list.generation) {
+            var headers = packRecords(companion.roomLeft(dict) - TUPLE_HEADER_SIZE, [0], list.sections,
+                                      function (writer, section) {
+                writer.writeString(section.tag).writeString(section.title).writeVarint(section.stops.length);
+            });
+            if (headers)
+                dict[Key.SECTION_HEADERS] = headers.bytes;
+        }
+        reply(dict);
+
+        // An empty list, or one the watch already holds, has nothing more to sync
+        if (list.sections.length === 0 ||
+                ((capabilities & Capability.SECTION_GENERATIONS) && message[Key.LIST_GENERATION] === list.generation))
+            companion.sentStops(list.sections.length - 1, Infinity);
+    });
+};
+
+/*
+ * Pack as many records from items as fit in size bytes, after a header of the version, the
+ * given fields and the record count. Return { bytes, count }, or null if not even one fits.
+ */
+function packRecords(size, fields, items, write) {
+    var records = new RecordWriter();
+    var count = 0;
+    for (var i = 0; i < items.length; i++) {
+        var record = new RecordWriter();
+        write(record, items[i], i);
+        if (headerOf(fields, count + 1).length() + records.length() + record.length() > size)
+            break;
+        records.bytes = records.bytes.concat(record.bytes);
+        count++;
+    }
+    if (count === 0)
+        return null;
+    return { bytes: headerOf(fields, count).bytes.concat(records.bytes), count: count };
+}
+
+function headerOf(fields, count) {
+    var header = new RecordWriter().writeVarint(RECORD_FORMAT_VERSION);
+    for (var i = 0; i < fields.length; i++)
+        header.writeVarint(fields[i]);
+    return header.writeVarint(count);
+}
+
+/*
+ * Return the section of the list at index, or null
+ */
+Companion.prototype.sectionAt = function (index) {
+    if (!this.list || index === undefined || index >= this.list.sections.length)
+        return null;
+    return this.list.sections[index];
+};
+
+/*
+ * Add as many stops of section from firstStop on as fit to dict, in the form negotiated.
+ * Return the number of stops added.
+ */
+Companion.prototype.packStops = function (dict, sectionIndex, section, firstStop) {
+    var stops = section.stops.slice(firstStop);
+    if (this.capabilities & Capability.BINARY_RECORDS) {
+        var records = packRecords(this.roomLeft(dict) - TUPLE_HEADER_SIZE, [sectionIndex, firstStop], stops,
+                                  function (writer, stop) {
+            for (var f = 0; f < STOP_RECORD_FIELD_COUNT; f++)
+                writer.writeString(stop[f]);
+        });
+        if (!records)
+            return 0;
+        dict[Key.STOP_RECORDS] = records.bytes;
+        return records.count;
+    }
+
+    dict[Key.SECTION_STOP_INDEX] = firstStop;
+    dict[Key.STOP_RECORD_COUNT] = 0;
+    var room = this.roomLeft(dict);
+    for (var i = 0; i < stops.length; i++) {
+        var size = 0;
+        for (var f = 0; f < STOP_RECORD_FIELD_COUNT; f++)
+            size += TUPLE_HEADER_SIZE + valueSize(stops[i][f]);
+        if (size > room)
+            break;
+        room -= size;
+        for (f = 0; f < STOP_RECORD_FIELD_COUNT; f++)
+            dict[STOP_RECORD_BASE + i * STOP_RECORD_FIELD_COUNT + f] = stops[i][f];
+        dict[Key.STOP_RECORD_COUNT] = i + 1;
+    }
+    return dict[Key.STOP_RECORD_COUNT];
+};
+
+/*
+ * Note that the stops of the section at sectionIndex up to end have been sent. Once the last
+ * stop of the list has, the sync of the watch is complete; ask it for its metrics, once a list.
+ */
+Companion.prototype.sentStops = function (sectionIndex, end) {
+    if (!this.list || this.metricsRequested)
+        return;
+    var last = this.list.sections.length - 1;
+    if (sectionIndex !== last || (last >= 0 && end < this.list.sections[last].stops.length))
+        return;
+    this.metricsRequested = true;
+    this.requestMetrics();
+};
+
+/*
+ * Answer with the header of a section and, in batched mode, as many of its stops as fit
+ */
+Companion.prototype.onRequestSectionData = function (message, reply) {
+    var sectionIndex = message[Key.SECTION_INDEX];
+    var section = this.sectionAt(sectionIndex);
+    if (!section) {
+        console.log('No section with section_index == ' + sectionIndex);
+        return;
+    }
+
+    var dict = {};
+    dict[Key.MESSAGE_TYPE] = MessageType.SECTION_DATA;
+    dict[Key.SECTION_INDEX] = sectionIndex;
+    dict[Key.SECTION_STOP_TAG] = section.tag;
+    dict[Key.SECTION_STOP_TITLE] = section.title;
+    dict[Key.SECTION_STOP_COUNT] = section.stops.length;
+    var count = 0;
+    if ((this.capabilities & Capability.BATCHED_STOPS) && section.stops.length > 0)
+        count = this.packStops(dict, sectionIndex, section, 0);
+    reply(dict);
+    this.sentStops(sectionIndex, count);
+};
+
+/*
+ * Answer with a stop or, in batched mode, as many stops from it on as fit
+ */
+Companion.prototype.onRequestStopData = function (message, reply) {
+    var sectionIndex = message[Key.SECTION_INDEX];
+    var stopIndex = message[Key.SECTION_STOP_INDEX];
+    var section = this.sectionAt(sectionIndex);
+    if (!section || stopIndex >= section.stops.length) {
+        console.log('No stop with section_index == ' + sectionIndex + ', stop_index == ' + stopIndex);
+        return;
+    }
+
+    var dict = {};
+    var count = 1;
+    dict[Key.MESSAGE_TYPE] = MessageType.STOP_DATA;
+    if (this.capabilities & Capability.BATCHED_STOPS) {
+        if (!(this.capabilities & Capability.BINARY_RECORDS))
+            dict[Key.SECTION_INDEX] = sectionIndex;
+        count = this.packStops(dict, sectionIndex, section, stopIndex);
+    } else {
+        var stop = section.stops[stopIndex];
+        dict[Key.SECTION_INDEX] = sectionIndex;
+        dict[Key.SECTION_STOP_INDEX] = stopIndex;
+        dict[Key.STOP_ROUTE_TAG] = stop[0];
+        dict[Key.STOP_ROUTE_TITLE] = stop[1];
+        dict[Key.STOP_DIRECTION_TAG] = stop[2];
+        dict[Key.STOP_DIRECTION_TITLE] = stop[3];
+    }
+    reply(dict);
+    this.sentStops(sectionIndex, stopIndex + count);
+};
+
+/****
+ ** PREDICTIONS
+ ****/
+
+/*
+ * Pass the predictions of every route at a stop to callback(error, predictions), fetching them
+ * once for all routes. Each prediction is { route_tag, direction_tag, arrival_time, confidence }.
+ */
+Companion.prototype.fetchPredictions = function (stopTag, callback) {
+    var url = this.upstream + '/predictions?stop_tag=' + encodeURIComponent(stopTag);
+    this.fetcher.get(url, PREDICTIONS_TTL_MS, function (error, body) {
+        if (error || !body || !(body.predictions instanceof Array))
+            return callback(error || new Error('Malformed predictions from ' + url));
+        callback(null, body.predictions);
+    });
+};
+
+/*
+ * Return the next arrival of a route at a stop as { arrival_time, confidence }, where an
+ * arrival_time of 0 means there is none. A direction tag of '' matches any direction.
+ */
+function nextArrival(predictions, routeTag, directionTag, now) {
+    var next = { arrival_time: 0, confidence: 0 };
+    for (var i = 0; i < predictions.length; i++) {
+        var prediction = predictions[i];
+        if (String(prediction.route_tag) !== routeTag)
+            continue;
+        if (directionTag && prediction.direction_tag !== undefined && String(prediction.direction_tag) !== directionTag)
+            continue;
+        var arrival = Math.floor(prediction.arrival_time);
+        if (!(arrival > now - ARRIVAL_GRACE_SECONDS))
+            continue;
+        if (next.arrival_time === 0 || arrival < next.arrival_time) {
+            var confidence = Math.floor(prediction.confidence || 0);
+            next = { arrival_time: arrival, confidence: Math.max(0, Math.min(100, confidence)) };
+        }
+    }
+    return next;
+}
+
+/*
+ * Return the text of an arrival for watches without arrival times, as parsed by the watch:
+ * minutes away and their label, "Due", or "--" if there is none
+ */
+function predictionText(arrival, now) {
+    if (arrival.arrival_time === 0)
+        return ['--', ''];
+    var minutes = Math.floor((arrival.arrival_time - now) / 60);
+    if (minutes <= 0)
+        return ['Due', ''];
+    return [String(minutes), minutes === 1 ? 'minute' : 'minutes'];
+}
+
+/*
+ * Return the route and direction tags of the stop with the given route at the section of the
+ * list with the given stop tag; the direction is '' if the list doesn't know the stop
+ */
+Companion.prototype.directionOf = function (stopTag, routeTag) {
+    var sections = this.list ? this.list.sections : [];
+    for (var i = 0; i < sections.length; i++) {
+        if (sections[i].tag !== stopTag)
+            continue;
+        for (var j = 0; j < sections[i].stops.length; j++) {
+            if (sections[i].stops[j][0] === routeTag)
+                return sections[i].stops[j][2];
+        }
+    }
+    return '';
+};
+
+/*
+ * Pass the next arrival of a route at a stop to callback(arrival), or nothing if it can't be fetched
+ */
+Companion.prototype.predict = function (routeTag, stopTag, callback) {
+    var companion = this;
+    this.fetchPredictions(stopTag, function (error, predictions) {
+        if (error) {
+            console.log('Could not fetch predictions for ' + stopTag + ': ' + error.message);
+            return;
+        }
+        var now = Math.floor(companion.now() / 1000);
+        callback(nextArrival(predictions, routeTag, companion.directionOf(stopTag, routeTag), now), now);
+    });
+};
+
+/*
+ * Add an arrival to a MESSAGE_STOP_PREDICTION, in the form negotiated
+ */
+Companion.prototype.writePrediction = function (dict, arrival, now) {
+    if (this.capabilities & Capability.ARRIVAL_TIMES) {
+        dict[Key.ARRIVALS] = new RecordWriter().writeVarint(RECORD_FORMAT_VERSION).writeVarint(1)
+            .writeVarint(arrival.arrival_time).writeVarint(arrival.confidence).bytes;
+    } else {
+        var text = predictionText(arrival, now);
+        dict[Key.STOP_PREDICTION] = text[0];
+        dict[Key.STOP_MINUTES_LABEL] = text[1];
+    }
+};
+
+Companion.prototype.onRequestStopPrediction = function (message, reply) {
+    var companion = this;
+    this.predict(message[Key.STOP_ROUTE_TAG], message[Key.SECTION_STOP_TAG], function (arrival, now) {
+        var dict = {};
+        dict[Key.MESSAGE_TYPE] = MessageType.STOP_PREDICTION;
+        companion.writePrediction(dict, arrival, now);
+        reply(dict);
+    });
+};
+
+/*
+ * Subscribe the watch to a stop: push its prediction now, then poll it at the interval the
+ * watch asks for, pushing it whenever it changes. Pushed predictions name their stop.
+ */
+Companion.prototype.onSubscribe = function (message) {
+    this.unsubscribe();
+    var interval = Math.max(message[Key.PREDICTION_INTERVAL] || 0, MIN_PREDICTION_INTERVAL_SECONDS);
+    var subscription = this.subscription = {
+        routeTag: message[Key.STOP_ROUTE_TAG],
+        stopTag: message[Key.SECTION_STOP_TAG],
+        last: null,
+        timer: null
+    };
+
+    var companion = this;
+    var poll = function () {
+        if (companion.subscription !== subscription)
+            return;
+        subscription.timer = companion.setTimer(poll, interval * 1000);
+        companion.predict(subscription.routeTag, subscription.stopTag, function (arrival, now) {
+            if (companion.subscription !== subscription)
+                return;
+            var dict = {};
+            dict[Key.MESSAGE_TYPE] = MessageType.STOP_PREDICTION;
+            dict[Key.STOP_ROUTE_TAG] = subscription.routeTag;
+            dict[Key.SECTION_STOP_TAG] = subscription.stopTag;
+            companion.writePrediction(dict, arrival, now);
+
+            // Push only what the watch would show differently: the arrival, or the text of it
+            var pushed = (companion.capabilities & Capability.ARRIVAL_TIMES) ?
+                arrival.arrival_time + ' ' + arrival.confidence :
+                dict[Key.STOP_PREDICTION] + ' ' + dict[Key.STOP_MINUTES_LABEL];
+            if (pushed === subscription.last)
+                return;
+            subscription.last = pushed;
+            companion.outbox.push(dict);
+        });
+    };
+    poll();
+};
+
+Companion.prototype.unsubscribe = function () {
+    if (this.subscription && this.subscription.timer !== null)
+        this.clearTimer(this.subscription.timer);
+    this.subscription = null;
+};
+
+/*
+ * Answer with the predictions of every stop of a section, from a single upstream fetch, in as
+ * many messages as it takes
+ */
+Companion.prototype.onRequestSectionPredictions = function (message, reply) {
+    var sectionIndex = message[Key.SECTION_INDEX];
+    var stopTag = message[Key.SECTION_STOP_TAG];
+    var section = this.sectionAt(sectionIndex);
+    if (!section || section.tag !== stopTag) {
+        console.log('No section with section_index == ' + sectionIndex + ' and stop tag ' + stopTag);
+        return;
+    }
+
+    var companion = this;
+    this.fetchPredictions(stopTag, function (error, predictions) {
+        if (error) {
+            console.log('Could not fetch predictions for ' + stopTag + ': ' + error.message);
+            return;
+        }
+        var now = Math.floor(companion.now() / 1000);
+        var arrivals = section.stops.map(function (stop) {
+            return nextArrival(predictions, stop[0], stop[2], now);
+        });
+        for (var first = 0; first < arrivals.length;) {
+            var dict = companion.sectionPredictions(sectionIndex, stopTag, arrivals, first, now);
+            var count = dict[Key.STOP_RECORD_COUNT];
+            if (count === 0) {
+                console.log('Prediction records don\'t fit an inbox of ' + companion.inboxSize + ' bytes');
+                return;
+            }
+            reply(dict);
+            first += count;
+        }
+    });
+};
+
+/*
+ * Return a MESSAGE_SECTION_PREDICTIONS with as many arrivals from first on as fit
+ */
+Companion.prototype.sectionPredictions = function (sectionIndex, stopTag, arrivals, first, now) {
+    var dict = {};
+    dict[Key.MESSAGE_TYPE] = MessageType.SECTION_PREDICTIONS;
+    dict[Key.SECTION_INDEX] = sectionIndex;
+    dict[Key.SECTION_STOP_TAG] = stopTag;
+    dict[Key.SECTION_STOP_INDEX] = first;
+    dict[Key.STOP_RECORD_COUNT] = 0;
+    var rest = arrivals.slice(first);
+
+    if (this.capabilities & Capability.ARRIVAL_TIMES) {
+        var records = packRecords(this.roomLeft(dict) - TUPLE_HEADER_SIZE, [], rest, function (writer, arrival) {
+            writer.writeVarint(arrival.arrival_time).writeVarint(arrival.confidence);
+        });
+        if (records) {
+            dict[Key.ARRIVALS] = records.bytes;
+            dict[Key.STOP_RECORD_COUNT] = records.count;
+        }
+        return dict;
+    }
+
+    var room = this.roomLeft(dict);
+    for (var i = 0; i < rest.length; i++) {
+        var text = predictionText(rest[i], now);
+        var size = 2 * TUPLE_HEADER_SIZE + valueSize(text[0]) + valueSize(text[1]);
+        if (size > room)
+            break;
+        room -= size;
+        dict[PREDICTION_RECORD_BASE + i * PREDICTION_RECORD_FIELD_COUNT] = text[0];
+        dict[PREDICTION_RECORD_BASE + i * PREDICTION_RECORD_FIELD_COUNT + 1] = text[1];
+        dict[Key.STOP_RECORD_COUNT] = i + 1;
+    }
+    return dict;
+};
+
+/****
+ ** METRICS
+ ****/
+
+/*
+ * Log the metrics the watch sends in MESSAGE_METRICS, and keep them for inspection
+ */
+Companion.prototype.onMetrics = function (message) {
+    var metrics = { sync: null, types: {}, failures: {} };
+    var sync = message[Key.METRICS_SYNC];
+    if (sync && sync.length >= 16) {
+        metrics.sync = {
+            sync_count: readUint32(sync, 0),
+            first_section_ms: readUint32(sync, 4),
+            complete_ms: readUint32(sync, 8),
+            dropped: readUint32(sync, 12)
+        };
+        console.log('Sync ' + metrics.sync.sync_count + ': first section in ' + metrics.sync.first_section_ms +
+                    ' ms, complete in ' + metrics.sync.complete_ms + ' ms, ' + metrics.sync.dropped + ' dropped');
+    }
+
+    for (var type = 0; type <= MessageType.METRICS; type++) {
+        var record = message[METRICS_RECORD_BASE + type];
+        if (record && record.length >= 14 + 2 * METRICS_LATENCY_BUCKET_COUNT) {
+            var latency = [];
+            for (var i = 0; i < METRICS_LATENCY_BUCKET_COUNT; i++)
+                latency.push(readUint16(record, 14 + 2 * i));
+            metrics.types[type] = {
+                bytes_sent: readUint32(record, 0),
+                bytes_received: readUint32(record, 4),
+                sent: readUint16(record, 8),
+                received: readUint16(record, 10),
+                failed: readUint16(record, 12),
+                latency: latency
+            };
+            console.log('Type ' + type + ': ' + JSON.stringify(metrics.types[type]));
+        }
+        if (message[METRICS_FAILURE_BASE + type])
+            metrics.failures[type] = message[METRICS_FAILURE_BASE + type];
+    }
+    this.metrics = metrics;
+    this.logStats();
+};
+
+/*
+ * Ask the watch for its metrics, which it sends in a MESSAGE_METRICS
+ */
+Companion.prototype.requestMetrics = function () {
+    var dict = {};
+    dict[Key.MESSAGE_TYPE] = MessageType.REQUEST_METRICS;
+    this.outbox.push(dict);
+};
+
+/*
+ * Log the upstream, outbox and latency counters of the companion
+ */
+Companion.prototype.logStats = function () {
+    console.log('Upstream: ' + JSON.stringify(this.fetcher.stats) + ', outbox: ' + JSON.stringify(this.outbox.stats));
+    for (var type in this.latency) {
+        if (this.latency.hasOwnProperty(type)) {
+            var latency = this.latency[type];
+            console.log('Request type ' + type + ': ' + latency.count + ' replies, mean ' +
+                        Math.round(latency.total / latency.count) + ' ms, max ' + latency.max + ' ms');
+        }
+    }
+};
+
+/****
+ ** CONFIGURATION
+ ****/
+
+/*
+ * Return the URL of the configuration page: a form for the URL of the upstream server, which
+ * closes with the settings as JSON
+ */
+function configurationUrl(upstream) {
+    var value = String(upstream).replace(/&/g, '&amp;').replace(/"/g, '&quot;').replace(/</g, '&lt;');
+    var html = '<!DOCTYPE html><html><head><meta name="viewport" content="width=device-width">' +
+        '<title>Faster Than Walking</title></head><body><form onsubmit="' +
+        'document.location = \'pebblejs://close#\' + encodeURIComponent(JSON.stringify({ upstream: this.upstream.value }));' +
+        ' return false;"><p><label>Prediction server<br><input name="upstream" type="url" value="' + value + '">' +
+        '</label></p><p><button type="submit">Save</button></p></form></body></html>';
+    return 'data:text/html,' + encodeURIComponent(html);
+}
+
+/*
+ * Return the upstream URL in the response of the configuration page, without a trailing slash,
+ * or null if it holds no http or https URL
+ */
+function upstreamOf(response) {
+    var settings;
+    try {
+        settings = JSON.parse(decodeURIComponent(response || ''));
+    } catch (e) {
+        return null;
+    }
+    var upstream = settings && typeof settings.upstream === 'string' ? settings.upstream.replace(/\/+$/, '') : '';
+    return /^https?:\/\/\S+$/.test(upstream) ? upstream : null;
+}
+
+/****
+ ** PEBBLE
+ ****/
+
+function sendWithPebble(dict, onSuccess, onFailure) {
+    Pebble.sendAppMessage(dict, onSuccess, onFailure);
+}
+
+/*
+ * Pass the position of the phone to callback, or null if it can't be found
+ */
+function locateWithGeolocation(callback) {
+    if (typeof navigator === 'undefined' || !navigator.geolocation)
+        return callback(null);
+    navigator.geolocation.getCurrentPosition(function (position) {
+        callback({ lat: position.coords.latitude, lon: position.coords.longitude });
+    }, function () {
+        callback(null);
+    }, { timeout: 15000, maximumAge: 60000 });
+}
+
+if (typeof Pebble !== 'undefined') {
+    var companion = new Companion({
+        upstream: (typeof localStorage !== 'undefined' && localStorage.getItem('upstream')) || DEFAULT_UPSTREAM_URL
+    });
+    Pebble.addEventListener('ready', function () {
+        console.log('Companion ready, upstream ' + companion.upstream);
+    });
+    Pebble.addEventListener('appmessage', function (e) {
+        companion.receive(e.payload);
+    });
+    Pebble.addEventListener('showConfiguration', function () {
+        Pebble.openURL(configurationUrl(companion.upstream));
+    });
+    Pebble.addEventListener('webviewclosed', function (e) {
+        var upstream = upstreamOf(e.response);
+        if (!upstream)
+            return;
+        companion.upstream = upstream;
+        if (typeof localStorage !== 'undefined')
+            localStorage.setItem('upstream', upstream);
+        console.log('Upstream set to ' + upstream);
+    });
+}
+
+if (typeof module !== 'undefined' && module.exports) {
+    module.exports = {
+        Companion: Companion,
+        Fetcher: Fetcher,
+        Outbox: Outbox,
+        RecordWriter: RecordWriter,
+        Key: Key,
+        MessageType: MessageType,
+        Capability: Capability,
+        dictionarySize: dictionarySize,
+        generationOf: generationOf,
+        nextArrival: nextArrival,
+        packRecords: packRecords,
+        configurationUrl: configurationUrl,
+        upstreamOf: upstreamOf
+    };
+}
@@ -0,0 +1,128 @@
+#include <pebble.h>
+#include "metrics.h"
+
+// Upper bounds of the latency buckets, in ms; the last bucket holds everything slower
+static const uint16_t latency_bounds[METRICS_LATENCY_BUCKET_COUNT - 1] = { 50, 100, 200, 500, 1000, 2000, 5000 };
+
+static MetricsRecord records[MESSAGE_TYPE_COUNT];
+static uint8_t failures[MESSAGE_TYPE_COUNT][METRICS_RESULT_COUNT];
+static MetricsSyncRecord sync_record;
+
+// When the last message of each type was sent
+static uint32_t last_sent_ms[MESSAGE_TYPE_COUNT];
+
+// When the current sync started, and whether a section has been received since
+static uint32_t sync_started_ms;
+static bool syncing = false;
+static bool section_received = false;
+
+/*
+ * Return the bit set in result, or the highest one if there are several
+ */
+static uint8_t result_bit(AppMessageResult result) {
+    uint8_t bit = 0;
+    while ((result >>= 1) != 0 && bit < METRICS_RESULT_COUNT - 1)
+        bit++;
+    return bit;
+}
+
+uint32_t metrics_now(void) {
+    time_t seconds;
+    uint16_t ms;
+    time_ms(&seconds, &ms);
+    return (uint32_t) seconds * 1000 + ms;
+}
+
+void metrics_count_sent(uint8_t message_type, uint32_t bytes) {
+    if (message_type >= MESSAGE_TYPE_COUNT) return;
+    records[message_type].sent++;
+    records[message_type].bytes_sent += bytes;
+    last_sent_ms[message_type] = metrics_now();
+}
+
+void metrics_count_failed(uint8_t message_type, AppMessageResult result) {
+    if (message_type >= MESSAGE_TYPE_COUNT) return;
+    records[message_type].failed++;
+    uint8_t *count = &failures[message_type][result_bit(result)];
+    if (*count < UINT8_MAX)
+        (*count)++;
+}
+
+void metrics_count_received(uint8_t message_type, uint32_t bytes) {
+    if (message_type >= MESSAGE_TYPE_COUNT) return;
+    records[message_type].received++;
+    records[message_type].bytes_received += bytes;
+}
+
+void metrics_count_dropped(AppMessageResult result) {
+    sync_record.dropped++;
+}
+
+void metrics_count_latency(uint8_t request_type, uint32_t sent_ms) {
+    if (request_type >= MESSAGE_TYPE_COUNT) return;
+    uint32_t latency = metrics_now() - sent_ms;
+    uint8_t bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKET_COUNT - 1 && latency > latency_bounds[bucket])
+        bucket++;
+    records[request_type].latency[bucket]++;
+}
+
+void metrics_count_reply(uint8_t request_type) {
+    if (request_type >= MESSAGE_TYPE_COUNT) return;
+    metrics_count_latency(request_type, last_sent_ms[request_type]);
+}
+
+void metrics_sync_started(void) {
+    sync_started_ms = metrics_now();
+    syncing = true;
+    section_received = false;
+    sync_record.sync_count++;
+}
+
+void metrics_section_received(void) {
+    if (!syncing || section_received) return;
+    section_received = true;
+    sync_record.first_section_ms = metrics_now() - sync_started_ms;
+}
+
+void metrics_sync_completed(void) {
+    if (!syncing) return;
+    syncing = false;
+    sync_record.complete_ms = metrics_now() - sync_started_ms;
+}
+
+void metrics_write(DictionaryIterator *iter) {
+    if (dict_write_data(iter, METRICS_SYNC, (const uint8_t *) &sync_record, sizeof(sync_record)) != DICT_OK)
+        return;
+    for (int i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        MetricsRecord *record = &records[i];
+        if (record->sent == 0 && record->received == 0 && record->failed == 0)
+            continue;
+        if (dict_write_data(iter, METRICS_RECORD_BASE + i, (const uint8_t *) record, sizeof(MetricsRecord)) != DICT_OK)
+            return;
+        if (record->failed > 0 &&
+                dict_write_data(iter, METRICS_FAILURE_BASE + i, failures[i], METRICS_RESULT_COUNT) != DICT_OK)
+            return;
+    }
+}
+
+void metrics_dump(void) {
+    APP_LOG(APP_LOG_LEVEL_INFO, "Syncs: %lu, first section: %lu ms, complete: %lu ms, dropped: %lu",
+            (unsigned long) sync_record.sync_count, (unsigned long) sync_record.first_section_ms,
+            (unsigned long) sync_record.complete_ms, (unsigned long) sync_record.dropped);
+    for (int i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+        MetricsRecord *record = &records[i];
+        if (record->sent == 0 && record->received == 0 && record->failed == 0)
+            continue;
+        // The record is packed, so its latency buckets are read in place rather than through a pointer
+        APP_LOG(APP_LOG_LEVEL_INFO, "%s: sent %d (%lu B), received %d (%lu B), failed %d, latency %d/%d/%d/%d/%d/%d/%d/%d",
+                translate_message_type(i), record->sent, (unsigned long) record->bytes_sent, record->received,
+                (unsigned long) record->bytes_received, record->failed, record->latency[0], record->latency[1],
+                record->latency[2], record->latency[3], record->latency[4], record->latency[5], record->latency[6],
+                record->latency[7]);
+        for (int bit = 0; bit < METRICS_RESULT_COUNT; bit++) {
+            if (failures[i][bit] > 0)
+                APP_LOG(APP_LOG_LEVEL_INFO, "  %s: %d", translate_error(1 << bit), failures[i][bit]);
+        }
+    }
+}
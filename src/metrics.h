@@ -0,0 +1,80 @@
+#pragma once
+
+#include <pebble.h>
+#include "protocol.h"
+
+// Latency histogram buckets; see metrics.c for their bounds
+#define METRICS_LATENCY_BUCKET_COUNT 8
+
+// Failure counts by the bit set in the AppMessageResult
+#define METRICS_RESULT_COUNT 15
+
+/*
+ * Counters of one message type, as sent to the phone in MESSAGE_METRICS
+ */
+typedef struct __attribute__((__packed__)) MetricsRecord {
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+    uint16_t sent;
+    uint16_t received;
+    uint16_t failed;
+    // Request to reply latency, for request types
+    uint16_t latency[METRICS_LATENCY_BUCKET_COUNT];
+} MetricsRecord;
+
+/*
+ * Timings of the last stop list sync, as sent to the phone in MESSAGE_METRICS
+ */
+typedef struct __attribute__((__packed__)) MetricsSyncRecord {
+    uint32_t sync_count;
+    // From sync_get_stops to the first section received and to the complete list, in ms
+    uint32_t first_section_ms;
+    uint32_t complete_ms;
+    // Inbound messages dropped
+    uint32_t dropped;
+} MetricsSyncRecord;
+
+/*
+ * Return a millisecond clock, for timing requests
+ */
+uint32_t metrics_now(void);
+
+/*
+ * Count a message sent, or failed to be sent, to the phone
+ */
+void metrics_count_sent(uint8_t message_type, uint32_t bytes);
+void metrics_count_failed(uint8_t message_type, AppMessageResult result);
+
+/*
+ * Count a message received from the phone, or dropped from the inbox
+ */
+void metrics_count_received(uint8_t message_type, uint32_t bytes);
+void metrics_count_dropped(AppMessageResult result);
+
+/*
+ * Count the latency of a reply to a request of the given type sent at sent_ms
+ */
+void metrics_count_latency(uint8_t request_type, uint32_t sent_ms);
+
+/*
+ * Count the latency of a reply to the last request of the given type sent, for requests
+ * which are never in flight more than once
+ */
+void metrics_count_reply(uint8_t request_type);
+
+/*
+ * Time a stop list sync: from its start to the first section received and to the complete list
+ */
+void metrics_sync_started(void);
+void metrics_section_received(void);
+void metrics_sync_completed(void);
+
+/*
+ * Write the metrics records into a message to the phone. Records which don't fit are left out.
+ */
+void metrics_write(DictionaryIterator *iter);
+
+/*
+ * Log the metrics, one line per message type seen.
+ */
+void metrics_dump(void);
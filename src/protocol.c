@@ -0,0 +1,181 @@
+#include <pebble.h>
+#include "protocol.h"
+
+#define MESSAGE_TYPE_NAME(name, value, required) case name: return #name;
+#define MESSAGE_TYPE_REQUIRED(name, value, required) case name: return required;
+#define MESSAGE_FIELD_NAME(name, member, key, kind) case name: return #name;
+
+// Decode the tuple of a field into its member of message, or else count it as missing
+#define MESSAGE_FIELD_DECODE(name, member, key, kind) \
+    case name: \
+        if (decode_##kind(tuple, &message->member)) \
+            message->present |= FIELD_BIT(name); \
+        else \
+            APP_LOG(APP_LOG_LEVEL_WARNING, "Malformed %s in message", #name); \
+        break;
+
+/*
+ * Return the name of the given message type
+ */
+char *translate_message_type(unsigned char message_type) {
+    switch (message_type) {
+        MESSAGE_TYPES(MESSAGE_TYPE_NAME)
+        default:
+            return "MESSAGE_UNKNOWN";
+    }
+}
+
+/*
+ * Return the name of the given message field
+ */
+char *translate_message_field(int message_field) {
+    switch (message_field) {
+        MESSAGE_FIELDS(MESSAGE_FIELD_NAME)
+        default:
+            return "UNKNOWN_FIELD";
+    }
+}
+
+/*
+ * Return the fields every message of the given type must hold
+ */
+static uint32_t required_fields(uint8_t message_type) {
+    switch (message_type) {
+        MESSAGE_TYPES(MESSAGE_TYPE_REQUIRED)
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Read an integer tuple of any width into value. Return false if it isn't an integer, or is negative.
+ */
+static bool decode_integer(Tuple *tuple, uint32_t *value) {
+    if (tuple->type == TUPLE_UINT) {
+        switch (tuple->length) {
+            case 1: *value = tuple->value->uint8; return true;
+            case 2: *value = tuple->value->uint16; return true;
+            case 4: *value = tuple->value->uint32; return true;
+        }
+    } else if (tuple->type == TUPLE_INT) {
+        int32_t signed_value;
+        switch (tuple->length) {
+            case 1: signed_value = tuple->value->int8; break;
+            case 2: signed_value = tuple->value->int16; break;
+            case 4: signed_value = tuple->value->int32; break;
+            default: return false;
+        }
+        *value = signed_value;
+        return signed_value >= 0;
+    }
+    return false;
+}
+
+static bool decode_UINT8(Tuple *tuple, uint8_t *value) {
+    uint32_t integer;
+    if (!decode_integer(tuple, &integer) || integer > UINT8_MAX) return false;
+    *value = integer;
+    return true;
+}
+
+static bool decode_UINT16(Tuple *tuple, uint16_t *value) {
+    uint32_t integer;
+    if (!decode_integer(tuple, &integer) || integer > UINT16_MAX) return false;
+    *value = integer;
+    return true;
+}
+
+static bool decode_UINT32(Tuple *tuple, uint32_t *value) {
+    return decode_integer(tuple, value);
+}
+
+/*
+ * A string must be terminated within its tuple
+ */
+static bool decode_CSTRING(Tuple *tuple, char **value) {
+    if (tuple->type != TUPLE_CSTRING || tuple->length == 0 || tuple->value->cstring[tuple->length - 1] != '\0')
+        return false;
+    *value = tuple->value->cstring;
+    return true;
+}
+
+static bool decode_BYTES(Tuple *tuple, Tuple **value) {
+    if (tuple->type != TUPLE_BYTE_ARRAY) return false;
+    *value = tuple;
+    return true;
+}
+
+bool message_decode(DictionaryIterator *iter, Message *message) {
+    memset(message, 0, sizeof(Message));
+    for (Tuple *tuple = dict_read_first(iter); tuple != NULL; tuple = dict_read_next(iter)) {
+        switch (tuple->key) {
+            MESSAGE_FIELDS(MESSAGE_FIELD_DECODE)
+            default:
+                // Records are looked up by key when their message is handled
+                break;
+        }
+    }
+
+    if (!(message->present & FIELD_BIT(MESSAGE_TYPE))) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Received a message without message type!");
+        return false;
+    }
+    return message_require(message, required_fields(message->message_type));
+}
+
+void message_find_records(DictionaryIterator *iter, uint32_t base, uint16_t field_count, uint16_t record_count, char **fields) {
+    uint32_t end = base + (uint32_t) record_count * field_count;
+    memset(fields, 0, (end - base) * sizeof(char *));
+    for (Tuple *tuple = dict_read_first(iter); tuple != NULL; tuple = dict_read_next(iter)) {
+        if (tuple->key >= base && tuple->key < end)
+            decode_CSTRING(tuple, &fields[tuple->key - base]);
+    }
+}
+
+bool message_require(const Message *message, uint32_t fields) {
+    uint32_t missing = fields & ~message->present;
+    for (int i = 0; missing != 0; i++, missing >>= 1) {
+        if (missing & 1)
+            APP_LOG(APP_LOG_LEVEL_WARNING, "%s not found in %s", translate_message_field(i),
+                    translate_message_type(message->message_type));
+    }
+    return (fields & ~message->present) == 0;
+}
+
+/*
+ * Return the name of the given AppMessageResult
+ */
+char *translate_error(AppMessageResult result) {
+    switch (result) {
+        case APP_MSG_OK:
+            return "APP_MSG_OK";
+        case APP_MSG_SEND_TIMEOUT:
+            return "APP_MSG_SEND_TIMEOUT";
+        case APP_MSG_SEND_REJECTED:
+            return "APP_MSG_SEND_REJECTED";
+        case APP_MSG_NOT_CONNECTED:
+            return "APP_MSG_NOT_CONNECTED";
+        case APP_MSG_APP_NOT_RUNNING:
+            return "APP_MSG_APP_NOT_RUNNING";
+        case APP_MSG_INVALID_ARGS:
+            return "APP_MSG_INVALID_ARGS";
+        case APP_MSG_BUSY:
+            return "APP_MSG_BUSY";
+        case APP_MSG_BUFFER_OVERFLOW:
+            return "APP_MSG_BUFFER_OVERFLOW";
+        case APP_MSG_ALREADY_RELEASED:
+            return "APP_MSG_ALREADY_RELEASED";
+        case APP_MSG_CALLBACK_ALREADY_REGISTERED:
+            return "APP_MSG_CALLBACK_ALREADY_REGISTERED";
+        case APP_MSG_CALLBACK_NOT_REGISTERED:
+            return "APP_MSG_CALLBACK_NOT_REGISTERED";
+        case APP_MSG_OUT_OF_MEMORY:
+            return "APP_MSG_OUT_OF_MEMORY";
+        case APP_MSG_CLOSED:
+            return "APP_MSG_CLOSED";
+        case APP_MSG_INTERNAL_ERROR:
+            return "APP_MSG_INTERNAL_ERROR";
+        default:
+            return "UNKNOWN ERROR";
+    }
+}
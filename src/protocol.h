@@ -0,0 +1,211 @@
+#pragma once
+
+#include <pebble.h>
+
+/*
+ * Messages exchanged with the phone. Both sides must agree on every key and value here.
+ */
+
+/*
+ * Message fields, as FIELD(name, member, key, kind), where member names the field in Message and
+ * kind is the type of its value: UINT8, UINT16 or UINT32 (which the phone may send at any width),
+ * CSTRING or BYTES. Keys run from 0 to MESSAGE_FIELD_COUNT - 1, so they fit a uint32_t bit mask.
+ */
+#define MESSAGE_FIELDS(FIELD) \
+    /* Message type */ \
+    FIELD(MESSAGE_TYPE, message_type, 0, UINT8) \
+    /* Sections */ \
+    FIELD(SECTION_INDEX, section_index, 1, UINT16) \
+    FIELD(SECTION_COUNT, section_count, 2, UINT16) \
+    FIELD(SECTION_STOP_TAG, stop_tag, 3, CSTRING) \
+    FIELD(SECTION_STOP_TITLE, stop_title, 4, CSTRING) \
+    FIELD(SECTION_STOP_COUNT, stop_count, 5, UINT16) \
+    /* Stops */ \
+    FIELD(SECTION_STOP_INDEX, stop_index, 6, UINT16) \
+    FIELD(STOP_ROUTE_TAG, route_tag, 7, CSTRING) \
+    FIELD(STOP_ROUTE_TITLE, route_title, 8, CSTRING) \
+    FIELD(STOP_DIRECTION_TAG, direction_tag, 9, CSTRING) \
+    FIELD(STOP_DIRECTION_TITLE, direction_title, 10, CSTRING) \
+    FIELD(STOP_PREDICTION, prediction, 11, CSTRING) \
+    FIELD(STOP_MINUTES_LABEL, minutes_label, 12, CSTRING) \
+    /* Protocol negotiation */ \
+    FIELD(PROTOCOL_CAPABILITIES, capabilities, 13, UINT32) \
+    FIELD(INBOX_SIZE, inbox_size, 14, UINT32) \
+    /* Batched stops */ \
+    FIELD(STOP_RECORD_COUNT, record_count, 15, UINT16) \
+    /* Pipelined requests */ \
+    FIELD(REQUEST_SEQUENCE, sequence, 16, UINT8) \
+    /* Section generations */ \
+    FIELD(LIST_GENERATION, generation, 17, UINT32) \
+    FIELD(SECTION_GENERATIONS, section_generations, 18, BYTES) /* uint32_t[SECTION_COUNT], little-endian */ \
+    /* Prediction subscriptions */ \
+    FIELD(PREDICTION_INTERVAL, prediction_interval, 19, UINT16) /* seconds */ \
+    /* Metrics */ \
+    FIELD(METRICS_SYNC, metrics_sync, 20, BYTES) /* MetricsSyncRecord */ \
+    /* Binary stop records */ \
+    FIELD(STOP_RECORDS, stop_records, 21, BYTES) /* see records.h */ \
+    /* Section headers up front */ \
+    FIELD(SECTION_HEADERS, section_headers, 22, BYTES) /* see records.h */ \
+    /* Arrival times */ \
+    FIELD(ARRIVALS, arrivals, 23, BYTES) /* see records.h */
+
+#define MESSAGE_FIELD_KEY(name, member, key, kind) name = key,
+#define MESSAGE_FIELD_ONE(name, member, key, kind) + 1
+
+/* Message fields */
+enum {
+    MESSAGE_FIELDS(MESSAGE_FIELD_KEY)
+    MESSAGE_FIELD_COUNT = 0 MESSAGE_FIELDS(MESSAGE_FIELD_ONE)
+};
+
+// Bit of a field in Message.present
+#define FIELD_BIT(field) ((uint32_t) 1 << (field))
+
+#define MESSAGE_KIND_TYPE_UINT8 uint8_t
+#define MESSAGE_KIND_TYPE_UINT16 uint16_t
+#define MESSAGE_KIND_TYPE_UINT32 uint32_t
+#define MESSAGE_KIND_TYPE_CSTRING char *
+#define MESSAGE_KIND_TYPE_BYTES Tuple *
+#define MESSAGE_FIELD_MEMBER(name, member, key, kind) MESSAGE_KIND_TYPE_##kind member;
+
+/*
+ * The fields of a message, decoded in a single pass by message_decode. A field is only set if
+ * its FIELD_BIT is in present. Strings and byte arrays point into the message, so they are only
+ * valid until the handler returns. Records at keys from STOP_RECORD_BASE up aren't decoded.
+ */
+typedef struct Message {
+    uint32_t present;
+    MESSAGE_FIELDS(MESSAGE_FIELD_MEMBER)
+} Message;
+
+/*
+ * Fields of a batched stop record. Record i of a batch stores field f at key
+ * STOP_RECORD_BASE + i * STOP_RECORD_FIELD_COUNT + f.
+ */
+enum {
+    STOP_RECORD_ROUTE_TAG = 0,       // char *
+    STOP_RECORD_ROUTE_TITLE = 1,     // char *
+    STOP_RECORD_DIRECTION_TAG = 2,   // char *
+    STOP_RECORD_DIRECTION_TITLE = 3, // char *
+    STOP_RECORD_FIELD_COUNT = 4
+};
+#define STOP_RECORD_BASE 1000
+
+/*
+ * Fields of a prediction record in MESSAGE_SECTION_PREDICTIONS. Record i stores field f at key
+ * PREDICTION_RECORD_BASE + i * PREDICTION_RECORD_FIELD_COUNT + f, and holds the prediction of
+ * stop SECTION_STOP_INDEX + i of the section. Phones with CAPABILITY_ARRIVAL_TIMES send ARRIVALS
+ * instead.
+ */
+enum {
+    PREDICTION_RECORD_PREDICTION = 0,    // char *
+    PREDICTION_RECORD_MINUTES_LABEL = 1, // char *
+    PREDICTION_RECORD_FIELD_COUNT = 2
+};
+#define PREDICTION_RECORD_BASE 2000
+
+/*
+ * Protocol capabilities. The watch advertises the capabilities it supports in
+ * MESSAGE_REQUEST_SECTIONS_METADATA and the phone replies with the subset it will use.
+ */
+enum {
+    // Phone packs as many stop records as fit into each MESSAGE_SECTION_DATA / MESSAGE_STOP_DATA
+    CAPABILITY_BATCHED_STOPS = 1 << 0,
+    // Phone echoes REQUEST_SEQUENCE in each reply, so several requests may be in flight at once
+    CAPABILITY_SEQUENCED_REQUESTS = 1 << 1,
+    // Phone sends a generation for the list and for each section, so unchanged sections are kept
+    CAPABILITY_SECTION_GENERATIONS = 1 << 2,
+    // Phone pushes MESSAGE_STOP_PREDICTION for a subscribed stop whenever the prediction changes
+    CAPABILITY_PREDICTION_SUBSCRIPTIONS = 1 << 3,
+    // Phone answers MESSAGE_REQUEST_SECTION_PREDICTIONS with the predictions of a whole section
+    CAPABILITY_SECTION_PREDICTIONS = 1 << 4,
+    // Phone sends the stops of MESSAGE_SECTION_DATA / MESSAGE_STOP_DATA as binary records in STOP_RECORDS
+    CAPABILITY_BINARY_RECORDS = 1 << 5,
+    // Phone sends the tag, title and stop count of the sections in SECTION_HEADERS of MESSAGE_SECTIONS_METADATA
+    CAPABILITY_SECTION_HEADERS = 1 << 6,
+    // Phone sends predictions as arrival times in ARRIVALS rather than as text
+    CAPABILITY_ARRIVAL_TIMES = 1 << 7
+};
+#define SUPPORTED_CAPABILITIES (CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS | \
+                                CAPABILITY_SECTION_GENERATIONS | CAPABILITY_PREDICTION_SUBSCRIPTIONS | \
+                                CAPABILITY_SECTION_PREDICTIONS | CAPABILITY_BINARY_RECORDS | \
+                                CAPABILITY_SECTION_HEADERS | CAPABILITY_ARRIVAL_TIMES)
+
+/*
+ * Metrics records in MESSAGE_METRICS. The record of message type t is stored at key
+ * METRICS_RECORD_BASE + t, and is left out if no message of that type was counted.
+ */
+#define METRICS_RECORD_BASE 3000
+
+/*
+ * Failure counts in MESSAGE_METRICS, as uint8_t[METRICS_RESULT_COUNT] indexed by the bit of the
+ * AppMessageResult. Those of message type t are stored at key METRICS_FAILURE_BASE + t, and are
+ * left out if no message of that type failed.
+ */
+#define METRICS_FAILURE_BASE 3100
+
+/*
+ * Message types, as TYPE(name, value, required), where required is the FIELD_BIT mask of the
+ * fields every message of the type must hold. Received messages without them are dropped.
+ */
+#define MESSAGE_TYPES(TYPE) \
+    TYPE(MESSAGE_REQUEST_SECTIONS_METADATA, 0, 0) \
+    TYPE(MESSAGE_REQUEST_SECTION_DATA, 1, FIELD_BIT(SECTION_INDEX)) \
+    TYPE(MESSAGE_REQUEST_STOP_DATA, 2, FIELD_BIT(SECTION_INDEX) | FIELD_BIT(SECTION_STOP_INDEX)) \
+    TYPE(MESSAGE_REQUEST_STOP_PREDICTION, 3, FIELD_BIT(STOP_ROUTE_TAG) | FIELD_BIT(SECTION_STOP_TAG)) \
+    TYPE(MESSAGE_SECTIONS_METADATA, 4, FIELD_BIT(SECTION_COUNT)) \
+    TYPE(MESSAGE_SECTION_DATA, 5, FIELD_BIT(SECTION_INDEX) | FIELD_BIT(SECTION_STOP_TAG) | \
+                                  FIELD_BIT(SECTION_STOP_TITLE) | FIELD_BIT(SECTION_STOP_COUNT)) \
+    TYPE(MESSAGE_STOP_DATA, 6, 0) \
+    TYPE(MESSAGE_STOP_PREDICTION, 7, 0) /* ARRIVALS, or STOP_PREDICTION and STOP_MINUTES_LABEL */ \
+    TYPE(MESSAGE_SUBSCRIBE_STOP_PREDICTION, 8, FIELD_BIT(STOP_ROUTE_TAG) | FIELD_BIT(SECTION_STOP_TAG)) \
+    TYPE(MESSAGE_UNSUBSCRIBE_STOP_PREDICTION, 9, 0) \
+    TYPE(MESSAGE_REQUEST_SECTION_PREDICTIONS, 10, FIELD_BIT(SECTION_INDEX) | FIELD_BIT(SECTION_STOP_TAG)) \
+    TYPE(MESSAGE_SECTION_PREDICTIONS, 11, FIELD_BIT(SECTION_INDEX) | FIELD_BIT(SECTION_STOP_TAG) | \
+                                          FIELD_BIT(SECTION_STOP_INDEX) | FIELD_BIT(STOP_RECORD_COUNT)) \
+    TYPE(MESSAGE_REQUEST_METRICS, 12, 0) \
+    TYPE(MESSAGE_METRICS, 13, 0)
+
+#define MESSAGE_TYPE_VALUE(name, value, required) name = value,
+#define MESSAGE_TYPE_ONE(name, value, required) + 1
+
+/* Possible message types */
+enum {
+    MESSAGE_TYPES(MESSAGE_TYPE_VALUE)
+    MESSAGE_TYPE_COUNT = 0 MESSAGE_TYPES(MESSAGE_TYPE_ONE)
+};
+
+/*
+ * Decode the fields of a message into message in a single pass over its tuples. A field of the
+ * wrong kind, or an integer out of range, counts as missing. Return false, logging the missing
+ * fields, if the message has no type or lacks a field its type requires.
+ */
+bool message_decode(DictionaryIterator *iter, Message *message);
+
+/*
+ * Find the string fields of record_count records stored from key base on, with field_count
+ * fields each, in a single pass over the tuples of a message. Field f of record i is stored into
+ * fields[i * field_count + f], or NULL if it is missing or not a string.
+ */
+void message_find_records(DictionaryIterator *iter, uint32_t base, uint16_t field_count, uint16_t record_count, char **fields);
+
+/*
+ * Return false, logging the missing fields, unless message holds every field of the mask fields.
+ * For fields which depend on the form of a message, beyond those its type requires.
+ */
+bool message_require(const Message *message, uint32_t fields);
+
+/*
+ * Return the name of the given message type
+ */
+char *translate_message_type(unsigned char message_type);
+
+/*
+ * Return the name of the given message field
+ */
+char *translate_message_field(int message_field);
+
+/*
+ * Return the name of the given AppMessageResult
+ */
+char *translate_error(AppMessageResult result);
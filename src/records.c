@@ -0,0 +1,48 @@
+#include <pebble.h>
+#include "records.h"
+
+// A uint32_t takes at most 5 varint bytes
+#define MAX_VARINT_BYTES 5
+
+void record_reader_init(RecordReader *reader, const uint8_t *data, uint16_t size) {
+    *reader = (RecordReader) {
+        .data = data,
+        .size = size,
+        .offset = 0,
+        .failed = false
+    };
+}
+
+uint32_t record_read_varint(RecordReader *reader) {
+    uint32_t value = 0;
+    for (int i = 0; i < MAX_VARINT_BYTES && !reader->failed; i++) {
+        if (reader->offset >= reader->size)
+            break;
+        uint8_t byte = reader->data[reader->offset++];
+        value |= (uint32_t) (byte & 0x7f) << (7 * i);
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+    reader->failed = true;
+    return 0;
+}
+
+bool record_read_string(RecordReader *reader, StringSlice *slice) {
+    uint32_t length = record_read_varint(reader);
+    if (reader->failed || length > (uint32_t) (reader->size - reader->offset)) {
+        reader->failed = true;
+        return false;
+    }
+
+    // Strings are interned by their NUL-terminated copy, so they can't hold a NUL themselves
+    const char *data = (const char *) reader->data + reader->offset;
+    if (memchr(data, '\0', length) != NULL) {
+        reader->failed = true;
+        return false;
+    }
+
+    slice->data = data;
+    slice->length = length;
+    reader->offset += length;
+    return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <pebble.h>
+#include "data.h"
+
+/*
+ * Binary stop records, sent by the phone as a single byte array in STOP_RECORDS:
+ *
+ *   version | section_index | first_stop_index | record_count | record[record_count]
+ *
+ * where each record holds the route tag, route title, direction tag and direction title of
+ * stop first_stop_index + i of the section. The version, indices and counts are unsigned
+ * LEB128 varints; each string is a varint length followed by that many bytes, with no NUL.
+ * A message holds as many whole records as fit, so record_count may be short of the section.
+ */
+#define RECORD_FORMAT_VERSION 1
+
+/*
+ * Binary section headers, sent by the phone in SECTION_HEADERS of MESSAGE_SECTIONS_METADATA in
+ * the same format:
+ *
+ *   version | first_section_index | record_count | record[record_count]
+ *
+ * where each record holds the stop tag and stop title of section first_section_index + i, as
+ * strings, followed by its stop count as a varint. Sections which don't fit are left out, and
+ * are requested with MESSAGE_REQUEST_SECTION_DATA as usual.
+ */
+
+/*
+ * Arrival times, sent by phones with CAPABILITY_ARRIVAL_TIMES in ARRIVALS of
+ * MESSAGE_STOP_PREDICTION and MESSAGE_SECTION_PREDICTIONS in the same format:
+ *
+ *   version | record_count | record[record_count]
+ *
+ * where each record holds the predicted arrival as a UTC time in seconds (0 if there is no
+ * prediction), then the confidence of the phone in it in percent (0 if unknown), as varints.
+ * A MESSAGE_STOP_PREDICTION holds one record; record i of a MESSAGE_SECTION_PREDICTIONS is the
+ * prediction of stop SECTION_STOP_INDEX + i of the section.
+ */
+
+/*
+ * A cursor over a byte array of records
+ */
+typedef struct RecordReader {
+    const uint8_t *data;
+    uint16_t size;
+    uint16_t offset;
+    // Set once a read runs past the end of the data or finds a malformed value
+    bool failed;
+} RecordReader;
+
+void record_reader_init(RecordReader *reader, const uint8_t *data, uint16_t size);
+
+/*
+ * Read a varint. Return 0 and set reader->failed if there is none.
+ */
+uint32_t record_read_varint(RecordReader *reader);
+
+/*
+ * Read a length-prefixed string into slice, which points into the data.
+ * Return false and set reader->failed if there is none, or it holds a NUL.
+ */
+bool record_read_string(RecordReader *reader, StringSlice *slice);
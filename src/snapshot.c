@@ -0,0 +1,91 @@
+#include <pebble.h>
+#include "snapshot.h"
+#include "checksum.h"
+
+/*
+ * Records are read and written in place, so the snapshot allocates nothing.
+ */
+
+static uint8_t chunk_count_of(uint16_t record_count) {
+    return (record_count + SNAPSHOT_CHUNK_RECORDS - 1) / SNAPSHOT_CHUNK_RECORDS;
+}
+
+/*
+ * Return the number of records of a snapshot of record_count records in its chunk at chunk_index
+ */
+static uint16_t chunk_size_of(uint16_t record_count, uint8_t chunk_index) {
+    uint16_t remaining = record_count - chunk_index * SNAPSHOT_CHUNK_RECORDS;
+    return remaining < SNAPSHOT_CHUNK_RECORDS ? remaining : SNAPSHOT_CHUNK_RECORDS;
+}
+
+uint16_t snapshot_read(SnapshotHeader *header, SnapshotRecord records[SNAPSHOT_MAX_RECORDS]) {
+    if (persist_read_data(SNAPSHOT_HEADER_KEY, header, sizeof(SnapshotHeader)) != sizeof(SnapshotHeader) ||
+            header->version != SNAPSHOT_VERSION || header->record_count > SNAPSHOT_MAX_RECORDS)
+        return 0;
+
+    // Each chunk holds whole records, so they are read straight into place
+    uint16_t record_count = header->record_count;
+    for (uint8_t i = 0; i < chunk_count_of(record_count); i++) {
+        int size = chunk_size_of(record_count, i) * sizeof(SnapshotRecord);
+        if (persist_read_data(SNAPSHOT_CHUNK_KEY + i, &records[i * SNAPSHOT_CHUNK_RECORDS], size) != size)
+            return 0;
+    }
+    if (checksum_update(CHECKSUM_INITIAL, (const uint8_t *) records, record_count * sizeof(SnapshotRecord)) != header->checksum)
+        return 0;
+    return record_count;
+}
+
+bool snapshot_write(uint32_t generation, uint32_t written_time, const SnapshotRecord *records, uint16_t record_count) {
+    if (record_count > SNAPSHOT_MAX_RECORDS)
+        record_count = SNAPSHOT_MAX_RECORDS;
+    if (record_count == 0) {
+        snapshot_clear();
+        return true;
+    }
+
+    SnapshotHeader previous;
+    bool has_previous = persist_read_data(SNAPSHOT_HEADER_KEY, &previous, sizeof(SnapshotHeader)) == sizeof(SnapshotHeader);
+
+    uint8_t chunk_count = chunk_count_of(record_count);
+    for (uint8_t i = 0; i < chunk_count; i++) {
+        size_t size = chunk_size_of(record_count, i) * sizeof(SnapshotRecord);
+        if (persist_write_data(SNAPSHOT_CHUNK_KEY + i, &records[i * SNAPSHOT_CHUNK_RECORDS], size) < 0) {
+            snapshot_clear();
+            return false;
+        }
+    }
+
+    // Free chunks left over from a larger snapshot
+    if (has_previous && previous.record_count <= SNAPSHOT_MAX_RECORDS) {
+        for (uint8_t i = chunk_count; i < chunk_count_of(previous.record_count); i++)
+            persist_delete(SNAPSHOT_CHUNK_KEY + i);
+    }
+
+    SnapshotHeader header = {
+        .version = SNAPSHOT_VERSION,
+        .generation = generation,
+        .written_time = written_time,
+        .record_count = record_count,
+        .checksum = checksum_update(CHECKSUM_INITIAL, (const uint8_t *) records, record_count * sizeof(SnapshotRecord))
+    };
+    if (persist_write_data(SNAPSHOT_HEADER_KEY, &header, sizeof(SnapshotHeader)) < 0) {
+        snapshot_clear();
+        return false;
+    }
+    return true;
+}
+
+uint16_t snapshot_prune(SnapshotRecord *records, uint16_t record_count, uint32_t now) {
+    uint16_t kept = 0;
+    for (uint16_t i = 0; i < record_count; i++) {
+        if ((int32_t) (now - records[i].arrival_time) < SNAPSHOT_ARRIVAL_GRACE_SECONDS)
+            records[kept++] = records[i];
+    }
+    return kept;
+}
+
+void snapshot_clear(void) {
+    persist_delete(SNAPSHOT_HEADER_KEY);
+    for (uint8_t i = 0; i < SNAPSHOT_MAX_CHUNKS; i++)
+        persist_delete(SNAPSHOT_CHUNK_KEY + i);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <pebble.h>
+
+/*
+ * The predictions snapshot: the latest predictions of the stops of the cached stop list, kept
+ * in persistent storage so they can be shown at the next launch before the phone is reachable.
+ * Arrivals which have come by then are pruned as the snapshot is loaded.
+ *
+ * The snapshot is a SnapshotHeader, stored under SNAPSHOT_HEADER_KEY, and its records in chunks
+ * of SNAPSHOT_CHUNK_RECORDS whole records, stored under consecutive keys from SNAPSHOT_CHUNK_KEY.
+ * The header is written last, so a write interrupted part way fails the checksum of the header
+ * it leaves behind.
+ */
+
+// Bump whenever the layout of SnapshotHeader or SnapshotRecord changes
+#define SNAPSHOT_VERSION 1
+
+// Keys after those of the stop list cache (see cache.c)
+#define SNAPSHOT_HEADER_KEY 200
+#define SNAPSHOT_CHUNK_KEY 201
+
+typedef struct __attribute__((__packed__)) SnapshotHeader {
+    uint8_t version;
+    // Generation of the stop list the records belong to; never 0
+    uint32_t generation;
+    // When the snapshot was written, as a UTC time
+    uint32_t written_time;
+    uint16_t record_count;
+    // Adler-32 of the records
+    uint32_t checksum;
+} SnapshotHeader;
+
+/*
+ * The prediction of one stop, by its position in the stop list
+ */
+typedef struct __attribute__((__packed__)) SnapshotRecord {
+    uint16_t section_index;
+    uint16_t stop_index;
+    // Predicted arrival, as a UTC time
+    uint32_t arrival_time;
+    // Seconds between when the prediction was received and written_time, at most UINT16_MAX
+    uint16_t age;
+    // Confidence of the phone in arrival_time, in percent; 0 if unknown
+    uint8_t confidence;
+} SnapshotRecord;
+
+// Persistent storage is 4 KB per app, most of which goes to the stop list cache
+#define SNAPSHOT_SIZE_BUDGET 512
+#define SNAPSHOT_CHUNK_RECORDS ((uint16_t) (PERSIST_DATA_MAX_LENGTH / sizeof(SnapshotRecord)))
+#define SNAPSHOT_MAX_CHUNKS (SNAPSHOT_SIZE_BUDGET / PERSIST_DATA_MAX_LENGTH)
+#define SNAPSHOT_MAX_RECORDS (SNAPSHOT_MAX_CHUNKS * SNAPSHOT_CHUNK_RECORDS)
+
+// Records whose bus came longer ago than this, in seconds, are dropped
+#define SNAPSHOT_ARRIVAL_GRACE_SECONDS 60
+
+/*
+ * Read the snapshot into header and records. Return the number of records, or 0 if there is no
+ * snapshot or it is from another version or fails its checksum.
+ */
+uint16_t snapshot_read(SnapshotHeader *header, SnapshotRecord records[SNAPSHOT_MAX_RECORDS]);
+
+/*
+ * Write record_count records, at most SNAPSHOT_MAX_RECORDS, as the snapshot of the list of the
+ * given generation as of written_time, deleting the snapshot if there are none. Return false
+ * if it could not be written; the snapshot is then deleted.
+ */
+bool snapshot_write(uint32_t generation, uint32_t written_time, const SnapshotRecord *records, uint16_t record_count);
+
+/*
+ * Drop the records whose bus came longer ago than SNAPSHOT_ARRIVAL_GRACE_SECONDS before now,
+ * keeping the others in order. Return the number of records kept.
+ */
+uint16_t snapshot_prune(SnapshotRecord *records, uint16_t record_count, uint32_t now);
+
+/*
+ * Delete the snapshot.
+ */
+void snapshot_clear(void);
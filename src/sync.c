@@ -1,148 +1,418 @@
 #include <pebble.h>
 #include "sync.h"
 #include "data.h"
+#include "cache.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "records.h"
+#include "trace.h"
 
-/* Message fields */
-enum {
-    // Message type
-    MESSAGE_TYPE = 0,           // uint8_t
-    // Sections
-    SECTION_INDEX = 1,          // uint16_t
-    SECTION_COUNT = 2,          // uint16_t
-    SECTION_STOP_TAG = 3,       // char *
-    SECTION_STOP_TITLE = 4,     // char *
-    SECTION_STOP_COUNT = 5,     // uint16_t
-    // Stops
-    SECTION_STOP_INDEX = 6,     // uint16_t
-    STOP_ROUTE_TAG = 7,         // char *
-    STOP_ROUTE_TITLE = 8,       // char *
-    STOP_DIRECTION_TAG = 9,     // char *
-    STOP_DIRECTION_TITLE = 10,  // char *
-    STOP_PREDICTION = 11,       // char *
-    STOP_MINUTES_LABEL = 12     // char *
-};
-
-/* Possible message types */
-enum {
-    MESSAGE_REQUEST_SECTIONS_METADATA = 0,
-    MESSAGE_REQUEST_SECTION_DATA = 1,
-    MESSAGE_REQUEST_STOP_DATA = 2,
-    MESSAGE_REQUEST_STOP_PREDICTION = 3,
-    MESSAGE_SECTIONS_METADATA = 4,
-    MESSAGE_SECTION_DATA = 5,
-    MESSAGE_STOP_DATA = 6,
-    MESSAGE_STOP_PREDICTION = 7
-};
+// Shortest time between two pushed predictions, in seconds; changes in between are coalesced
+#define PREDICTION_INTERVAL_SECONDS 30
+
+// Longest route or stop tag which can be subscribed to, including the NUL
+#define MAX_TAG_LENGTH 32
+
+// Bounds of the request window
+#define MAX_WINDOW_SIZE 8
+#define DEFAULT_WINDOW_SIZE 4
+
+// Time to wait for the reply to a request in the window before sending it again
+#define REPLY_TIMEOUT_MS 10000
+
+// In lazy mode, stops left in the selected section when the next section is loaded ahead
+#define PREFETCH_STOPS 3
+
+// Section index standing for no section
+#define NO_SECTION UINT16_MAX
+
+// Text prediction records found in each pass over a MESSAGE_SECTION_PREDICTIONS
+#define PREDICTION_CHUNK_SIZE 16
+
+// Bounds of the outbound queue and of the delay between retries after a failed send
+#define QUEUE_SIZE 8
+#define MIN_RETRY_DELAY_MS 250
+#define MAX_RETRY_DELAY_MS 16000
+
+/*
+ * A message waiting for the outbox. Requests for sections and stops of the stop list aren't
+ * queued; they are derived from the sync state whenever nothing queued is waiting.
+ */
+typedef struct QueuedMessage {
+    uint8_t message_type;
+    // Section, for MESSAGE_REQUEST_SECTION_PREDICTIONS
+    uint16_t section_index;
+} QueuedMessage;
+
+/*
+ * A stop list request which has been sent to the phone and is awaiting its reply
+ */
+typedef struct PendingRequest {
+    bool in_use;
+    uint8_t sequence;
+    uint8_t message_type;
+    uint16_t section_index;
+    uint16_t stop_index;
+    // When the request was sent, by metrics_now
+    uint32_t sent_ms;
+} PendingRequest;
+
+/*
+ * How far the sync of a list has got: the generation of the list, and the first record not yet
+ * received in list order. In lazy mode, where stops are loaded on demand, only sections count.
+ */
+typedef struct SyncCheckpoint {
+    uint32_t generation;
+    uint16_t section_index;
+    uint16_t stop_index;
+} SyncCheckpoint;
 
 // A list of stops by section
 static StopList *stop_list = NULL;
 
+// The last complete list, which stays valid while its replacement is synced in the background
+static StopList *previous_list = NULL;
+
+// Capabilities negotiated with the phone in the last MESSAGE_SECTIONS_METADATA
+static uint32_t capabilities = 0;
+
+// Size of the AppMessage inbox, which bounds the size of a batch
+static uint32_t inbox_size = 0;
+
+// Requests awaiting a reply. window_size adapts to the link between 1 and max_window_size.
+static PendingRequest window[MAX_WINDOW_SIZE];
+static uint8_t pending_count = 0;
+static uint8_t window_size = 1;
+static uint8_t max_window_size = DEFAULT_WINDOW_SIZE;
+
+// Sequence number of the next request
+static uint8_t next_sequence = 0;
+
+// True while a message is in the outbox; AppMessage sends one message at a time
+static bool outbox_busy = false;
+
+// True while the stop list is being synced
+static bool loading = false;
+
+// Index of the next stop to request, for each section of stop_list
+static uint16_t *stop_cursors = NULL;
+
+// Progress of the sync of stop_list. A sync cut off by a lost connection resumes from here.
+static SyncCheckpoint checkpoint;
+
+// In lazy mode, the stops of a section are only requested once it is viewed, by sync_load_section
+// or sync_set_focus. section_views holds the view_clock of the last view of each section, or 0
+// if it isn't wanted; the least recently viewed sections are evicted first when memory runs out.
+static bool lazy = false;
+static uint32_t *section_views = NULL;
+static uint32_t view_clock = 0;
+
 // Callback for when the stop list is fully loaded
 static void (*stops_loaded_callback)(StopList *) = NULL;
 
+// Callback for when more of a list with nothing on screen before it has been received
+static void (*stops_progress_callback)(StopList *) = NULL;
+
+// The list last passed to the app, and its number of complete leading sections at the time
+static StopList *shown_list = NULL;
+static uint16_t shown_section_count = 0;
+
+// Callback for when stops of a wanted section have been loaded, in lazy mode
+static void (*section_loaded_callback)(StopList *, uint16_t section_index) = NULL;
+
 // Callback for when a stop prediction has been loaded
-static void (*stop_prediction_loaded_callback)(char *prediction, char *minutes_label) = NULL;
+static void (*stop_prediction_loaded_callback)(const Prediction *prediction) = NULL;
+
+// The stop whose predictions are wanted, if subscribed
+static bool subscribed = false;
+static char subscribed_route_tag[MAX_TAG_LENGTH];
+static char subscribed_stop_tag[MAX_TAG_LENGTH];
+
+// The stop of a single prediction request
+static char prediction_route_tag[MAX_TAG_LENGTH];
+static char prediction_stop_tag[MAX_TAG_LENGTH];
+
+// The stop of the last MESSAGE_REQUEST_STOP_PREDICTION sent, for replies which don't name it
+static char requested_route_tag[MAX_TAG_LENGTH];
+static char requested_stop_tag[MAX_TAG_LENGTH];
+
+// Messages waiting for the outbox, as a ring
+static QueuedMessage queue[QUEUE_SIZE];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+
+// Holds back sending after a failure, for retry_delay_ms, which doubles with each failure
+static AppTimer *retry_timer = NULL;
+static uint32_t retry_delay_ms = 0;
+
+// Fires when no reply has arrived for REPLY_TIMEOUT_MS while requests are in the window
+static AppTimer *reply_timer = NULL;
+
+// Callback for when the predictions of a section have been loaded
+static void (*section_predictions_loaded_callback)(StopList *, uint16_t section_index) = NULL;
 
 /**********************************************************
  ** UTILITIES
  **********************************************************/
 
 /*
- * Return the name of the given message type
+ * Return the list on screen: the last complete list while its replacement is synced,
+ * otherwise the current list
+ */
+static StopList *displayed_list(void) {
+    return previous_list != NULL ? previous_list : stop_list;
+}
+
+/*
+ * Return true if the list is loaded as far as it is synced up front: every section and stop,
+ * or in lazy mode every section, whose stops are loaded on demand
+ */
+static bool list_loaded(StopList *list) {
+    if (lazy)
+        return stop_list_received_prefix(list) == list->section_count;
+    return stop_list_is_complete(list);
+}
+
+/*
+ * Return true if stop list data is being requested: while the list is synced, and in lazy mode
+ * for as long as it is the list on screen
  */
-static char *translate_message_type(unsigned char message_type) {
+static bool fetching(void) {
+    return loading || (lazy && stop_cursors != NULL);
+}
+
+/*
+ * Copy a tag into a buffer of MAX_TAG_LENGTH bytes, truncating it to fit
+ */
+static void copy_tag(char *buffer, const char *tag) {
+    strncpy(buffer, tag, MAX_TAG_LENGTH - 1);
+    buffer[MAX_TAG_LENGTH - 1] = '\0';
+}
+
+/**********************************************************
+ ** OUTBOUND QUEUE
+ **********************************************************/
+
+static void pump_requests(void);
+
+/*
+ * Return the priority of a queued message type; higher goes first. Predictions are what the
+ * user is looking at, so they jump ahead of the stop list sync.
+ */
+static uint8_t message_priority(uint8_t message_type) {
     switch (message_type) {
-        case MESSAGE_REQUEST_SECTIONS_METADATA:
-            return "MESSAGE_REQUEST_SECTIONS_METADATA";
-        case MESSAGE_REQUEST_SECTION_DATA:
-            return "MESSAGE_REQUEST_SECTION_DATA";
-        case MESSAGE_REQUEST_STOP_DATA:
-            return "MESSAGE_REQUEST_STOP_DATA";
+        case MESSAGE_SUBSCRIBE_STOP_PREDICTION:
         case MESSAGE_REQUEST_STOP_PREDICTION:
-            return "MESSAGE_REQUEST_STOP_PREDICTION";
-        case MESSAGE_SECTIONS_METADATA:
-            return "MESSAGE_SECTIONS_METADATA";
-        case MESSAGE_SECTION_DATA:
-            return "MESSAGE_SECTION_DATA";
-        case MESSAGE_STOP_DATA:
-            return "MESSAGE_STOP_DATA";
-        case MESSAGE_STOP_PREDICTION:
-            return "MESSAGE_STOP_PREDICTION";
+            return 3;
+        case MESSAGE_REQUEST_SECTION_PREDICTIONS:
+            return 2;
+        case MESSAGE_REQUEST_SECTIONS_METADATA:
+            return 1;
         default:
-            return "MESSAGE_UNKNOWN";
+            return 0;
     }
 }
 
 /*
- * Return the name of the given message field
+ * Queue a message for the outbox. A message of the same type which is still waiting is
+ * coalesced with it, and goes out with the latest arguments.
  */
-static char *translate_message_field(int message_field) {
-    switch (message_field) {
-        case MESSAGE_TYPE:
-            return "MESSAGE_TYPE";
-        case SECTION_INDEX:
-            return "SECTION_INDEX";
-        case SECTION_COUNT:
-            return "SECTION_COUNT";
-        case SECTION_STOP_TITLE:
-            return "SECTION_STOP_TITLE";
-        case SECTION_STOP_COUNT:
-            return "SECTION_STOP_COUNT";
-        case SECTION_STOP_INDEX:
-            return "SECTION_STOP_INDEX";
-        default:
-            return "UNKNOWN_FIELD";
-    }
-}
-
-/*
- * Return the name of the given AppMessageResult
- */
-static char *translate_error(AppMessageResult result) {
-    switch (result) {
-        case APP_MSG_OK:
-            return "APP_MSG_OK";
-        case APP_MSG_SEND_TIMEOUT:
-            return "APP_MSG_SEND_TIMEOUT";
-        case APP_MSG_SEND_REJECTED:
-            return "APP_MSG_SEND_REJECTED";
-        case APP_MSG_NOT_CONNECTED:
-            return "APP_MSG_NOT_CONNECTED";
-        case APP_MSG_APP_NOT_RUNNING:
-            return "APP_MSG_APP_NOT_RUNNING";
-        case APP_MSG_INVALID_ARGS:
-            return "APP_MSG_INVALID_ARGS";
-        case APP_MSG_BUSY:
-            return "APP_MSG_BUSY";
-        case APP_MSG_BUFFER_OVERFLOW:
-            return "APP_MSG_BUFFER_OVERFLOW";
-        case APP_MSG_ALREADY_RELEASED:
-            return "APP_MSG_ALREADY_RELEASED";
-        case APP_MSG_CALLBACK_ALREADY_REGISTERED:
-            return "APP_MSG_CALLBACK_ALREADY_REGISTERED";
-        case APP_MSG_CALLBACK_NOT_REGISTERED:
-            return "APP_MSG_CALLBACK_NOT_REGISTERED";
-        case APP_MSG_OUT_OF_MEMORY:
-            return "APP_MSG_OUT_OF_MEMORY";
-        case APP_MSG_CLOSED:
-            return "APP_MSG_CLOSED";
-        case APP_MSG_INTERNAL_ERROR:
-            return "APP_MSG_INTERNAL_ERROR";
-        default:
-            return "UNKNOWN ERROR";
+static void queue_push(uint8_t message_type, uint16_t section_index) {
+    for (int i = 0; i < queue_count; i++) {
+        QueuedMessage *message = &queue[(queue_head + i) % QUEUE_SIZE];
+        if (message->message_type == message_type) {
+            message->section_index = section_index;
+            return;
+        }
+    }
+    if (queue_count == QUEUE_SIZE) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Outbound queue is full; dropping %s", translate_message_type(message_type));
+        return;
+    }
+    queue[(queue_head + queue_count) % QUEUE_SIZE] = (QueuedMessage) {
+        .message_type = message_type,
+        .section_index = section_index
+    };
+    queue_count++;
+}
+
+/*
+ * Take the first message of the highest priority out of the queue.
+ * Return false if the queue is empty.
+ */
+static bool queue_pop(QueuedMessage *message) {
+    if (queue_count == 0)
+        return false;
+    uint8_t best = 0;
+    for (uint8_t i = 1; i < queue_count; i++) {
+        if (message_priority(queue[(queue_head + i) % QUEUE_SIZE].message_type) >
+                message_priority(queue[(queue_head + best) % QUEUE_SIZE].message_type))
+            best = i;
+    }
+    *message = queue[(queue_head + best) % QUEUE_SIZE];
+
+    // Close the gap by moving the messages ahead of it back, keeping their order
+    for (uint8_t i = best; i > 0; i--)
+        queue[(queue_head + i) % QUEUE_SIZE] = queue[(queue_head + i - 1) % QUEUE_SIZE];
+    queue_head = (queue_head + 1) % QUEUE_SIZE;
+    queue_count--;
+    return true;
+}
+
+static void on_retry_timer(void *data) {
+    retry_timer = NULL;
+    pump_requests();
+}
+
+/*
+ * Hold back sending after a failure, for twice as long as after the last one
+ */
+static void schedule_retry(void) {
+    if (retry_timer != NULL)
+        return;
+    retry_delay_ms = retry_delay_ms == 0 ? MIN_RETRY_DELAY_MS : retry_delay_ms * 2;
+    if (retry_delay_ms > MAX_RETRY_DELAY_MS)
+        retry_delay_ms = MAX_RETRY_DELAY_MS;
+    TRACE_INFO(RETRY_SCHEDULED, retry_delay_ms, 0);
+    retry_timer = app_timer_register(retry_delay_ms, on_retry_timer, NULL);
+}
+
+/*
+ * Send again right away, e.g. once the phone is reachable again
+ */
+static void reset_retry(void) {
+    if (retry_timer != NULL)
+        app_timer_cancel(retry_timer);
+    retry_timer = NULL;
+    retry_delay_ms = 0;
+}
+
+/**********************************************************
+ ** REQUEST WINDOW
+ **********************************************************/
+
+/*
+ * Return the number of requests which may be in flight at once. Phones which don't echo
+ * sequence numbers get one request at a time, since their replies can't be told apart.
+ */
+static uint8_t effective_window_size(void) {
+    return (capabilities & CAPABILITY_SEQUENCED_REQUESTS) ? window_size : 1;
+}
+
+static void window_clear(bool rewind);
+static void window_shrink(void);
+
+/*
+ * Send again every request in the window after its replies stop arriving
+ */
+static void on_reply_timeout(void *data) {
+    reply_timer = NULL;
+    if (pending_count == 0)
+        return;
+    APP_LOG(APP_LOG_LEVEL_WARNING, "No reply to %d requests; requesting them again", pending_count);
+    window_clear(true);
+    window_shrink();
+    pump_requests();
+}
+
+/*
+ * Restart the reply timeout after the window changes, or stop it once the window is empty
+ */
+static void arm_reply_timer(void) {
+    if (pending_count == 0) {
+        if (reply_timer != NULL)
+            app_timer_cancel(reply_timer);
+        reply_timer = NULL;
+        return;
+    }
+    if (reply_timer == NULL || !app_timer_reschedule(reply_timer, REPLY_TIMEOUT_MS))
+        reply_timer = app_timer_register(REPLY_TIMEOUT_MS, on_reply_timeout, NULL);
+}
+
+/*
+ * Track a sent request in the window until its reply arrives
+ */
+static void window_add(uint8_t sequence, uint8_t message_type, uint16_t section_index, uint16_t stop_index) {
+    for (int i = 0; i < MAX_WINDOW_SIZE; i++) {
+        if (!window[i].in_use) {
+            window[i] = (PendingRequest) {
+                .in_use = true,
+                .sequence = sequence,
+                .message_type = message_type,
+                .section_index = section_index,
+                .stop_index = stop_index,
+                .sent_ms = metrics_now()
+            };
+            pending_count++;
+            arm_reply_timer();
+            return;
+        }
+    }
+}
+
+/*
+ * Return the pending request with the given sequence number, or NULL if there is none
+ */
+static PendingRequest *window_find(uint8_t sequence) {
+    for (int i = 0; i < MAX_WINDOW_SIZE; i++) {
+        if (window[i].in_use && window[i].sequence == sequence)
+            return &window[i];
+    }
+    return NULL;
+}
+
+/*
+ * Return true if a request of the given type for the given section is awaiting its reply
+ */
+static bool window_contains(uint8_t message_type, uint16_t section_index) {
+    for (int i = 0; i < MAX_WINDOW_SIZE; i++) {
+        if (window[i].in_use && window[i].message_type == message_type && window[i].section_index == section_index)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Remove a request from the window. If its reply will never arrive, rewind so that the
+ * request is sent again.
+ */
+static void window_release(PendingRequest *request, bool rewind) {
+    if (rewind && request->message_type == MESSAGE_REQUEST_STOP_DATA && stop_cursors != NULL &&
+            request->section_index < stop_list->section_count &&
+            request->stop_index < stop_cursors[request->section_index]) {
+        stop_cursors[request->section_index] = request->stop_index;
     }
+    if (rewind && request->message_type == MESSAGE_REQUEST_SECTIONS_METADATA)
+        queue_push(MESSAGE_REQUEST_SECTIONS_METADATA, 0);
+    request->in_use = false;
+    pending_count--;
+    arm_reply_timer();
 }
 
 /*
- * Same as dict_find: Tries to find a Tuple with specified key in a dictionary.
- *
- * Logs a message via APP_LOG if the given key could not be found
+ * Remove every request from the window
  */
-static Tuple *dict_find_log(DictionaryIterator *iter, uint32_t key) {
-    Tuple *tuple = dict_find(iter, key);
-    if (tuple == NULL)
-        APP_LOG(APP_LOG_LEVEL_DEBUG, "%s not found in message", translate_message_field(key));
-    return tuple;
+static void window_clear(bool rewind) {
+    for (int i = 0; i < MAX_WINDOW_SIZE; i++) {
+        if (window[i].in_use)
+            window_release(&window[i], rewind);
+    }
+}
+
+/*
+ * Halve the window after the link reports congestion
+ */
+static void window_shrink(void) {
+    window_size = window_size > 1 ? window_size / 2 : 1;
+    TRACE_INFO(WINDOW_SHRUNK, window_size, 0);
+}
+
+/*
+ * Grow the window by one after a reply arrives
+ */
+static void window_grow(void) {
+    if (window_size < max_window_size)
+        window_size++;
 }
 
 /**********************************************************
@@ -150,65 +420,267 @@ static Tuple *dict_find_log(DictionaryIterator *iter, uint32_t key) {
  **********************************************************/
 
 /*
- * Send a request to android for section metadata
+ * Begin an outbound request of the given type, tagged with the next sequence number.
+ * Return false if the outbox is not available.
+ */
+static bool begin_request(DictionaryIterator **iter, uint8_t message_type) {
+    AppMessageResult result = app_message_outbox_begin(iter);
+    if (result != APP_MSG_OK) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Failed to begin message with type %s: %s", translate_message_type(message_type), translate_error(result));
+        return false;
+    }
+    Tuplet message_type_tuplet = TupletInteger(MESSAGE_TYPE, message_type);
+    dict_write_tuplet(*iter, &message_type_tuplet);
+    Tuplet sequence_tuplet = TupletInteger(REQUEST_SEQUENCE, next_sequence);
+    dict_write_tuplet(*iter, &sequence_tuplet);
+    return true;
+}
+
+/*
+ * Send the request begun by begin_request. Return false if it could not be sent.
+ */
+static bool send_request(DictionaryIterator *iter, uint8_t message_type) {
+    uint32_t size = dict_write_end(iter);
+    AppMessageResult result = app_message_outbox_send();
+    if (result != APP_MSG_OK) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Failed to send message with type %s: %s", translate_message_type(message_type), translate_error(result));
+        metrics_count_failed(message_type, result);
+        return false;
+    }
+    metrics_count_sent(message_type, size);
+    TRACE_DEBUG(MESSAGE_SENT, message_type, 0);
+    outbox_busy = true;
+    next_sequence++;
+    return true;
+}
+
+/*
+ * Return the last complete list, which a new sync may build on, or NULL if there is none
+ */
+static StopList *complete_list(void) {
+    if (previous_list != NULL)
+        return previous_list;
+    if (stop_list != NULL && list_loaded(stop_list))
+        return stop_list;
+    return NULL;
+}
+
+/*
+ * Send a request to android for section metadata, advertising the protocol capabilities
+ * of the watch, the size of its inbox and the generation of the list it already has.
+ * Return false if the request could not be sent.
  */
-static void request_section_metadata(void) {
+static bool request_section_metadata(void) {
+    uint8_t sequence = next_sequence;
     DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
-    Tuplet message_type_tuplet = TupletInteger(MESSAGE_TYPE, MESSAGE_REQUEST_SECTIONS_METADATA);
-    dict_write_tuplet(iter, &message_type_tuplet);
-    app_message_outbox_send();
+    if (!begin_request(&iter, MESSAGE_REQUEST_SECTIONS_METADATA)) return false;
+    Tuplet capabilities_tuplet = TupletInteger(PROTOCOL_CAPABILITIES, (uint32_t) SUPPORTED_CAPABILITIES);
+    dict_write_tuplet(iter, &capabilities_tuplet);
+    Tuplet inbox_size_tuplet = TupletInteger(INBOX_SIZE, inbox_size);
+    dict_write_tuplet(iter, &inbox_size_tuplet);
+    StopList *list = complete_list();
+    Tuplet generation_tuplet = TupletInteger(LIST_GENERATION, list == NULL ? (uint32_t) 0 : list->generation);
+    dict_write_tuplet(iter, &generation_tuplet);
+    if (!send_request(iter, MESSAGE_REQUEST_SECTIONS_METADATA)) return false;
+
+    // Track the request so that it is sent again if no reply arrives
+    window_add(sequence, MESSAGE_REQUEST_SECTIONS_METADATA, 0, 0);
+    return true;
 }
 
 /*
- * Send a request to android for the section with the given index
+ * Send a request to android for the section with the given index.
+ * Return false if the request could not be sent.
  */
-static void request_section(int section_index) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Requesting section with section_index == %d", section_index);
+static bool request_section(uint16_t section_index) {
+    TRACE_DEBUG(SECTION_REQUESTED, section_index, 0);
 
+    uint8_t sequence = next_sequence;
     DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
-    Tuplet message_type_tuplet = TupletInteger(MESSAGE_TYPE, MESSAGE_REQUEST_SECTION_DATA);
-    dict_write_tuplet(iter, &message_type_tuplet);
+    if (!begin_request(&iter, MESSAGE_REQUEST_SECTION_DATA)) return false;
     Tuplet section_index_tuplet = TupletInteger(SECTION_INDEX, section_index);
     dict_write_tuplet(iter, &section_index_tuplet);
-    app_message_outbox_send();
+    if (!send_request(iter, MESSAGE_REQUEST_SECTION_DATA)) return false;
+    window_add(sequence, MESSAGE_REQUEST_SECTION_DATA, section_index, 0);
+    return true;
 }
 
 /*
- * Send a request to android for the stop with the given section and stop index
+ * Send a request to android for the stop with the given section and stop index.
+ * Return false if the request could not be sent.
  */
-static void request_stop(int section_index, int stop_index) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Requesting stop with section_index == %d, stop_index == %d", section_index, stop_index);
+static bool request_stop(uint16_t section_index, uint16_t stop_index) {
+    TRACE_DEBUG(STOP_REQUESTED, section_index, stop_index);
 
+    uint8_t sequence = next_sequence;
     DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
-    Tuplet message_type_tuplet = TupletInteger(MESSAGE_TYPE, MESSAGE_REQUEST_STOP_DATA);
-    dict_write_tuplet(iter, &message_type_tuplet);
+    if (!begin_request(&iter, MESSAGE_REQUEST_STOP_DATA)) return false;
     Tuplet section_index_tuplet = TupletInteger(SECTION_INDEX, section_index);
     dict_write_tuplet(iter, &section_index_tuplet);
     Tuplet stop_index_tuplet = TupletInteger(SECTION_STOP_INDEX, stop_index);
     dict_write_tuplet(iter, &stop_index_tuplet);
-    app_message_outbox_send();
+    if (!send_request(iter, MESSAGE_REQUEST_STOP_DATA)) return false;
+    window_add(sequence, MESSAGE_REQUEST_STOP_DATA, section_index, stop_index);
+    return true;
 }
 
 /*
- * Send a request to android for prediction data for the given stop
- * (identified by section index and stop index within the section)
+ * Send a request to android for prediction data for the given stop.
+ * Return false if the request could not be sent.
  */
-static void request_prediction(char *route_tag, char *stop_tag) {
+static bool request_prediction(const char *route_tag, const char *stop_tag) {
     APP_LOG(APP_LOG_LEVEL_DEBUG, "Requesting prediction with route_tag == %s, stop_tag == %s",
         route_tag, stop_tag);
 
     DictionaryIterator *iter;
-    app_message_outbox_begin(&iter);
-    Tuplet message_type_tuplet = TupletInteger(MESSAGE_TYPE, MESSAGE_REQUEST_STOP_PREDICTION);
-    dict_write_tuplet(iter, &message_type_tuplet);
+    if (!begin_request(&iter, MESSAGE_REQUEST_STOP_PREDICTION)) return false;
     Tuplet route_tag_tuplet = TupletCString(STOP_ROUTE_TAG, route_tag);
     dict_write_tuplet(iter, &route_tag_tuplet);
     Tuplet stop_tag_tuplet = TupletCString(SECTION_STOP_TAG, stop_tag);
     dict_write_tuplet(iter, &stop_tag_tuplet);
-    app_message_outbox_send();
+    if (!send_request(iter, MESSAGE_REQUEST_STOP_PREDICTION)) return false;
+    copy_tag(requested_route_tag, route_tag);
+    copy_tag(requested_stop_tag, stop_tag);
+    return true;
+}
+
+/*
+ * Tell android about the latest subscription or unsubscription. Phones which can't push
+ * predictions get a single prediction request instead.
+ * Return false if the message could not be sent.
+ */
+static bool send_subscription(void) {
+    if (!(capabilities & CAPABILITY_PREDICTION_SUBSCRIPTIONS))
+        return !subscribed || request_prediction(subscribed_route_tag, subscribed_stop_tag);
+
+    DictionaryIterator *iter;
+    if (!subscribed) {
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "Unsubscribing from predictions");
+        if (!begin_request(&iter, MESSAGE_UNSUBSCRIBE_STOP_PREDICTION)) return false;
+        return send_request(iter, MESSAGE_UNSUBSCRIBE_STOP_PREDICTION);
+    }
+
+    // TupletCString tests its argument for NULL, which an array never is
+    const char *route_tag = subscribed_route_tag;
+    const char *stop_tag = subscribed_stop_tag;
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Subscribing to predictions with route_tag == %s, stop_tag == %s", route_tag, stop_tag);
+    if (!begin_request(&iter, MESSAGE_SUBSCRIBE_STOP_PREDICTION)) return false;
+    Tuplet route_tag_tuplet = TupletCString(STOP_ROUTE_TAG, route_tag);
+    dict_write_tuplet(iter, &route_tag_tuplet);
+    Tuplet stop_tag_tuplet = TupletCString(SECTION_STOP_TAG, stop_tag);
+    dict_write_tuplet(iter, &stop_tag_tuplet);
+    Tuplet interval_tuplet = TupletInteger(PREDICTION_INTERVAL, (uint16_t) PREDICTION_INTERVAL_SECONDS);
+    dict_write_tuplet(iter, &interval_tuplet);
+    return send_request(iter, MESSAGE_SUBSCRIBE_STOP_PREDICTION);
+}
+
+/*
+ * Send a request to android for the predictions of every stop in the section at
+ * section_index of the list on screen. Return false if the request could not be sent.
+ */
+static bool request_section_predictions(uint16_t section_index) {
+    StopList *list = displayed_list();
+    StopSection *section = list == NULL ? NULL : stop_list_get_section(list, section_index);
+    if (section == NULL) {
+        // The list has changed since; there is nothing to request
+        return true;
+    }
+    const char *stop_tag = stop_list_string(list, section->stop_tag);
+    TRACE_DEBUG(PREDICTIONS_REQUESTED, section_index, 0);
+
+    DictionaryIterator *iter;
+    if (!begin_request(&iter, MESSAGE_REQUEST_SECTION_PREDICTIONS)) return false;
+    Tuplet section_index_tuplet = TupletInteger(SECTION_INDEX, section_index);
+    dict_write_tuplet(iter, &section_index_tuplet);
+    Tuplet stop_tag_tuplet = TupletCString(SECTION_STOP_TAG, stop_tag);
+    dict_write_tuplet(iter, &stop_tag_tuplet);
+    return send_request(iter, MESSAGE_REQUEST_SECTION_PREDICTIONS);
+}
+
+/*
+ * Send the metrics to android. Return false if they could not be sent.
+ */
+static bool send_metrics(void) {
+    DictionaryIterator *iter;
+    if (!begin_request(&iter, MESSAGE_METRICS)) return false;
+    metrics_write(iter);
+    return send_request(iter, MESSAGE_METRICS);
+}
+
+/*
+ * Send a queued message. Return false if it could not be sent.
+ */
+static bool send_queued(QueuedMessage *message) {
+    switch (message->message_type) {
+        case MESSAGE_REQUEST_SECTIONS_METADATA:
+            return request_section_metadata();
+        case MESSAGE_SUBSCRIBE_STOP_PREDICTION:
+            return send_subscription();
+        case MESSAGE_REQUEST_STOP_PREDICTION:
+            return request_prediction(prediction_route_tag, prediction_stop_tag);
+        case MESSAGE_REQUEST_SECTION_PREDICTIONS:
+            return request_section_predictions(message->section_index);
+        case MESSAGE_METRICS:
+            return send_metrics();
+        default:
+            return true;
+    }
+}
+
+/*
+ * Send the next message: the first queued message of the highest priority, or else a request
+ * for the first stop list data which has been neither received nor requested. Stop list
+ * requests go out across sections, so replies for one section may arrive while another is
+ * still in flight. The outbox holds a single message, so this sends at most one; it is called
+ * again once the outbox is free. After a failed send, nothing is sent until the retry timer fires.
+ */
+static void pump_requests(void) {
+    if (outbox_busy || retry_timer != NULL)
+        return;
+
+    QueuedMessage message;
+    while (!outbox_busy && queue_pop(&message)) {
+        if (!send_queued(&message)) {
+            queue_push(message.message_type, message.section_index);
+            schedule_retry();
+            return;
+        }
+    }
+    if (outbox_busy || !fetching() || pending_count >= effective_window_size())
+        return;
+
+    bool batched = capabilities & CAPABILITY_BATCHED_STOPS;
+    for (uint16_t i = 0; i < stop_list->section_count; i++) {
+        StopSection *section = stop_list_get_section(stop_list, i);
+        if (section == NULL) {
+            // Stops can only be requested once the section has arrived
+            if (window_contains(MESSAGE_REQUEST_SECTION_DATA, i))
+                continue;
+            if (!request_section(i))
+                schedule_retry();
+            return;
+        }
+
+        // In lazy mode, only the stops of wanted sections are requested
+        if (lazy && section_views[i] == 0)
+            continue;
+
+        // Skip stops kept from the previous list
+        while (stop_cursors[i] < section->stop_count && stop_list_get_stop(stop_list, i, stop_cursors[i]) != NULL)
+            stop_cursors[i]++;
+        if (stop_cursors[i] >= section->stop_count)
+            continue;
+
+        // The size of a batch isn't known until it arrives, so batches of a section go one at a time
+        if (batched && window_contains(MESSAGE_REQUEST_STOP_DATA, i))
+            continue;
+
+        if (!request_stop(i, stop_cursors[i]))
+            schedule_retry();
+        else if (!batched)
+            stop_cursors[i]++;
+        return;
+    }
 }
 
 /**********************************************************
@@ -216,146 +688,778 @@ static void request_prediction(char *route_tag, char *stop_tag) {
  **********************************************************/
 
 /*
- * Upon receiving sections metadata, create a new stop_list and begin sync by requesting the first section data.
+ * Match a reply to the request it answers and remove that request from the window.
+ * Return false if the reply is stale, i.e. it answers a request from an earlier sync.
  */
-static void on_receive_section_metadata(DictionaryIterator *data) {
-    // Receiving sections metadata; begin to sync a new stop list
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Received a MESSAGE_SECTIONS_METADATA. Syncing...");
+static bool acknowledge_reply(const Message *message) {
+    PendingRequest *request = NULL;
+    if (message->present & FIELD_BIT(REQUEST_SEQUENCE)) {
+        request = window_find(message->sequence);
+        if (request == NULL) {
+            TRACE_DEBUG(STALE_REPLY, message->sequence, 0);
+            return false;
+        }
+    } else {
+        // Phones which don't echo sequence numbers have at most one stop list request in flight
+        for (int i = 0; i < MAX_WINDOW_SIZE && request == NULL; i++) {
+            if (window[i].in_use && window[i].message_type != MESSAGE_REQUEST_SECTIONS_METADATA)
+                request = &window[i];
+        }
+    }
 
-    // Delete existing data
-    stop_list_destroy(stop_list);
+    if (request != NULL) {
+        metrics_count_latency(request->message_type, request->sent_ms);
+        window_release(request, false);
+        window_grow();
+    }
+    return true;
+}
 
-    Tuple *tuple;
+/*
+ * Pass the complete stop list to the app.
+ */
+static void show_stops(void) {
+    shown_list = stop_list;
+    shown_section_count = stop_list->section_count;
+    stops_loaded_callback(stop_list);
+}
 
-    // Get the number of sections we're receiving
-    if ((tuple = dict_find_log(data, SECTION_COUNT)) == NULL) return;
-    uint16_t section_count = tuple->value->uint16;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found section_count == %d", section_count);
+/*
+ * If there is no complete list on screen, pass the list being synced to the app whenever more
+ * sections of it are complete (in lazy mode, received), or whenever it has moved or been
+ * replaced, so the app never holds a stale pointer. The list may be NULL.
+ */
+static void report_progress(void) {
+    if (stops_progress_callback == NULL || previous_list != NULL)
+        return;
+    uint16_t section_count = 0;
+    if (stop_list != NULL)
+        section_count = lazy ? stop_list_received_prefix(stop_list) : stop_list_complete_prefix(stop_list);
+    if (stop_list == shown_list && section_count == shown_section_count)
+        return;
+    shown_list = stop_list;
+    shown_section_count = section_count;
+    stops_progress_callback(stop_list);
+}
+
+/*
+ * In lazy mode, once the list is on screen, pass it to the app after stops of the section at
+ * section_index have arrived, since they may also have moved it.
+ */
+static void report_section_loaded(uint16_t section_index) {
+    if (!lazy || loading || section_loaded_callback == NULL || stop_list == NULL || previous_list != NULL)
+        return;
+    shown_list = stop_list;
+    section_loaded_callback(stop_list, section_index);
+}
 
-    // Create a new stop_list
-    stop_list = stop_list_create(section_count);
+/*
+ * Allocate the request state for a list of section_count sections. Return false if out of memory.
+ */
+static bool alloc_cursors(uint16_t section_count) {
+    stop_cursors = calloc(section_count, sizeof(uint16_t));
+    section_views = calloc(section_count, sizeof(uint32_t));
+    return (stop_cursors != NULL && section_views != NULL) || section_count == 0;
+}
 
-    // Request first section data
-    if (section_count > 0)
-        request_section(0);
+static void free_cursors(void) {
+    free(stop_cursors);
+    stop_cursors = NULL;
+    free(section_views);
+    section_views = NULL;
 }
 
 /*
- * Upon receiving section data, update stop_list with the new data.
+ * Give up on the current sync after running out of memory for the stop list. Once the list is
+ * loaded, only give up on the sections wanted but not fully loaded; the cursors stay, so that
+ * sections can still be loaded on demand once viewed again.
  */
-static void on_receive_section_data(DictionaryIterator *data) {
-    // Received section data
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Received a MESSAGE_SECTION_DATA");
+static void fail_sync(void) {
+    window_clear(false);
+    if (!loading) {
+        APP_LOG(APP_LOG_LEVEL_ERROR, "No room for the stops of the sections wanted");
+        for (uint16_t i = 0; section_views != NULL && i < stop_list->section_count; i++) {
+            StopSection *section = stop_list_get_section(stop_list, i);
+            if (section != NULL && section->loaded_count < section->stop_count)
+                section_views[i] = 0;
+        }
+        return;
+    }
 
-    Tuple *tuple;
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Stopping sync: no room for the stop list");
+    loading = false;
+    free_cursors();
 
-    // Get the index of the section we're receiving
-    if ((tuple = dict_find(data, SECTION_INDEX)) == NULL) return;
-    uint16_t section_index = tuple->value->uint16;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found section_index == %d", section_index);
+    // Fall back to the last complete list
+    if (previous_list != NULL) {
+        stop_list_destroy(stop_list);
+        stop_list = previous_list;
+        previous_list = NULL;
+    }
+}
 
-    // Get the stop tag of the section we're receiving
-    if ((tuple = dict_find(data, SECTION_STOP_TAG)) == NULL) return;
-    char *stop_tag = tuple->value->cstring;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found stop_tag == %s", stop_tag);
+/*
+ * Move the checkpoint past the records of stop_list received since it last moved.
+ */
+static void advance_checkpoint(void) {
+    if (!loading)
+        return;
+    while (checkpoint.section_index < stop_list->section_count) {
+        StopSection *section = stop_list_get_section(stop_list, checkpoint.section_index);
+        if (section == NULL)
+            return;
+        if (!lazy) {
+            while (checkpoint.stop_index < section->stop_count &&
+                    stop_list_get_stop(stop_list, checkpoint.section_index, checkpoint.stop_index) != NULL)
+                checkpoint.stop_index++;
+            if (checkpoint.stop_index < section->stop_count)
+                return;
+        }
+        checkpoint.section_index++;
+        checkpoint.stop_index = 0;
+    }
+}
 
-    // Get the stop title of the section we're receiving
-    if ((tuple = dict_find(data, SECTION_STOP_TITLE)) == NULL) return;
-    char *stop_title = tuple->value->cstring;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found stop_title == %s", stop_title);
+/*
+ * Request the next data not yet received. If the stop list is loaded,
+ * call the stops_loaded_callback callback.
+ */
+static void request_next(void) {
+    if (loading && list_loaded(stop_list)) {
+        // No more stops remain; replace the previous list and call the callback function.
+        // In lazy mode, requests for wanted sections carry on.
+        loading = false;
+        if (!lazy)
+            window_clear(false);
+        stop_list_destroy(previous_list);
+        previous_list = NULL;
+        metrics_sync_completed();
+        dump_stop_list_memory();
+        show_stops();
+
+        // Save the list for the next launch
+        cache_save(stop_list);
+        return;
+    }
+    pump_requests();
+}
+
+/*
+ * Return true if the sync in progress can carry on from its checkpoint under the list
+ * announced by a MESSAGE_SECTIONS_METADATA with the given negotiated capabilities: the
+ * phone must still have the list of the same generation.
+ */
+static bool can_resume(const Message *message, uint32_t new_capabilities) {
+    return loading && stop_list != NULL && stop_cursors != NULL && new_capabilities == capabilities &&
+            (capabilities & CAPABILITY_SECTION_GENERATIONS) && (message->present & FIELD_BIT(LIST_GENERATION)) &&
+            checkpoint.generation != 0 && message->generation == checkpoint.generation &&
+            message->section_count == stop_list->section_count;
+}
+
+/*
+ * Carry on the sync in progress from its checkpoint. Requests cut off with the connection
+ * will never be answered, so the first missing record and everything after it is requested
+ * again; records already received are skipped.
+ */
+static void resume_sync(void) {
+    TRACE_INFO(SYNC_RESUMED, checkpoint.section_index, checkpoint.stop_index);
+    window_clear(false);
+    for (uint16_t i = 0; i < stop_list->section_count; i++)
+        stop_cursors[i] = i == checkpoint.section_index ? checkpoint.stop_index : 0;
+    window_size = 1;
+    request_next();
+}
+
+/*
+ * In lazy mode, evict the stops of the least recently viewed loaded section, other than the
+ * section at section_index. Its title stays, so they can be requested again once it is viewed.
+ * Return false if there is none.
+ */
+static bool evict_section(uint16_t section_index) {
+    int32_t oldest = -1;
+    for (uint16_t i = 0; i < stop_list->section_count; i++) {
+        StopSection *section = stop_list_get_section(stop_list, i);
+        if (i == section_index || section == NULL || section->loaded_count == 0)
+            continue;
+        if (oldest < 0 || section_views[i] < section_views[oldest])
+            oldest = i;
+    }
+    if (oldest < 0)
+        return false;
+
+    TRACE_INFO(SECTION_EVICTED, oldest, stop_list_section_bytes(stop_list, oldest));
+    stop_list_evict_section(stop_list, oldest);
+    stop_cursors[oldest] = 0;
+    section_views[oldest] = 0;
+    return true;
+}
+
+/*
+ * Move the cursor of the section at section_index to stop_index. A failed sync has no cursors.
+ */
+static void move_cursor(uint16_t section_index, uint16_t stop_index) {
+    if (stop_cursors != NULL)
+        stop_cursors[section_index] = stop_index;
+}
+
+/*
+ * Add a stop to stop_list. In lazy mode, if there is no room within the memory budget, evict
+ * the least recently viewed sections until it fits. If it still doesn't fit, give up on the
+ * sync and return false.
+ */
+static bool add_stop(uint16_t section_index, uint16_t stop_index, const StringSlice strings[STOP_STRING_COUNT]) {
+    while (section_add_stop_slices(&stop_list, section_index, stop_index, strings) == NULL) {
+        if (!lazy || !evict_section(section_index)) {
+            fail_sync();
+            return false;
+        }
+    }
+    return true;
+}
 
-    // Get the stop count of the section we're receiving
-    if ((tuple = dict_find(data, SECTION_STOP_COUNT)) == NULL) return;
-    uint16_t stop_count = tuple->value->uint16;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found stop_count == %d", stop_count);
+/*
+ * Read a batch of stop records into the section at section_index, starting at the stop
+ * given by SECTION_STOP_INDEX. Return the index of the stop following the batch, or the cursor
+ * of the section as it was if the batch is malformed, so no stop is skipped.
+ */
+static uint16_t read_stop_batch(DictionaryIterator *data, const Message *message, uint16_t section_index) {
+    uint16_t cursor = stop_cursors != NULL ? stop_cursors[section_index] : 0;
+    // Adding stops may move the list, so keep the stop count rather than the section
+    uint16_t stop_count = stop_list_get_section(stop_list, section_index)->stop_count;
+
+    // Get the index of the first stop in the batch, and the number of stop records in it
+    if (!message_require(message, FIELD_BIT(SECTION_STOP_INDEX) | FIELD_BIT(STOP_RECORD_COUNT))) return cursor;
+    uint16_t first_stop_index = message->stop_index;
+    uint16_t record_count = message->record_count;
+    TRACE_DEBUG(STOP_BATCH, first_stop_index, record_count);
+
+    // Never write past the end of the section
+    if (first_stop_index >= stop_count)
+        return cursor;
+    if (record_count > stop_count - first_stop_index)
+        record_count = stop_count - first_stop_index;
+
+    // Find the fields of every record in one pass
+    char **fields = malloc(record_count * STOP_RECORD_FIELD_COUNT * sizeof(char *));
+    if (fields == NULL && record_count > 0) {
+        fail_sync();
+        return first_stop_index;
+    }
+    message_find_records(data, STOP_RECORD_BASE, STOP_RECORD_FIELD_COUNT, record_count, fields);
+
+    uint16_t stop_index = first_stop_index;
+    for (uint16_t i = 0; i < record_count; i++) {
+        char **record = &fields[i * STOP_RECORD_FIELD_COUNT];
+        StringSlice strings[STOP_STRING_COUNT];
+        bool truncated = false;
+        for (int j = 0; j < STOP_STRING_COUNT; j++) {
+            truncated |= record[j] == NULL;
+            strings[j] = (StringSlice) { record[j], record[j] == NULL ? 0 : strlen(record[j]) };
+        }
+        // Request the rest of a truncated batch from the first missing stop
+        if (truncated || !add_stop(section_index, stop_index, strings))
+            break;
+        stop_index++;
+    }
+    free(fields);
+    return stop_index;
+}
+
+/*
+ * Read the binary stop records in tuple (see records.h) into their section, and move the cursor
+ * of the section past them. The stops are copied straight from the message into the list.
+ * Records after a malformed one are dropped, so they are requested again.
+ * Return the index of the section, or NO_SECTION if no records were read.
+ */
+static uint16_t read_stop_records(Tuple *tuple) {
+    if (tuple->type != TUPLE_BYTE_ARRAY) return NO_SECTION;
+    RecordReader reader;
+    record_reader_init(&reader, tuple->value->data, tuple->length);
+
+    uint32_t version = record_read_varint(&reader);
+    if (version != RECORD_FORMAT_VERSION) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Ignoring stop records with version %lu", (unsigned long) version);
+        return NO_SECTION;
+    }
+
+    // Get the section, the index of its first stop in the records, and the number of records
+    uint32_t section_index = record_read_varint(&reader);
+    uint32_t first_stop_index = record_read_varint(&reader);
+    uint32_t record_count = record_read_varint(&reader);
+    StopSection *section = section_index > UINT16_MAX ? NULL : stop_list_get_section(stop_list, section_index);
+    if (reader.failed || section == NULL) return NO_SECTION;
+    TRACE_DEBUG(STOP_RECORDS, section_index, record_count);
+
+    // Never write past the end of the section
+    uint16_t stop_count = section->stop_count;
+    if (first_stop_index >= stop_count) return NO_SECTION;
+    if (record_count > stop_count - first_stop_index)
+        record_count = stop_count - first_stop_index;
+
+    uint16_t stop_index = first_stop_index;
+    for (uint32_t i = 0; i < record_count; i++) {
+        StringSlice strings[STOP_STRING_COUNT];
+        for (int j = 0; j < STOP_STRING_COUNT; j++)
+            record_read_string(&reader, &strings[j]);
+        if (reader.failed) {
+            APP_LOG(APP_LOG_LEVEL_WARNING, "Malformed stop record at stop_index == %d", stop_index);
+            break;
+        }
+        if (!add_stop(section_index, stop_index, strings))
+            break;
+        stop_index++;
+    }
+    move_cursor(section_index, stop_index);
+    return section_index;
+}
+
+/*
+ * Read the generation of each of section_count sections from SECTION_GENERATIONS into
+ * generations. Sections the phone sends no generation for get generation 0, which never matches.
+ */
+static void read_section_generations(const Message *message, uint16_t section_count, uint32_t *generations) {
+    // An empty list has no generations, nor room for any
+    if (section_count == 0) return;
+    memset(generations, 0, section_count * sizeof(uint32_t));
+    if (!message_require(message, FIELD_BIT(SECTION_GENERATIONS))) return;
+    Tuple *tuple = message->section_generations;
+    uint16_t count = tuple->length / 4;
+    if (count > section_count)
+        count = section_count;
+    for (uint16_t i = 0; i < count; i++) {
+        const uint8_t *bytes = tuple->value->data + i * 4;
+        generations[i] = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+    }
+}
+
+/*
+ * Rearrange the list by the section generations in SECTION_GENERATIONS, keeping the sections
+ * whose generation hasn't changed, and set the generation of the list. If there is no room
+ * for this, destroy the list and set it to NULL.
+ */
+static void splice_generations(StopList **list, const Message *message, uint16_t section_count, uint32_t generation) {
+    uint32_t *generations = malloc(section_count * sizeof(uint32_t));
+    if (generations == NULL && section_count > 0) {
+        stop_list_destroy(*list);
+        *list = NULL;
+        return;
+    }
+    read_section_generations(message, section_count, generations);
+    if (stop_list_splice(list, section_count, generations)) {
+        (*list)->generation = generation;
+    } else {
+        stop_list_destroy(*list);
+        *list = NULL;
+    }
+    free(generations);
+}
+
+/*
+ * Read the section headers in SECTION_HEADERS (see records.h) into stop_list, so the stops of
+ * those sections can be requested right away. Headers after a malformed one are dropped, so
+ * their sections are requested as usual. Return false if out of memory.
+ */
+static bool read_section_headers(const Message *message) {
+    if (!message_require(message, FIELD_BIT(SECTION_HEADERS))) return true;
+    Tuple *tuple = message->section_headers;
+    RecordReader reader;
+    record_reader_init(&reader, tuple->value->data, tuple->length);
+
+    uint32_t version = record_read_varint(&reader);
+    if (version != RECORD_FORMAT_VERSION) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Ignoring section headers with version %lu", (unsigned long) version);
+        return true;
+    }
+
+    // Get the index of the first section in the headers, and the number of headers
+    uint32_t first_section_index = record_read_varint(&reader);
+    uint32_t record_count = record_read_varint(&reader);
+    if (reader.failed) return true;
+    TRACE_DEBUG(SECTION_HEADERS, first_section_index, record_count);
+
+    for (uint32_t i = 0; i < record_count; i++) {
+        // Never write past the end of the list
+        uint32_t section_index = first_section_index + i;
+        if (section_index >= stop_list->section_count)
+            break;
+
+        StringSlice stop_tag, stop_title;
+        record_read_string(&reader, &stop_tag);
+        record_read_string(&reader, &stop_title);
+        uint32_t stop_count = record_read_varint(&reader);
+        if (reader.failed || stop_count > UINT16_MAX) {
+            APP_LOG(APP_LOG_LEVEL_WARNING, "Malformed section header at section_index == %lu", (unsigned long) section_index);
+            break;
+        }
+        if (stop_list_add_section_slices(&stop_list, section_index, stop_tag, stop_title, stop_count) == NULL)
+            return false;
+        metrics_section_received();
+    }
+    return true;
+}
+
+/*
+ * Upon receiving sections metadata, begin to sync a new stop_list by requesting the first
+ * section data. If the phone sends generations, sections which haven't changed since the last
+ * complete list are kept, and an unchanged list is kept as it is; a sync cut off by a lost
+ * connection resumes from its checkpoint if the list it was syncing hasn't changed.
+ */
+static void on_receive_section_metadata(DictionaryIterator *data, const Message *message) {
+    // Receiving sections metadata; begin to sync a new stop list
+    metrics_count_reply(MESSAGE_REQUEST_SECTIONS_METADATA);
+
+    // Get the capabilities the phone will use; phones which don't send any use the per-stop protocol
+    uint32_t new_capabilities = message->capabilities & SUPPORTED_CAPABILITIES;
+    // Binary records are batches, which are only requested in batched mode
+    if (!(new_capabilities & CAPABILITY_BATCHED_STOPS))
+        new_capabilities &= ~CAPABILITY_BINARY_RECORDS;
+
+    if (can_resume(message, new_capabilities)) {
+        resume_sync();
+        return;
+    }
+    capabilities = new_capabilities;
+
+    // Replies to requests for existing data are now stale
+    loading = false;
+    window_clear(false);
+
+    // Keep a loaded list on screen until the new list replaces it; delete a partial one
+    if (stop_list != NULL && previous_list == NULL && list_loaded(stop_list))
+        previous_list = stop_list;
+    else
+        stop_list_destroy(stop_list);
+    stop_list = NULL;
+    free_cursors();
+
+    // Get the number of sections we're receiving
+    uint16_t section_count = message->section_count;
+
+    // Get the total number of stops, if the phone sends it, so the list is allocated once
+    uint16_t stop_count = message->stop_count;
+    TRACE_INFO(LIST_METADATA, section_count, stop_count);
+    TRACE_INFO(LIST_CAPABILITIES, capabilities, message->generation);
+
+    if ((capabilities & CAPABILITY_SECTION_GENERATIONS) && message_require(message, FIELD_BIT(LIST_GENERATION))) {
+        uint32_t generation = message->generation;
+
+        if (previous_list != NULL && generation != 0 && generation == previous_list->generation &&
+                section_count == previous_list->section_count) {
+            // Nothing has changed; keep the list without requesting any of it
+            TRACE_INFO(LIST_UP_TO_DATE, generation, 0);
+            stop_list = previous_list;
+            previous_list = NULL;
+            metrics_sync_completed();
+            show_stops();
+
+            // Stops not yet loaded may still be wanted
+            if (lazy && !alloc_cursors(section_count))
+                free_cursors();
+            return;
+        }
+
+        // Keep the unchanged sections of a copy of the last complete list, which stays on screen
+        if (previous_list != NULL && (stop_list = stop_list_copy(previous_list)) != NULL)
+            splice_generations(&stop_list, message, section_count, generation);
+
+        // Otherwise start from a new list, tagging its sections with their generations
+        if (stop_list == NULL && (stop_list = stop_list_create(section_count, stop_count)) != NULL)
+            splice_generations(&stop_list, message, section_count, generation);
+    } else {
+        // Create a new stop_list
+        stop_list = stop_list_create(section_count, stop_count);
+    }
+
+    // From here on, running out of memory stops this sync rather than the loading of sections
+    loading = true;
+    if (stop_list == NULL || !alloc_cursors(section_count)) {
+        fail_sync();
+        return;
+    }
+
+    // Sections whose headers come up front need not be requested
+    if ((capabilities & CAPABILITY_SECTION_HEADERS) && !read_section_headers(message)) {
+        fail_sync();
+        return;
+    }
+
+    // Request section data, starting with the first section not kept
+    checkpoint = (SyncCheckpoint) { .generation = stop_list->generation };
+    window_size = 1;
+    request_next();
+}
+
+/*
+ * Upon receiving section data, update stop_list with the new data.
+ */
+static void on_receive_section_data(DictionaryIterator *data, const Message *message) {
+    // Received section data
+    if (!fetching() || !acknowledge_reply(message)) return;
+
+    uint16_t section_index = message->section_index;
+    TRACE_DEBUG(SECTION_RECEIVED, section_index, message->stop_count);
+    if (section_index >= stop_list->section_count) return;
 
     // Update stop_list with the new data
-    stop_list_add_section(stop_list, section_index, stop_tag, stop_title, stop_count);
+    if (stop_list_add_section(&stop_list, section_index, message->stop_tag, message->stop_title, message->stop_count) == NULL) {
+        fail_sync();
+        return;
+    }
+    metrics_section_received();
 
-    // Request first stop data
-    if (stop_count > 0)
-        request_stop(section_index, 0);
+    // In batched mode, the section data also carries as many of its stops as fit
+    if ((capabilities & CAPABILITY_BINARY_RECORDS) && (message->present & FIELD_BIT(STOP_RECORDS)))
+        read_stop_records(message->stop_records);
+    else if ((capabilities & CAPABILITY_BATCHED_STOPS) && (message->present & FIELD_BIT(STOP_RECORD_COUNT)))
+        move_cursor(section_index, read_stop_batch(data, message, section_index));
+
+    // Request the next data not yet received
+    request_next();
 }
 
 /*
  * Upon receiving stop data, update stop_list with the new data.
  * If this is the last stop, call the stops_loaded_callback callback.
  */
-static void on_receive_stop_data(DictionaryIterator *data) {
-    // Received section data
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Received a MESSAGE_STOP_DATA");
+static void on_receive_stop_data(DictionaryIterator *data, const Message *message) {
+    // Received stop data
+    if (!fetching() || !acknowledge_reply(message)) return;
 
-    Tuple *tuple;
+    // Binary stop records name their own section
+    if ((capabilities & CAPABILITY_BINARY_RECORDS) && (message->present & FIELD_BIT(STOP_RECORDS))) {
+        uint16_t section_index = read_stop_records(message->stop_records);
+        if (section_index != NO_SECTION)
+            report_section_loaded(section_index);
+        request_next();
+        return;
+    }
 
     // Get the index of the section containing the stop we're receiving
-    if ((tuple = dict_find(data, SECTION_INDEX)) == NULL) return;
-    uint16_t section_index = tuple->value->uint16;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found section_index == %d", section_index);
-
-    // Get the index of the stop we're receiving
-    if ((tuple = dict_find(data, SECTION_STOP_INDEX)) == NULL) return;
-    uint16_t stop_index = tuple->value->uint16;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found stop_index == %d", stop_index);
-
-    // Get the route tag of the stop we're receiving
-    if ((tuple = dict_find(data, STOP_ROUTE_TAG)) == NULL) return;
-    char *route_tag = tuple->value->cstring;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found route_tag == %s", route_tag);
-
-    // Get the route title of the stop we're receiving
-    if ((tuple = dict_find(data, STOP_ROUTE_TITLE)) == NULL) return;
-    char *route_title = tuple->value->cstring;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found route_title == %s", route_title);
-
-    // Get the direction tag of the stop we're receiving
-    if ((tuple = dict_find(data, STOP_DIRECTION_TAG)) == NULL) return;
-    char *direction_tag = tuple->value->cstring;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found direction_tag == %s", direction_tag);    
-
-    // Get the direction title of the stop we're receiving
-    if ((tuple = dict_find(data, STOP_DIRECTION_TITLE)) == NULL) return;
-    char *direction_title = tuple->value->cstring;
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found direction_title == %s", direction_title);
+    if (!message_require(message, FIELD_BIT(SECTION_INDEX))) return;
+    uint16_t section_index = message->section_index;
+    if (stop_list_get_section(stop_list, section_index) == NULL) return;
+
+    // In batched mode, a single message acknowledges a whole batch of stops
+    if ((capabilities & CAPABILITY_BATCHED_STOPS) && (message->present & FIELD_BIT(STOP_RECORD_COUNT))) {
+        move_cursor(section_index, read_stop_batch(data, message, section_index));
+        report_section_loaded(section_index);
+        request_next();
+        return;
+    }
+
+    // Get the index and the strings of the stop we're receiving
+    if (!message_require(message, FIELD_BIT(SECTION_STOP_INDEX) | FIELD_BIT(STOP_ROUTE_TAG) | FIELD_BIT(STOP_ROUTE_TITLE) |
+                                  FIELD_BIT(STOP_DIRECTION_TAG) | FIELD_BIT(STOP_DIRECTION_TITLE))) return;
+    uint16_t stop_index = message->stop_index;
+    TRACE_DEBUG(STOP_RECEIVED, section_index, stop_index);
+    if (stop_index >= stop_list_get_section(stop_list, section_index)->stop_count) return;
 
     // Update stop_list with the new data
-    section_add_stop(stop_list->sections[section_index], stop_index, route_tag, route_title, direction_tag, direction_title);
+    StringSlice strings[STOP_STRING_COUNT] = {
+        { message->route_tag, strlen(message->route_tag) },
+        { message->route_title, strlen(message->route_title) },
+        { message->direction_tag, strlen(message->direction_tag) },
+        { message->direction_title, strlen(message->direction_title) }
+    };
+    if (!add_stop(section_index, stop_index, strings)) return;
+    report_section_loaded(section_index);
 
     // Request next data
-    if (stop_index + 1 < stop_list->sections[section_index]->stop_count) {
-        // More stops remain; request the next stop
-        request_stop(section_index, stop_index + 1);
-    } else if (section_index + 1 < stop_list->section_count) {
-        // More sections remain; request the next section
-        request_section(section_index + 1);
-    } else {
-        // No more stops remain; call the callback function
-        stops_loaded_callback(stop_list);
+    request_next();
+}
+
+/*
+ * Begin reading the records of ARRIVALS with reader. Return the number of records, or 0 if
+ * there are none or they are of another version.
+ */
+static uint32_t begin_arrivals(Tuple *tuple, RecordReader *reader) {
+    record_reader_init(reader, tuple->value->data, tuple->length);
+
+    uint32_t version = record_read_varint(reader);
+    if (version != RECORD_FORMAT_VERSION) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Ignoring arrivals with version %lu", (unsigned long) version);
+        return 0;
     }
+    uint32_t record_count = record_read_varint(reader);
+    return reader->failed ? 0 : record_count;
 }
 
 /*
- * Upon receiving stop prediction data, update stop_list with the new data and call
+ * Read the next arrival record into prediction, as received at now. Return false if it is malformed.
  */
-static void on_receive_stop_prediction(DictionaryIterator *data) {
-    // Received section data
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Received a MESSAGE_STOP_PREDICTION");
+static bool read_arrival(RecordReader *reader, time_t now, Prediction *prediction) {
+    uint32_t arrival_time = record_read_varint(reader);
+    uint32_t confidence = record_read_varint(reader);
+    if (reader->failed) {
+        APP_LOG(APP_LOG_LEVEL_WARNING, "Malformed arrival record");
+        return false;
+    }
+    *prediction = (Prediction) {
+        .arrival_time = arrival_time,
+        .predicted_time = now,
+        .confidence = confidence > 100 ? 100 : confidence
+    };
+    return true;
+}
 
-    Tuple *tuple;
+/*
+ * Convert a prediction sent as text by phones without arrival times, such as "12" (minutes)
+ * or "Due", into an arrival time as of now. Any other text means there is no prediction.
+ */
+static void parse_prediction(const char *text, time_t now, Prediction *prediction) {
+    *prediction = (Prediction) { .predicted_time = now };
+    if (strcmp(text, "Due") == 0) {
+        prediction->arrival_time = now;
+        return;
+    }
 
-    // Get the prediction string of the stop we're receiving
-    if ((tuple = dict_find(data, STOP_PREDICTION)) == NULL) return;
-    char *prediction = malloc(tuple->length);
-    strcpy(prediction, tuple->value->cstring);
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found prediction == %s", prediction);
+    int32_t minutes = 0;
+    const char *digit = text;
+    for (; *digit >= '0' && *digit <= '9' && minutes < 10000; digit++)
+        minutes = minutes * 10 + (*digit - '0');
+    if (digit != text && *digit == '\0')
+        prediction->arrival_time = now + minutes * 60;
+}
+
+/*
+ * Read the prediction of a MESSAGE_STOP_PREDICTION, as arrival times or as text.
+ * Return false if it holds neither.
+ */
+static bool read_prediction(const Message *message, Prediction *prediction) {
+    time_t now = time(NULL);
+    if (message->present & FIELD_BIT(ARRIVALS)) {
+        RecordReader reader;
+        return begin_arrivals(message->arrivals, &reader) >= 1 && read_arrival(&reader, now, prediction);
+    }
+    if (!message_require(message, FIELD_BIT(STOP_PREDICTION) | FIELD_BIT(STOP_MINUTES_LABEL)))
+        return false;
+    parse_prediction(message->prediction, now, prediction);
+    return true;
+}
 
-    // Get the minutes label the stop we're receiving
-    if ((tuple = dict_find(data, STOP_MINUTES_LABEL)) == NULL) return;
-    char *minutes_label = malloc(tuple->length);
-    strcpy(minutes_label, tuple->value->cstring);
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Found minutes_label == %s", minutes_label);
+/*
+ * Store up to record_count predictions of a MESSAGE_SECTION_PREDICTIONS, as arrival times or as
+ * text, into the stops of the section at section_index of list from first_stop_index on. Each
+ * is stored as it is read, so no memory is allocated.
+ */
+static void read_section_predictions(DictionaryIterator *data, const Message *message, StopList *list,
+        uint16_t section_index, uint16_t first_stop_index, uint16_t record_count) {
+    time_t now = time(NULL);
+    Prediction prediction;
+    if (message->present & FIELD_BIT(ARRIVALS)) {
+        RecordReader reader;
+        uint32_t arrival_count = begin_arrivals(message->arrivals, &reader);
+        for (uint16_t i = 0; i < record_count && i < arrival_count; i++) {
+            if (!read_arrival(&reader, now, &prediction))
+                return;
+            stop_set_prediction(list, section_index, first_stop_index + i, &prediction);
+        }
+        return;
+    }
+
+    // Find the fields of the records a chunk at a time, in one pass over the message each
+    char *fields[PREDICTION_CHUNK_SIZE * PREDICTION_RECORD_FIELD_COUNT];
+    for (uint16_t chunk = 0; chunk < record_count; chunk += PREDICTION_CHUNK_SIZE) {
+        uint16_t chunk_count = record_count - chunk < PREDICTION_CHUNK_SIZE ? record_count - chunk : PREDICTION_CHUNK_SIZE;
+        message_find_records(data, PREDICTION_RECORD_BASE + chunk * PREDICTION_RECORD_FIELD_COUNT,
+                             PREDICTION_RECORD_FIELD_COUNT, chunk_count, fields);
+        for (uint16_t i = 0; i < chunk_count; i++) {
+            char **record = &fields[i * PREDICTION_RECORD_FIELD_COUNT];
+            if (record[PREDICTION_RECORD_PREDICTION] == NULL || record[PREDICTION_RECORD_MINUTES_LABEL] == NULL)
+                return;
+            parse_prediction(record[PREDICTION_RECORD_PREDICTION], now, &prediction);
+            stop_set_prediction(list, section_index, first_stop_index + chunk + i, &prediction);
+        }
+    }
+}
+
+/*
+ * Upon receiving stop prediction data, store it into the stops it is for in the list on screen,
+ * found by their tags, whichever window is open. Then call the stop_prediction_loaded_callback
+ * callback if it is for the stop the callback asked about.
+ */
+static void on_receive_stop_prediction(DictionaryIterator *data, const Message *message) {
+    // Received a prediction
+    // Pushed predictions aren't replies
+    if (!(capabilities & CAPABILITY_PREDICTION_SUBSCRIPTIONS))
+        metrics_count_reply(MESSAGE_REQUEST_STOP_PREDICTION);
+
+    Prediction prediction;
+    if (!read_prediction(message, &prediction)) return;
+    TRACE_DEBUG(PREDICTION_RECEIVED, prediction.arrival_time, prediction.confidence);
+
+    // Pushed predictions name their stop; replies are for the stop last requested
+    const char *route_tag = requested_route_tag;
+    const char *stop_tag = requested_stop_tag;
+    uint32_t tags = FIELD_BIT(STOP_ROUTE_TAG) | FIELD_BIT(SECTION_STOP_TAG);
+    if ((message->present & tags) == tags) {
+        route_tag = message->route_tag;
+        stop_tag = message->stop_tag;
+    }
+    StopList *list = displayed_list();
+    if (list != NULL)
+        stop_list_set_prediction_by_tags(list, stop_tag, route_tag, &prediction);
+
+    // Only the stop subscribed to, or last asked about, is passed to the callback
+    if (stop_prediction_loaded_callback == NULL) return;
+    bool wanted = subscribed ?
+        strcmp(route_tag, subscribed_route_tag) == 0 && strcmp(stop_tag, subscribed_stop_tag) == 0 :
+        strcmp(route_tag, prediction_route_tag) == 0 && strcmp(stop_tag, prediction_stop_tag) == 0;
+    if (!wanted) {
+        TRACE_DEBUG(PREDICTION_IGNORED, 0, 0);
+        return;
+    }
 
     // Call the callback function
-    stop_prediction_loaded_callback(prediction, minutes_label);
+    stop_prediction_loaded_callback(&prediction);
+}
+
+/*
+ * Upon receiving the predictions of a section, store them into the stops of the section in the
+ * list on screen and call the section_predictions_loaded_callback callback.
+ */
+static void on_receive_section_predictions(DictionaryIterator *data, const Message *message) {
+    metrics_count_reply(MESSAGE_REQUEST_SECTION_PREDICTIONS);
+
+    StopList *list = displayed_list();
+    if (section_predictions_loaded_callback == NULL || list == NULL) return;
+
+    // Get the section the predictions are for
+    uint16_t section_index = message->section_index;
+    StopSection *section = stop_list_get_section(list, section_index);
+    if (section == NULL) return;
+
+    // The list may have been replaced since the request; drop predictions for another stop
+    if (strcmp(message->stop_tag, stop_list_string(list, section->stop_tag)) != 0) {
+        TRACE_DEBUG(SECTION_PREDICTIONS_IGNORED, section_index, 0);
+        return;
+    }
+
+    // Get the index of the first stop and the number of prediction records
+    uint16_t first_stop_index = message->stop_index;
+    uint16_t record_count = message->record_count;
+    TRACE_DEBUG(SECTION_PREDICTIONS, first_stop_index, record_count);
+
+    // Never write past the end of the section
+    uint16_t stop_count = section->stop_count;
+    if (first_stop_index >= stop_count) return;
+    if (record_count > stop_count - first_stop_index)
+        record_count = stop_count - first_stop_index;
+
+    read_section_predictions(data, message, list, section_index, first_stop_index, record_count);
+    section_predictions_loaded_callback(list, section_index);
+}
+
+/*
+ * Upon a request for metrics, log them and send them to the phone once the outbox is free
+ */
+static void on_receive_request_metrics(DictionaryIterator *data, const Message *message) {
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Received a MESSAGE_REQUEST_METRICS");
+    metrics_dump();
+    dump_stop_list_memory();
+    trace_dump();
+    queue_push(MESSAGE_METRICS, 0);
+    pump_requests();
 }
 
 /**********************************************************
@@ -363,46 +1467,95 @@ static void on_receive_stop_prediction(DictionaryIterator *data) {
  **********************************************************/
 
 static void on_in_message_received(DictionaryIterator *received, void *context) {
-    // First, find the message type
-    Tuple *message_type_tuple = dict_find(received, MESSAGE_TYPE);
-    if (message_type_tuple == NULL) {
-        APP_LOG(APP_LOG_LEVEL_WARNING, "Received a message without message type!");
-        return;
-    }
-    unsigned char message_type = message_type_tuple->value->uint8;
-    // APP_LOG(APP_LOG_LEVEL_DEBUG, "Received message with type %s", translate_message_type(message_type));
+    // First, decode the message; messages without the fields their type requires are dropped
+    Message message;
+    if (!message_decode(received, &message)) return;
+    unsigned char message_type = message.message_type;
+    TRACE_DEBUG(MESSAGE_RECEIVED, message_type, dict_size(received));
+    metrics_count_received(message_type, dict_size(received));
 
     // Determine what to do with the message
     switch(message_type) {
         case MESSAGE_SECTIONS_METADATA:
-            on_receive_section_metadata(received);
+            on_receive_section_metadata(received, &message);
             break;
         case MESSAGE_SECTION_DATA:
-            on_receive_section_data(received);
+            on_receive_section_data(received, &message);
             break;
         case MESSAGE_STOP_DATA:
-            on_receive_stop_data(received);
+            on_receive_stop_data(received, &message);
             break;
         case MESSAGE_STOP_PREDICTION:
-            on_receive_stop_prediction(received);
+            on_receive_stop_prediction(received, &message);
+            break;
+        case MESSAGE_SECTION_PREDICTIONS:
+            on_receive_section_predictions(received, &message);
+            break;
+        case MESSAGE_REQUEST_METRICS:
+            on_receive_request_metrics(received, &message);
             break;
         default:
             APP_LOG(APP_LOG_LEVEL_WARNING, "Unknown message type %d", message_type);
     }
+
+    // Any message may have completed a section, or moved or replaced the list being synced
+    if (stop_list != NULL)
+        advance_checkpoint();
+    report_progress();
 }
 
 static void on_in_message_dropped(AppMessageResult reason, void *context) {
     APP_LOG(APP_LOG_LEVEL_WARNING, "Incoming message was dropped: %s", translate_error(reason));
+    metrics_count_dropped(reason);
+
+    // The dropped message may have been a reply to any pending request; request them all again
+    if (pending_count > 0) {
+        window_clear(true);
+        window_shrink();
+        pump_requests();
+    }
 }
 
 static void on_out_message_delivered(DictionaryIterator *sent, void *context) {
     // unsigned char message_type = dict_find(sent, MESSAGE_TYPE)->value->uint8;
     // APP_LOG(APP_LOG_LEVEL_DEBUG, "Sent message with type %s", translate_message_type(message_type));
+
+    // The outbox is free; keep the window full
+    outbox_busy = false;
+    retry_delay_ms = 0;
+    pump_requests();
 }
 
 static void on_out_message_failed(DictionaryIterator *failed, AppMessageResult reason, void *context) {
-    unsigned char message_type = dict_find(failed, MESSAGE_TYPE)->value->uint8;
+    Message message;
+    message_decode(failed, &message);
+    unsigned char message_type = message.message_type;
     APP_LOG(APP_LOG_LEVEL_WARNING, "Failed to send message with type %s: %s", translate_message_type(message_type), translate_error(reason));
+    metrics_count_failed(message_type, reason);
+    outbox_busy = false;
+
+    // Queue again a message which came from the queue; an unsubscription is resent as the latest subscription
+    switch (message_type) {
+        case MESSAGE_UNSUBSCRIBE_STOP_PREDICTION:
+            message_type = MESSAGE_SUBSCRIBE_STOP_PREDICTION;
+            // Fall through
+        case MESSAGE_SUBSCRIBE_STOP_PREDICTION:
+        case MESSAGE_REQUEST_STOP_PREDICTION:
+        case MESSAGE_REQUEST_SECTION_PREDICTIONS:
+        case MESSAGE_METRICS:
+            queue_push(message_type, message.section_index);
+            break;
+    }
+
+    // A request in the window will never be answered; take it out so that it is sent again
+    PendingRequest *request = (message.present & FIELD_BIT(REQUEST_SEQUENCE)) ? window_find(message.sequence) : NULL;
+    if (request != NULL)
+        window_release(request, true);
+
+    // The phone is congested; shrink the window. Either way, back off before sending again.
+    if (reason == APP_MSG_BUSY || reason == APP_MSG_SEND_TIMEOUT)
+        window_shrink();
+    schedule_retry();
 }
 
 /**********************************************************
@@ -418,21 +1571,141 @@ void init_sync() {
     app_message_register_inbox_dropped(on_in_message_dropped);
     app_message_register_outbox_sent(on_out_message_delivered);
     app_message_register_outbox_failed(on_out_message_failed);
-    app_message_open(app_message_inbox_size_maximum(), app_message_outbox_size_maximum());
+    inbox_size = app_message_inbox_size_maximum();
+    app_message_open(inbox_size, app_message_outbox_size_maximum());
+}
+
+void deinit_sync(void) {
+    // Keep the latest predictions for the next launch
+    cache_save_predictions(complete_list());
+}
+
+void sync_set_window_size(uint8_t size) {
+    if (size < 1)
+        size = 1;
+    if (size > MAX_WINDOW_SIZE)
+        size = MAX_WINDOW_SIZE;
+    max_window_size = size;
+    if (window_size > max_window_size)
+        window_size = max_window_size;
+}
+
+StopList *sync_load_cached_stops(void) {
+    if (stop_list == NULL) {
+        stop_list = cache_load();
+        if (stop_list != NULL)
+            cache_load_predictions(stop_list);
+        shown_list = stop_list;
+        shown_section_count = stop_list == NULL ? 0 : stop_list->section_count;
+    }
+    return stop_list;
 }
 
 void sync_get_stops(void (*on_stops_loaded)(StopList *)) {
+    // Save callback function
+    stops_loaded_callback = on_stops_loaded;
+
     // Send initial message to notify the app has started and request stop data
-    request_section_metadata();
+    metrics_sync_started();
+    queue_push(MESSAGE_REQUEST_SECTIONS_METADATA, 0);
+
+    // The phone forgets subscriptions when the connection drops; renew it
+    if (subscribed)
+        queue_push(MESSAGE_SUBSCRIBE_STOP_PREDICTION, 0);
+
+    // The phone may be reachable again; don't wait out the backoff
+    reset_retry();
+    pump_requests();
+}
+
+void sync_set_stops_progress_callback(void (*on_stops_progress)(StopList *)) {
+    stops_progress_callback = on_stops_progress;
+}
 
+void sync_set_lazy_loading(void (*on_section_loaded)(StopList *, uint16_t section_index)) {
+    lazy = true;
+    section_loaded_callback = on_section_loaded;
+}
+
+/*
+ * Mark the section at section_index of stop_list as viewed now, and request its stops if they
+ * are not loaded. Return false if it isn't a section of the list on screen.
+ */
+static bool want_section(uint16_t section_index) {
+    if (!lazy || section_views == NULL || previous_list != NULL || section_index >= stop_list->section_count)
+        return false;
+    bool wanted = section_views[section_index] != 0;
+    section_views[section_index] = ++view_clock;
+    if (!wanted)
+        pump_requests();
+    return true;
+}
+
+void sync_load_section(uint16_t section_index) {
+    want_section(section_index);
+}
+
+void sync_set_focus(uint16_t section_index, uint16_t stop_index) {
+    if (!want_section(section_index))
+        return;
+
+    // Load the next section ahead once the selection nears the end of this one
+    StopSection *section = stop_list_get_section(stop_list, section_index);
+    if (section != NULL && stop_index + PREFETCH_STOPS >= section->stop_count)
+        want_section(section_index + 1);
+}
+
+void sync_get_prediction(const char *route_tag, const char *stop_tag, void (*on_prediction_loaded)(const Prediction *prediction)) {
     // Save callback function
-    stops_loaded_callback = on_stops_loaded;
+    stop_prediction_loaded_callback = on_prediction_loaded;
+
+    // Request prediction data from android, remembering the stop while the request waits
+    copy_tag(prediction_route_tag, route_tag);
+    copy_tag(prediction_stop_tag, stop_tag);
+    queue_push(MESSAGE_REQUEST_STOP_PREDICTION, 0);
+    pump_requests();
 }
 
-void sync_get_prediction(char *route_tag, char *stop_tag, void (*on_prediction_loaded)(char *prediction, char *minutes_label)) {
-    // Request prediction data from android
-    request_prediction(route_tag, stop_tag);
+void sync_subscribe_prediction(const char *route_tag, const char *stop_tag, void (*on_prediction_loaded)(const Prediction *prediction)) {
+    // Remember the stop, since the subscription may have to wait for the outbox
+    copy_tag(subscribed_route_tag, route_tag);
+    copy_tag(subscribed_stop_tag, stop_tag);
+    subscribed = true;
+    queue_push(MESSAGE_SUBSCRIBE_STOP_PREDICTION, 0);
 
     // Save callback function
     stop_prediction_loaded_callback = on_prediction_loaded;
+
+    pump_requests();
+}
+
+void sync_get_section_predictions(uint16_t section_index, void (*on_section_predictions_loaded)(StopList *, uint16_t section_index)) {
+    // Save callback function
+    section_predictions_loaded_callback = on_section_predictions_loaded;
+
+    // Phones which can't send a whole section would take a round trip per stop; leave the rows as they are
+    if (!(capabilities & CAPABILITY_SECTION_PREDICTIONS))
+        return;
+
+    // Request the latest section once the outbox is free
+    queue_push(MESSAGE_REQUEST_SECTION_PREDICTIONS, section_index);
+    pump_requests();
+}
+
+void sync_refresh_prediction(void) {
+    // Phones which push predictions send changes as they happen
+    if (!subscribed || (capabilities & CAPABILITY_PREDICTION_SUBSCRIPTIONS))
+        return;
+    queue_push(MESSAGE_SUBSCRIBE_STOP_PREDICTION, 0);
+    pump_requests();
+}
+
+void sync_unsubscribe_prediction(void) {
+    // Predictions still in flight are dropped
+    stop_prediction_loaded_callback = NULL;
+    if (!subscribed)
+        return;
+    subscribed = false;
+    queue_push(MESSAGE_SUBSCRIBE_STOP_PREDICTION, 0);
+    pump_requests();
 }
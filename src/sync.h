@@ -7,12 +7,93 @@
  */
 void init_sync();
 
+/*
+ * Save what is worth keeping for the next launch, such as the predictions of the stops.
+ */
+void deinit_sync(void);
+
+/*
+ * Set the maximum number of stop list requests in flight at once (1 to 8, default 4).
+ * The window adapts below this limit when the link is congested.
+ */
+void sync_set_window_size(uint8_t size);
+
+/*
+ * Load the stop list saved by the last complete sync, if any, so it can be shown before the
+ * phone is reachable. Return NULL if there is no usable saved list.
+ */
+StopList *sync_load_cached_stops(void);
+
 /*
  * Sends a request to android for stop data.
+ * A list previously passed to on_stops_loaded, or returned by sync_load_cached_stops, stays
+ * valid until on_stops_loaded is called with its replacement. Called again during a sync, such
+ * as after the connection drops, the sync resumes from the first record not yet received if
+ * the phone still has the same generation of the list; otherwise it starts over.
  */
 void sync_get_stops(void (*on_stops_loaded)(StopList *));
 
+/*
+ * Show the stop list progressively while it syncs with no complete list to show instead, such
+ * as on the first launch. on_stops_progress is passed the list being synced, or NULL, whenever
+ * another of its leading sections is complete (see stop_list_complete_prefix), and whenever it
+ * has moved or been replaced; the previous list passed is then no longer valid. Only the
+ * complete leading sections (in lazy mode, received leading sections) should be shown.
+ * on_stops_loaded is still called once it is loaded.
+ */
+void sync_set_stops_progress_callback(void (*on_stops_progress)(StopList *));
+
+/*
+ * Load the stops of each section of the list on demand, rather than all of them up front.
+ * The list is then loaded, and passed to on_stops_loaded, once every section has been received;
+ * stops still missing are requested by sync_load_section and sync_set_focus, and stops of the
+ * least recently viewed sections are evicted when memory runs out. on_section_loaded is passed
+ * the list on screen whenever stops of the section at section_index arrive; the previous list
+ * passed is then no longer valid.
+ */
+void sync_set_lazy_loading(void (*on_section_loaded)(StopList *, uint16_t section_index));
+
+/*
+ * In lazy mode, record that the section at section_index of the list on screen is viewed, and
+ * request its stops if they are not loaded.
+ */
+void sync_load_section(uint16_t section_index);
+
+/*
+ * In lazy mode, tell sync which stop is selected. Its section is loaded, and the next section
+ * is loaded ahead as the selection nears it.
+ */
+void sync_set_focus(uint16_t section_index, uint16_t stop_index);
+
 /*
  * Sends a request to android for prediction data for the given stop.
  */
-void sync_get_prediction(char *route_tag, char *stop_tag, void (*on_prediction_loaded)(char *prediction, char *minutes_label));
+void sync_get_prediction(const char *route_tag, const char *stop_tag, void (*on_prediction_loaded)(const Prediction *prediction));
+
+/*
+ * Subscribe to prediction data for the given stop, replacing any previous subscription.
+ * The phone pushes a new prediction whenever it changes, at most once per interval; phones
+ * which can't push answer a single request instead. The prediction passed to on_prediction_loaded
+ * is only valid until it returns.
+ */
+void sync_subscribe_prediction(const char *route_tag, const char *stop_tag, void (*on_prediction_loaded)(const Prediction *prediction));
+
+/*
+ * Request the prediction of the subscribed stop again, once it has gone stale (see
+ * stop_prediction_is_stale). Phones which push predictions already send every change, so
+ * nothing is requested from them.
+ */
+void sync_refresh_prediction(void);
+
+/*
+ * Sends a request to android for the predictions of every stop in the section at section_index
+ * of the list on screen, in a single reply, and stores them into the stops of the section.
+ * on_section_predictions_loaded is passed the list on screen. Only the latest section requested
+ * before the outbox is free is sent.
+ */
+void sync_get_section_predictions(uint16_t section_index, void (*on_section_predictions_loaded)(StopList *, uint16_t section_index));
+
+/*
+ * Stop receiving prediction data for the subscribed stop.
+ */
+void sync_unsubscribe_prediction(void);
@@ -0,0 +1,56 @@
+#include <pebble.h>
+#include "trace.h"
+#include "metrics.h"
+
+#if TRACE_LEVEL > TRACE_LEVEL_NONE
+
+#define TRACE_EVENT_FORMAT(name, format) format,
+static const char *const event_formats[TRACE_EVENT_COUNT] = {
+    TRACE_EVENTS(TRACE_EVENT_FORMAT)
+};
+#undef TRACE_EVENT_FORMAT
+
+static TraceEvent events[TRACE_BUFFER_SIZE];
+// Index of the next event to write, and events held
+static uint16_t next_event = 0;
+static uint16_t event_count = 0;
+// Events overwritten before they were dumped
+static uint32_t overwritten = 0;
+
+void trace_record(TraceEventId event, uint32_t arg0, uint32_t arg1) {
+    events[next_event] = (TraceEvent) {
+        .time_ms = metrics_now(),
+        .args = { arg0, arg1 },
+        .event = event
+    };
+    next_event = (next_event + 1) % TRACE_BUFFER_SIZE;
+    if (event_count < TRACE_BUFFER_SIZE)
+        event_count++;
+    else
+        overwritten++;
+}
+
+void trace_dump(void) {
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "====== Dumping %d trace events, %lu overwritten ======",
+            event_count, (unsigned long) overwritten);
+    char line[96];
+    uint16_t first = (next_event + TRACE_BUFFER_SIZE - event_count) % TRACE_BUFFER_SIZE;
+    for (uint16_t i = 0; i < event_count; i++) {
+        TraceEvent *event = &events[(first + i) % TRACE_BUFFER_SIZE];
+        snprintf(line, sizeof(line), event_formats[event->event],
+                (unsigned long) event->args[0], (unsigned long) event->args[1]);
+        APP_LOG(APP_LOG_LEVEL_DEBUG, "%lu: %s", (unsigned long) event->time_ms, line);
+    }
+    event_count = 0;
+    overwritten = 0;
+}
+
+#else
+
+void trace_record(TraceEventId event, uint32_t arg0, uint32_t arg1) {
+}
+
+void trace_dump(void) {
+}
+
+#endif
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <pebble.h>
+
+/*
+ * Trace points for the sync hot path. Unlike APP_LOG, a trace point formats nothing and sends
+ * nothing over Bluetooth: it writes a fixed-size event into a ring buffer in RAM, which is
+ * logged by trace_dump on demand. Trace points above TRACE_LEVEL compile to nothing, and their
+ * arguments are not evaluated.
+ *
+ * TRACE_LEVEL is set at build time, e.g. TRACE_LEVEL=2 pebble build; see wscript.
+ */
+#define TRACE_LEVEL_NONE 0
+// Rare events which explain the course of a sync: retries, evictions, the list received
+#define TRACE_LEVEL_INFO 1
+// Every message and request
+#define TRACE_LEVEL_DEBUG 2
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_NONE
+#endif
+
+// Events kept; older events are overwritten
+#define TRACE_BUFFER_SIZE 32
+
+/*
+ * The events traced, with the format of their two arguments for trace_dump
+ */
+#define TRACE_EVENTS(EVENT) \
+    EVENT(MESSAGE_RECEIVED, "Received message type %lu, %lu bytes") \
+    EVENT(MESSAGE_SENT, "Sent message type %lu") \
+    EVENT(RETRY_SCHEDULED, "Retrying in %lu ms") \
+    EVENT(WINDOW_SHRUNK, "Shrinking request window to %lu") \
+    EVENT(STALE_REPLY, "Ignoring stale reply with sequence == %lu") \
+    EVENT(SECTION_REQUESTED, "Requesting section with section_index == %lu") \
+    EVENT(STOP_REQUESTED, "Requesting stop with section_index == %lu, stop_index == %lu") \
+    EVENT(PREDICTIONS_REQUESTED, "Requesting predictions with section_index == %lu") \
+    EVENT(LIST_METADATA, "Found section_count == %lu, stop_count == %lu") \
+    EVENT(LIST_CAPABILITIES, "Found capabilities == 0x%lx, generation == %lu") \
+    EVENT(LIST_UP_TO_DATE, "Stop list generation %lu is up to date") \
+    EVENT(SYNC_RESUMED, "Resuming sync at section_index == %lu, stop_index == %lu") \
+    EVENT(SECTION_RECEIVED, "Found section_index == %lu, stop_count == %lu") \
+    EVENT(SECTION_HEADERS, "Found section headers starting at section_index == %lu, record_count == %lu") \
+    EVENT(SECTION_EVICTED, "Evicted section_index == %lu, %lu bytes") \
+    EVENT(STOP_RECEIVED, "Found section_index == %lu, stop_index == %lu") \
+    EVENT(STOP_BATCH, "Found batch starting at stop_index == %lu, record_count == %lu") \
+    EVENT(STOP_RECORDS, "Found stop records starting at section_index == %lu, record_count == %lu") \
+    EVENT(PREDICTION_RECEIVED, "Found prediction arriving at %lu, confidence %lu") \
+    EVENT(PREDICTION_IGNORED, "Ignoring prediction for another stop") \
+    EVENT(SECTION_PREDICTIONS, "Found predictions starting at stop_index == %lu, record_count == %lu") \
+    EVENT(SECTION_PREDICTIONS_IGNORED, "Ignoring predictions for section_index == %lu")
+
+#define TRACE_EVENT_ENUM(name, format) TRACE_##name,
+typedef enum TraceEventId {
+    TRACE_EVENTS(TRACE_EVENT_ENUM)
+    TRACE_EVENT_COUNT
+} TraceEventId;
+#undef TRACE_EVENT_ENUM
+
+typedef struct TraceEvent {
+    // metrics_now() when the event was recorded
+    uint32_t time_ms;
+    uint32_t args[2];
+    uint8_t event;
+} TraceEvent;
+
+/*
+ * Record an event in the ring buffer. Use TRACE_INFO and TRACE_DEBUG rather than calling this.
+ */
+void trace_record(TraceEventId event, uint32_t arg0, uint32_t arg1);
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(event, arg0, arg1) trace_record(TRACE_##event, (uint32_t) (arg0), (uint32_t) (arg1))
+#else
+#define TRACE_INFO(event, arg0, arg1) ((void) 0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(event, arg0, arg1) trace_record(TRACE_##event, (uint32_t) (arg0), (uint32_t) (arg1))
+#else
+#define TRACE_DEBUG(event, arg0, arg1) ((void) 0)
+#endif
+
+/*
+ * Log the events in the ring buffer, oldest first, and empty it.
+ */
+void trace_dump(void);
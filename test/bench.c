@@ -0,0 +1,179 @@
+#include <pebble.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fixture.h"
+#include "host.h"
+#include "phone.h"
+#include "protocol.h"
+#include "sync.h"
+
+/*
+ * Build, sync and destroy stop lists from one stop up to thousands, with the strings of the
+ * fake phone, and print a row for each stage: the simulated time it took, the messages and
+ * bytes exchanged, the peak of the heap, the allocations made and the most blocks live at once,
+ * the bytes left allocated afterwards, and the time it took on the host.
+ *
+ * Lists past a few hundred stops don't fit the heap of a watch, so the simulated heap is made
+ * large enough for the largest; the peak column shows which would. Every column but the last
+ * is deterministic, so the table can be diffed from one change to the next. Exits with 1 if a
+ * stage failed: a list couldn't be built or synced, or destroying one left memory allocated.
+ */
+
+// Heap of the simulated watch, room for the largest list
+#define BENCH_HEAP_SIZE (8 * 1024 * 1024)
+
+typedef struct Size {
+    uint16_t section_count;
+    uint16_t stops_per_section;
+} Size;
+
+static const Size sizes[] = {
+    { 1, 1 }, { 2, 5 }, { 10, 10 }, { 50, 10 }, { 100, 10 }, { 200, 10 }, { 250, 20 }
+};
+
+typedef struct Mode {
+    const char *name;
+    // Capabilities of the phone, if the list is synced
+    uint32_t capabilities;
+    // Whether the list is built directly rather than synced
+    bool direct;
+} Mode;
+
+static const Mode modes[] = {
+    { "direct", 0, true },
+    { "legacy", 0, false },
+    { "batched", CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS, false },
+    { "all", SUPPORTED_CAPABILITIES, false }
+};
+
+/*
+ * Counters at the start of a stage, which its row shows the change in
+ */
+typedef struct Stage {
+    uint64_t now_ms;
+    uint64_t host_us;
+    HostMessageStats messages;
+    // Bytes allocated before the list was
+    size_t used;
+} Stage;
+
+static uint64_t host_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Start the counters of a stage, with the heap statistics over from what is allocated now
+ */
+static void stage_start(Stage *stage, size_t used) {
+    host_reset_heap_stats();
+    stage->now_ms = host_now_ms();
+    stage->messages = *host_message_stats();
+    stage->used = used;
+    stage->host_us = host_us();
+}
+
+/*
+ * Build a list of the given size from the strings of the phone, as the watch does from batches
+ * of stops. Return it, or NULL if out of memory.
+ */
+static StopList *build_list(const Size *size) {
+    StopList *list = stop_list_create(size->section_count, size->section_count * size->stops_per_section);
+    for (uint16_t i = 0; list != NULL && i < size->section_count; i++) {
+        char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+        phone_section_strings(i, stop_tag, stop_title);
+        if (stop_list_add_section(&list, i, stop_tag, stop_title, size->stops_per_section) == NULL)
+            break;
+        for (uint16_t j = 0; j < size->stops_per_section; j++) {
+            char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+            phone_stop_strings(i, j, strings);
+            if (section_add_stop(&list, i, j, strings[0], strings[1], strings[2], strings[3]) == NULL)
+                break;
+        }
+    }
+    if (list != NULL && !stop_list_is_complete(list)) {
+        stop_list_destroy(list);
+        list = NULL;
+    }
+    return list;
+}
+
+/*
+ * Print the row of a stage
+ */
+static void print_row(const Mode *mode, const Size *size, const char *name, const Stage *stage, bool passed) {
+    uint64_t elapsed_us = host_us() - stage->host_us;
+    const HostMessageStats *messages = host_message_stats();
+    const HostHeapStats *heap = host_heap_stats();
+    printf("%6u %-8s %-8s %8llu %6u %8u %8u %7u %7u %7u  %-6s %8llu\n",
+           size->section_count * size->stops_per_section, mode->name, name,
+           (unsigned long long) (host_now_ms() - stage->now_ms),
+           messages->sent + messages->received - stage->messages.sent - stage->messages.received,
+           messages->sent_bytes + messages->received_bytes - stage->messages.sent_bytes - stage->messages.received_bytes,
+           (unsigned) heap->peak, heap->allocations, heap->blocks_peak, (unsigned) (heap->used - stage->used),
+           passed ? "ok" : "FAILED", (unsigned long long) elapsed_us);
+}
+
+/*
+ * Build or sync a list of the given size, then destroy it, and print a row for each stage.
+ * Sync keeps its state in statics, so each runs in a process of its own. Return false if a
+ * stage failed.
+ */
+static bool bench(const Mode *mode, const Size *size) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        host_set_heap_size(BENCH_HEAP_SIZE);
+        host_set_link((HostLink) { .latency_ms = 50, .bytes_per_second = 4000, .timeout_ms = 1000, .inbox_size = 2026 });
+        PhoneConfig config = {
+            .section_count = size->section_count,
+            .stops_per_section = size->stops_per_section,
+            .capabilities = mode->capabilities,
+            .generation = 1,
+            .seed = 1
+        };
+        start_sync(&config);
+
+        Stage stage;
+        size_t used = host_heap_stats()->used;
+        stage_start(&stage, used);
+        StopList *list;
+        if (mode->direct) {
+            list = build_list(size);
+        } else {
+            list = load_stops();
+            if (list != NULL && !stop_list_is_complete(list))
+                list = NULL;
+        }
+        print_row(mode, size, mode->direct ? "create" : "sync", &stage, list != NULL);
+        if (list == NULL)
+            _exit(1);
+
+        // What sync keeps beside the list stays allocated; a list built directly must be freed in full
+        stage_start(&stage, used);
+        stop_list_destroy(list);
+        bool freed = !mode->direct || host_heap_stats()->used == used;
+        print_row(mode, size, "destroy", &stage, freed);
+        fflush(stdout);
+        _exit(freed ? 0 : 1);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return false;
+    if (WIFSIGNALED(status))
+        printf("%6u %-8s crashed with signal %d\n", size->section_count * size->stops_per_section, mode->name,
+               WTERMSIG(status));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(void) {
+    printf("%6s %-8s %-8s %8s %6s %8s %8s %7s %7s %7s  %-6s %8s\n", "stops", "mode", "stage", "ms", "msgs",
+           "bytes", "peak", "allocs", "blocks", "left", "", "host_us");
+    bool passed = true;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+            passed &= bench(&modes[m], &sizes[s]);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+#include <pebble.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "check.h"
+
+static bool failed;
+
+void check_failed(void) {
+    failed = true;
+}
+
+bool check_run(const char *name, void (*test)(void)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        failed = false;
+        test();
+        _exit(failed ? 1 : 0);
+    }
+
+    int status;
+    bool passed = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (pid > 0 && WIFSIGNALED(status))
+        printf("%-48s crashed with signal %d\n", name, WTERMSIG(status));
+    else
+        printf("%-48s %s\n", name, passed ? "ok" : "FAILED");
+    return passed;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdio.h>
+
+/*
+ * A minimal test runner for the host harness. Each test runs in a process of its own, since
+ * sync keeps its state in statics; CHECK reports a failed condition and fails the test.
+ */
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            check_failed(); \
+        } \
+    } while (0)
+
+/*
+ * Fail the running test
+ */
+void check_failed(void);
+
+/*
+ * Run test in a process of its own and print whether it passed. Return true if it did.
+ */
+bool check_run(const char *name, void (*test)(void));
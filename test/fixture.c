@@ -0,0 +1,31 @@
+#include <pebble.h>
+#include "fixture.h"
+#include "host.h"
+#include "sync.h"
+
+StopList *loaded_list = NULL;
+
+void on_stops_loaded(StopList *stop_list) {
+    loaded_list = stop_list;
+}
+
+bool stops_loaded(void) {
+    return loaded_list != NULL;
+}
+
+void start_sync(const PhoneConfig *config) {
+    host_reset();
+    phone_start(config);
+    init_sync();
+}
+
+StopList *load_stops(void) {
+    loaded_list = NULL;
+    sync_get_stops(on_stops_loaded);
+    return host_run(stops_loaded, SYNC_TIMEOUT_MS) ? loaded_list : NULL;
+}
+
+StopList *sync_list(const PhoneConfig *config) {
+    start_sync(config);
+    return load_stops();
+}
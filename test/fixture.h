@@ -0,0 +1,40 @@
+#pragma once
+
+#include <pebble.h>
+#include "data.h"
+#include "phone.h"
+
+/*
+ * The fixture the programs of the host harness share: a fresh sync module syncing from the fake
+ * phone, and the stop list it loads.
+ */
+
+// Longest a sync may take on the simulated clock
+#define SYNC_TIMEOUT_MS (30 * 60 * 1000)
+
+// The list sync last passed to on_stops_loaded, or to any callback of a test which sets it
+extern StopList *loaded_list;
+
+void on_stops_loaded(StopList *stop_list);
+
+/*
+ * Return true once a list has been loaded
+ */
+bool stops_loaded(void);
+
+/*
+ * Reset the host, and start the phone as configured and sync. The link and the size of the heap
+ * stay as set.
+ */
+void start_sync(const PhoneConfig *config);
+
+/*
+ * Ask sync for the stop list of the phone, and return it once loaded, or NULL if it wasn't
+ * within SYNC_TIMEOUT_MS
+ */
+StopList *load_stops(void);
+
+/*
+ * Start sync, and return the list the phone is configured with once loaded, or NULL
+ */
+StopList *sync_list(const PhoneConfig *config);
@@ -0,0 +1,319 @@
+#include <pebble.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fixture.h"
+#include "host.h"
+#include "phone.h"
+#include "protocol.h"
+#include "records.h"
+#include "record_writer.h"
+#include "sync.h"
+
+/*
+ * Fuzz the messages the watch receives. Each session syncs a list from the fake phone while
+ * random messages are sent to the watch alongside the phone's replies: replies of every type
+ * with fields missing, out of range or of the wrong kind, unknown types and keys, and binary
+ * records cut short, overlong or flipped. The watch must reject them without crashing, which
+ * is best checked with make SANITIZE=1, and must then sync the phone's list in full.
+ *
+ *   fuzz [sessions [messages [seed]]]
+ *
+ * runs the given number of sessions in each form of the protocol, each with the given number of
+ * random messages, and prints the seed of any session which failed, to run it again with.
+ */
+
+#define DEFAULT_SESSION_COUNT 20
+#define DEFAULT_MESSAGE_COUNT 200
+
+// Longest random string or byte array
+#define MAX_RANDOM_SIZE 160
+
+typedef struct Mode {
+    const char *name;
+    uint32_t capabilities;
+} Mode;
+
+static const Mode modes[] = {
+    { "legacy", 0 },
+    { "batched", CAPABILITY_BATCHED_STOPS },
+    { "pipelined", CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS },
+    { "all", SUPPORTED_CAPABILITIES }
+};
+
+// Types of the messages the watch receives from the phone, which are fuzzed most
+static const uint8_t reply_types[] = {
+    MESSAGE_SECTIONS_METADATA, MESSAGE_SECTION_DATA, MESSAGE_STOP_DATA, MESSAGE_STOP_PREDICTION,
+    MESSAGE_SECTION_PREDICTIONS, MESSAGE_REQUEST_METRICS
+};
+
+static PhoneConfig config;
+static uint32_t random_state;
+
+/*
+ * Return the next number of a xorshift sequence
+ */
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static bool chance(uint8_t percent) {
+    return next_random() % 100 < percent;
+}
+
+static void on_prediction_loaded(const Prediction *prediction) {
+}
+
+static void on_section_predictions_loaded(StopList *stop_list, uint16_t section_index) {
+}
+
+/**********************************************************
+ ** RANDOM MESSAGES
+ **********************************************************/
+
+/*
+ * Return a number which is likely to be at an edge: of the list, of a width, or of a varint
+ */
+static uint32_t random_number(void) {
+    switch (next_random() % 8) {
+        case 0:
+            return 0;
+        case 1:
+            return config.section_count;
+        case 2:
+            return next_random() % (config.section_count + 1);
+        case 3:
+            return config.stops_per_section + next_random() % 3 - 1;
+        case 4:
+            return (uint32_t) 1 << (next_random() % 32);
+        case 5:
+            return ((uint32_t) 1 << (next_random() % 32)) - 1;
+        case 6:
+            return next_random() % 16;
+        default:
+            return next_random();
+    }
+}
+
+/*
+ * Write binary records: a header of the version and a few fields, then records of varints and
+ * strings, with the record count and lengths sometimes wrong. Return the size written.
+ */
+static uint16_t write_random_records(uint8_t *data, uint16_t size) {
+    RecordWriter writer;
+    record_writer_init(&writer, data, size);
+    record_write_varint(&writer, chance(80) ? RECORD_FORMAT_VERSION : random_number());
+    uint32_t field_count = next_random() % 4;
+    for (uint32_t i = 0; i < field_count; i++)
+        record_write_varint(&writer, random_number());
+    uint32_t record_count = random_number() % 32;
+    record_write_varint(&writer, chance(80) ? record_count : random_number());
+    for (uint32_t i = 0; i < record_count && !writer.failed; i++) {
+        uint32_t value_count = 1 + next_random() % STOP_STRING_COUNT;
+        for (uint32_t v = 0; v < value_count; v++) {
+            if (chance(50)) {
+                record_write_varint(&writer, random_number());
+            } else {
+                char string[PHONE_STRING_LENGTH];
+                uint32_t length = next_random() % (PHONE_STRING_LENGTH - 1);
+                for (uint32_t c = 0; c < length; c++)
+                    string[c] = 'a' + next_random() % 26;
+                string[length] = '\0';
+                record_write_string(&writer, string);
+            }
+        }
+    }
+    uint16_t length = writer.failed ? size : writer.offset;
+
+    // Flip a byte, or cut the records short
+    if (length > 0 && chance(30))
+        data[next_random() % length] ^= 1 << (next_random() % 8);
+    if (length > 0 && chance(30))
+        length = next_random() % length;
+    return length;
+}
+
+/*
+ * Write a random value to key, of a random kind
+ */
+static void write_random_value(DictionaryIterator *iter, uint32_t key) {
+    static uint8_t data[MAX_RANDOM_SIZE];
+    uint32_t value = random_number();
+    switch (next_random() % 7) {
+        case 0:
+            dict_write_uint8(iter, key, value);
+            break;
+        case 1:
+            dict_write_uint16(iter, key, value);
+            break;
+        case 2:
+            dict_write_uint32(iter, key, value);
+            break;
+        case 3:
+            dict_write_int32(iter, key, -(int32_t) (value % 1000));
+            break;
+        case 4: {
+            char string[MAX_RANDOM_SIZE];
+            uint32_t length = next_random() % MAX_RANDOM_SIZE;
+            for (uint32_t c = 0; c < length; c++)
+                string[c] = chance(90) ? ' ' + next_random() % 95 : 1 + next_random() % 255;
+            string[length] = '\0';
+            dict_write_cstring(iter, key, string);
+            break;
+        }
+        case 5:
+            dict_write_data(iter, key, data, write_random_records(data, sizeof(data)));
+            break;
+        default: {
+            uint16_t size = next_random() % MAX_RANDOM_SIZE;
+            for (uint16_t i = 0; i < size; i++)
+                data[i] = next_random();
+            dict_write_data(iter, key, data, size);
+            break;
+        }
+    }
+}
+
+/*
+ * Return the key of a random field: mostly those of the protocol, some of records, a few any
+ */
+static uint32_t random_key(void) {
+    uint32_t roll = next_random() % 10;
+    if (roll < 7)
+        return next_random() % MESSAGE_FIELD_COUNT;
+    if (roll < 8)
+        return STOP_RECORD_BASE + next_random() % (STOP_RECORD_FIELD_COUNT * 8);
+    if (roll < 9)
+        return PREDICTION_RECORD_BASE + next_random() % (PREDICTION_RECORD_FIELD_COUNT * 8);
+    return next_random();
+}
+
+/*
+ * Send the watch a random message
+ */
+static void send_random_message(void) {
+    DictionaryIterator *iter = host_begin_message();
+    if (chance(95)) {
+        uint8_t type = chance(85) ? reply_types[next_random() % (sizeof(reply_types) / sizeof(reply_types[0]))] : next_random();
+        dict_write_uint8(iter, MESSAGE_TYPE, type);
+    }
+    uint32_t field_count = next_random() % 12;
+    for (uint32_t i = 0; i < field_count; i++)
+        write_random_value(iter, random_key());
+    host_send_to_watch(iter);
+}
+
+/*
+ * Ask sync for something at random, as the user would, so replies of every type are expected
+ */
+static void random_request(void) {
+    uint16_t section_index = random_number();
+    char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+    char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+    phone_section_strings(section_index, stop_tag, stop_title);
+    phone_stop_strings(section_index, 0, strings);
+
+    switch (next_random() % 5) {
+        case 0:
+            sync_get_section_predictions(section_index, on_section_predictions_loaded);
+            break;
+        case 1:
+            sync_get_prediction(strings[0], stop_tag, on_prediction_loaded);
+            break;
+        case 2:
+            sync_subscribe_prediction(strings[0], stop_tag, on_prediction_loaded);
+            break;
+        case 3:
+            sync_unsubscribe_prediction();
+            break;
+        default:
+            sync_get_stops(on_stops_loaded);
+            break;
+    }
+}
+
+/**********************************************************
+ ** SESSIONS
+ **********************************************************/
+
+/*
+ * Sync a list while sending the watch message_count random messages, then sync it again without
+ * any. Return true if the list synced in full.
+ */
+static bool fuzz_session(const Mode *mode, uint32_t seed, uint32_t message_count) {
+    // A xorshift sequence never leaves 0
+    random_state = seed != 0 ? seed : 1;
+    config = (PhoneConfig) {
+        .section_count = 1 + next_random() % 12,
+        .stops_per_section = 1 + next_random() % 10,
+        .capabilities = mode->capabilities,
+        .generation = 1 + next_random() % 3,
+        .seed = seed
+    };
+    start_sync(&config);
+    sync_get_stops(on_stops_loaded);
+
+    for (uint32_t i = 0; i < message_count; i++) {
+        host_run(NULL, next_random() % 400);
+        if (chance(10))
+            random_request();
+        send_random_message();
+    }
+    host_run(NULL, SYNC_TIMEOUT_MS);
+
+    phone_start(&config);
+    if (load_stops() == NULL || !stop_list_is_complete(loaded_list))
+        return false;
+    if (loaded_list->section_count != config.section_count)
+        return false;
+    for (uint16_t i = 0; i < config.section_count; i++) {
+        StopSection *section = stop_list_get_section(loaded_list, i);
+        if (section == NULL || section->stop_count != config.stops_per_section)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Run sessions of a mode from seed on, each in a process of its own since sync keeps its state
+ * in statics, and print whether they passed. Return true if they all did.
+ */
+static bool fuzz_mode(const Mode *mode, uint32_t seed, uint32_t session_count, uint32_t message_count) {
+    char name[32];
+    snprintf(name, sizeof(name), "fuzz: %s", mode->name);
+    uint32_t failures = 0;
+    for (uint32_t session = 0; session < session_count; session++) {
+        uint32_t session_seed = seed + session;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(fuzz_session(mode, session_seed, message_count) ? 0 : 1);
+
+        int status;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0)
+            return false;
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "%s: seed %u crashed with signal %d\n", name, session_seed, WTERMSIG(status));
+            failures++;
+        } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "%s: seed %u didn't sync its list afterwards\n", name, session_seed);
+            failures++;
+        }
+    }
+    printf("%-48s %s\n", name, failures == 0 ? "ok" : "FAILED");
+    return failures == 0;
+}
+
+int main(int argc, char **argv) {
+    uint32_t session_count = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_SESSION_COUNT;
+    uint32_t message_count = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_MESSAGE_COUNT;
+    uint32_t seed = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+
+    bool passed = true;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        passed &= fuzz_mode(&modes[m], seed, session_count, message_count);
+    return passed ? 0 : 1;
+}
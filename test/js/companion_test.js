@@ -0,0 +1,294 @@
+/*
+ * Tests of the companion in src/js under Node, against a fake upstream and watch. Run from
+ * test/Makefile, like the tests of the host harness, and print a line for each test in the
+ * same form.
+ */
+
+var assert = require('assert');
+var app = require('../../src/js/pebble-js-app.js');
+
+var Key = app.Key;
+var MessageType = app.MessageType;
+var Capability = app.Capability;
+
+/*
+ * Run test, and print whether it passed. Return true if it did.
+ */
+function run(name, test) {
+    var passed = true;
+    try {
+        test();
+    } catch (error) {
+        console.error(error.stack);
+        passed = false;
+    }
+    var padding = name.length < 48 ? new Array(48 - name.length + 1).join(' ') : ' ';
+    console.log(name + padding + (passed ? 'ok' : 'FAILED'));
+    return passed;
+}
+
+/*
+ * Return a companion whose upstream answers every GET with the stops of sections, or fails if
+ * sections is null, and which sends to the watch at once. The messages sent are in .sent.
+ */
+function fakeCompanion(sections) {
+    var sent = [];
+    var companion = new app.Companion({
+        send: function (dict, onSuccess) {
+            sent.push(dict);
+            onSuccess();
+        },
+        transport: function (url, callback) {
+            if (sections === null)
+                return callback(new Error('Upstream down'));
+            callback(null, { sections: sections });
+        },
+        locate: function (callback) {
+            callback(null);
+        },
+        now: function () {
+            return 0;
+        },
+        setTimeout: function () {},
+        clearTimeout: function () {}
+    });
+    companion.sent = sent;
+    return companion;
+}
+
+/*
+ * Return upstream sections, each with stopCount stops
+ */
+function sectionsOf(sectionCount, stopCount) {
+    var sections = [];
+    for (var i = 0; i < sectionCount; i++) {
+        var stops = [];
+        for (var j = 0; j < stopCount; j++) {
+            stops.push({ route_tag: 'r' + j, route_title: 'Route ' + j,
+                         direction_tag: 'd' + j, direction_title: 'Direction ' + j });
+        }
+        sections.push({ tag: 's' + i, title: 'Stop ' + i, stops: stops });
+    }
+    return sections;
+}
+
+/*
+ * Return the message types of the messages sent
+ */
+function typesOf(sent) {
+    return sent.map(function (dict) {
+        return dict[Key.MESSAGE_TYPE];
+    });
+}
+
+/****
+ ** ENCODING
+ ****/
+
+function testDictionarySize() {
+    assert.strictEqual(app.dictionarySize({}), 1);
+    // Numbers are 32-bit integers
+    assert.strictEqual(app.dictionarySize({ 0: 4 }), 1 + 7 + 4);
+    // Strings are sent with a NUL, in UTF-8
+    assert.strictEqual(app.dictionarySize({ 0: 'abc' }), 1 + 7 + 4);
+    assert.strictEqual(app.dictionarySize({ 0: 'é' }), 1 + 7 + 3);
+    // Byte arrays are sent as they are
+    assert.strictEqual(app.dictionarySize({ 0: [1, 2, 3], 1: 'x' }), 1 + 7 + 3 + 7 + 2);
+}
+
+function testPackRecords() {
+    var write = function (writer, item) {
+        writer.writeString(item);
+    };
+    // Header of version 1, the fields 2 and 300, and the count, then each string
+    var packed = app.packRecords(100, [2, 300], ['ab', ''], write);
+    assert.deepStrictEqual(packed, { bytes: [1, 2, 0xac, 0x02, 2, 2, 0x61, 0x62, 0], count: 2 });
+
+    // Only whole records which fit, along with their header, are packed
+    packed = app.packRecords(8, [2, 300], ['ab', 'cd'], write);
+    assert.deepStrictEqual(packed, { bytes: [1, 2, 0xac, 0x02, 1, 2, 0x61, 0x62], count: 1 });
+    assert.strictEqual(app.packRecords(7, [2, 300], ['ab'], write), null);
+    assert.strictEqual(app.packRecords(100, [], [], write), null);
+}
+
+/****
+ ** PREDICTIONS
+ ****/
+
+function testNextArrival() {
+    var now = 10000;
+    var predictions = [
+        { route_tag: '5', direction_tag: 'in', arrival_time: now + 600, confidence: 80 },
+        { route_tag: '5', direction_tag: 'out', arrival_time: now + 120, confidence: 250 },
+        { route_tag: '5', direction_tag: 'in', arrival_time: now - 120, confidence: 90 },
+        { route_tag: 6, arrival_time: now + 30.7 }
+    ];
+    assert.deepStrictEqual(app.nextArrival(predictions, '5', 'in', now), { arrival_time: now + 600, confidence: 80 });
+    // Any direction matches '', and confidence is clamped to 100
+    assert.deepStrictEqual(app.nextArrival(predictions, '5', '', now), { arrival_time: now + 120, confidence: 100 });
+    // Predictions without a direction match any, and tags and times may be numbers
+    assert.deepStrictEqual(app.nextArrival(predictions, '6', 'in', now), { arrival_time: now + 30, confidence: 0 });
+    // Buses which came longer ago than the grace period are skipped
+    assert.deepStrictEqual(app.nextArrival(predictions, '5', 'in', now + 700), { arrival_time: 0, confidence: 0 });
+    assert.deepStrictEqual(app.nextArrival(predictions, '7', '', now), { arrival_time: 0, confidence: 0 });
+}
+
+/****
+ ** SYNC
+ ****/
+
+/*
+ * A failed upstream fetch is answered with an empty list, rather than not at all
+ */
+function testMetadataOnFailedFetch() {
+    var companion = fakeCompanion(null);
+    var request = {};
+    request[Key.MESSAGE_TYPE] = MessageType.REQUEST_SECTIONS_METADATA;
+    request[Key.PROTOCOL_CAPABILITIES] = 0xff;
+    companion.receive(request);
+
+    assert.strictEqual(companion.sent.length, 1);
+    var reply = companion.sent[0];
+    assert.strictEqual(reply[Key.MESSAGE_TYPE], MessageType.SECTIONS_METADATA);
+    assert.strictEqual(reply[Key.SECTION_COUNT], 0);
+    assert.strictEqual(reply[Key.SECTION_STOP_COUNT], 0);
+    assert.strictEqual(reply[Key.PROTOCOL_CAPABILITIES] & (Capability.SECTION_GENERATIONS | Capability.SECTION_HEADERS), 0);
+    assert.strictEqual(reply[Key.LIST_GENERATION], undefined);
+}
+
+/*
+ * The watch is asked for its metrics once the last stop of the list has been sent, and only then
+ */
+function testMetricsAfterSync() {
+    var companion = fakeCompanion(sectionsOf(2, 3));
+    var request = {};
+    request[Key.MESSAGE_TYPE] = MessageType.REQUEST_SECTIONS_METADATA;
+    companion.receive(request);
+    for (var i = 0; i < 2; i++) {
+        request = {};
+        request[Key.MESSAGE_TYPE] = MessageType.REQUEST_SECTION_DATA;
+        request[Key.SECTION_INDEX] = i;
+        companion.receive(request);
+        for (var j = 0; j < 3; j++) {
+            assert.strictEqual(typesOf(companion.sent).indexOf(MessageType.REQUEST_METRICS), -1);
+            request = {};
+            request[Key.MESSAGE_TYPE] = MessageType.REQUEST_STOP_DATA;
+            request[Key.SECTION_INDEX] = i;
+            request[Key.SECTION_STOP_INDEX] = j;
+            companion.receive(request);
+        }
+    }
+    var types = typesOf(companion.sent);
+    assert.strictEqual(types[types.length - 1], MessageType.REQUEST_METRICS);
+
+    // Requests for stops sent again don't ask again
+    companion.receive(request);
+    types = typesOf(companion.sent);
+    assert.strictEqual(types[types.length - 1], MessageType.STOP_DATA);
+}
+
+/*
+ * A watch which already holds the list, by its generation, has nothing to sync
+ */
+function testMetricsAfterUnchangedList() {
+    var companion = fakeCompanion(sectionsOf(2, 3));
+    var request = {};
+    request[Key.MESSAGE_TYPE] = MessageType.REQUEST_SECTIONS_METADATA;
+    request[Key.PROTOCOL_CAPABILITIES] = Capability.SECTION_GENERATIONS;
+    companion.receive(request);
+    var generation = companion.sent[0][Key.LIST_GENERATION];
+    assert.deepStrictEqual(typesOf(companion.sent), [MessageType.SECTIONS_METADATA]);
+
+    request[Key.LIST_GENERATION] = generation;
+    companion.receive(request);
+    assert.deepStrictEqual(typesOf(companion.sent),
+                           [MessageType.SECTIONS_METADATA, MessageType.SECTIONS_METADATA, MessageType.REQUEST_METRICS]);
+}
+
+/*
+ * A subscription pushes a prediction only when what the watch shows would change, in text as
+ * with arrival times
+ */
+function checkCoalescedPushes(capabilities) {
+    var clock = 1000000 * 1000;
+    var arrival = 1000000 + 630;
+    var poll = null;
+    var sent = [];
+    var companion = new app.Companion({
+        send: function (dict, onSuccess) {
+            sent.push(dict);
+            onSuccess();
+        },
+        transport: function (url, callback) {
+            callback(null, { predictions: [{ route_tag: '5', arrival_time: arrival, confidence: 90 }] });
+        },
+        locate: function (callback) {
+            callback(null);
+        },
+        now: function () {
+            return clock;
+        },
+        setTimeout: function (f) {
+            poll = f;
+        },
+        clearTimeout: function () {}
+    });
+    // As negotiated with a MESSAGE_REQUEST_SECTIONS_METADATA
+    companion.capabilities = capabilities;
+    var request = {};
+    request[Key.MESSAGE_TYPE] = MessageType.SUBSCRIBE_STOP_PREDICTION;
+    request[Key.STOP_ROUTE_TAG] = '5';
+    request[Key.SECTION_STOP_TAG] = '100';
+    companion.receive(request);
+    assert.strictEqual(sent.length, 1);
+
+    // Polled again past the cache, with nothing changed, nothing is pushed; the countdown
+    // stays at 10 minutes
+    clock += 20 * 1000;
+    poll();
+    assert.strictEqual(sent.length, 1);
+
+    // A later arrival is pushed
+    clock += 20 * 1000;
+    arrival += 300;
+    poll();
+    assert.strictEqual(sent.length, 2);
+}
+
+function testCoalescedPushes() {
+    checkCoalescedPushes(Capability.PREDICTION_SUBSCRIPTIONS | Capability.ARRIVAL_TIMES);
+    checkCoalescedPushes(Capability.PREDICTION_SUBSCRIPTIONS);
+}
+
+/****
+ ** CONFIGURATION
+ ****/
+
+function testUpstreamOf() {
+    var response = function (settings) {
+        return encodeURIComponent(JSON.stringify(settings));
+    };
+    assert.strictEqual(app.upstreamOf(response({ upstream: 'https://example.org/ftw/' })), 'https://example.org/ftw');
+    assert.strictEqual(app.upstreamOf(response({ upstream: 'http://10.0.0.2:8080' })), 'http://10.0.0.2:8080');
+    // Cancelled pages, malformed responses and other schemes leave the upstream as it is
+    assert.strictEqual(app.upstreamOf(''), null);
+    assert.strictEqual(app.upstreamOf(undefined), null);
+    assert.strictEqual(app.upstreamOf('%7Bnot json'), null);
+    assert.strictEqual(app.upstreamOf(response({ upstream: 'javascript:alert(1)' })), null);
+    assert.strictEqual(app.upstreamOf(response({ upstream: 'http://a b' })), null);
+
+    // The page holds the upstream it was opened with, escaped
+    var page = decodeURIComponent(app.configurationUrl('http://x/?a="b"&c').replace(/^data:text\/html,/, ''));
+    assert.notStrictEqual(page.indexOf('value="http://x/?a=&quot;b&quot;&amp;c"'), -1);
+}
+
+var passed = true;
+passed = run('companion: dictionary sizes', testDictionarySize) && passed;
+passed = run('companion: packed records', testPackRecords) && passed;
+passed = run('companion: next arrival', testNextArrival) && passed;
+passed = run('companion: metadata on a failed fetch', testMetadataOnFailedFetch) && passed;
+passed = run('companion: metrics after a sync', testMetricsAfterSync) && passed;
+passed = run('companion: metrics after an unchanged list', testMetricsAfterUnchangedList) && passed;
+passed = run('companion: coalesced pushes', testCoalescedPushes) && passed;
+passed = run('companion: upstream from configuration', testUpstreamOf) && passed;
+process.exit(passed ? 0 : 1);
@@ -0,0 +1,453 @@
+#include <pebble.h>
+#include "host.h"
+#include "phone.h"
+#include "protocol.h"
+#include "records.h"
+#include "record_writer.h"
+
+// Bytes of each tuple before its value
+#define TUPLE_HEADER_SIZE 7
+
+// Inbox size assumed for watches which don't send theirs, as by the companion
+#define DEFAULT_INBOX_SIZE 124
+
+// Longest byte array the phone packs
+#define MAX_RECORDS_SIZE 8192
+
+// The phone's buffers are static, so the heap of the simulated watch only counts the watch's own
+static uint8_t byte_array[MAX_RECORDS_SIZE];
+
+static const char *streets[] = {
+    "King St West", "Queen St East", "Spadina Ave", "Bathurst St", "Dundas St West",
+    "College St", "Broadview Ave", "Lake Shore Blvd West", "St Clair Ave", "Kingston Rd"
+};
+#define STREET_COUNT (sizeof(streets) / sizeof(streets[0]))
+
+static const char *directions[] = { "East", "West", "North", "South" };
+
+static PhoneConfig config;
+static uint32_t capabilities;
+static uint32_t inbox_size;
+static uint32_t requests[MESSAGE_TYPE_COUNT];
+static uint32_t random_state;
+static uint32_t batch_count;
+
+// The stop subscribed to, if any
+static bool subscribed;
+static char subscribed_route_tag[PHONE_STRING_LENGTH];
+static char subscribed_stop_tag[PHONE_STRING_LENGTH];
+
+/*
+ * Return the next number of a xorshift sequence
+ */
+static uint32_t next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static bool chance(uint8_t percent) {
+    return percent > 0 && next_random() % 100 < percent;
+}
+
+/**********************************************************
+ ** THE STOP LIST
+ **********************************************************/
+
+void phone_section_strings(uint16_t section_index, char stop_tag[PHONE_STRING_LENGTH], char stop_title[PHONE_STRING_LENGTH]) {
+    snprintf(stop_tag, PHONE_STRING_LENGTH, "%u", 10000 + section_index);
+    snprintf(stop_title, PHONE_STRING_LENGTH, "%s At %s", streets[section_index % STREET_COUNT],
+             streets[(section_index / STREET_COUNT + 3) % STREET_COUNT]);
+}
+
+void phone_stop_strings(uint16_t section_index, uint16_t stop_index, char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH]) {
+    // Routes recur across sections, as at neighbouring stops, so their strings are shared
+    unsigned route = 500 + (section_index + stop_index * 7) % 60;
+    unsigned direction = (section_index + stop_index) % 2;
+    const char *street = streets[route % STREET_COUNT];
+    snprintf(strings[0], PHONE_STRING_LENGTH, "%u", route);
+    snprintf(strings[1], PHONE_STRING_LENGTH, "%u-%s", route, street);
+    snprintf(strings[2], PHONE_STRING_LENGTH, "%u_%u_%u", route, direction, route);
+    snprintf(strings[3], PHONE_STRING_LENGTH, "%s - %u %s towards %s", directions[(route + direction) % 4], route,
+             street, streets[(route / 3) % STREET_COUNT]);
+}
+
+static uint32_t section_generation(uint16_t section_index) {
+    return config.generation * 31 + section_index + 1;
+}
+
+/*
+ * Return the next arrival at a stop, in minutes from now
+ */
+static uint32_t arrival_minutes(uint16_t section_index, uint16_t stop_index) {
+    return (section_index * 7 + stop_index * 3) % 25;
+}
+
+/**********************************************************
+ ** REPLIES
+ **********************************************************/
+
+/*
+ * Return the bytes written to a message so far
+ */
+static uint32_t written_size(DictionaryIterator *iter) {
+    return (const uint8_t *) iter->cursor - (const uint8_t *) iter->dictionary;
+}
+
+/*
+ * Return the bytes left in a message for more tuples, or 0
+ */
+static uint32_t room_left(DictionaryIterator *iter) {
+    uint32_t written = written_size(iter);
+    return inbox_size > written ? inbox_size - written : 0;
+}
+
+/*
+ * Start a reply of the given type to request, echoing its sequence number if agreed on
+ */
+static DictionaryIterator *begin_reply(uint8_t message_type, const Message *request) {
+    DictionaryIterator *reply = host_begin_message();
+    dict_write_uint8(reply, MESSAGE_TYPE, message_type);
+    if (request != NULL && (capabilities & CAPABILITY_SEQUENCED_REQUESTS) && (request->present & FIELD_BIT(REQUEST_SEQUENCE)))
+        dict_write_uint8(reply, REQUEST_SEQUENCE, request->sequence);
+    return reply;
+}
+
+/*
+ * Write as many binary records as fit in room bytes into a byte array at key, after a header of
+ * the version, the given fields and the record count. write_record writes record i. Return the
+ * number of records written.
+ */
+static uint16_t pack_records(DictionaryIterator *reply, uint32_t key, uint32_t room, const uint32_t *fields,
+        uint8_t field_count, uint16_t item_count, void (*write_record)(RecordWriter *, uint16_t, void *), void *context) {
+    static uint8_t records[MAX_RECORDS_SIZE];
+    static uint8_t packed[MAX_RECORDS_SIZE];
+    if (room <= TUPLE_HEADER_SIZE)
+        return 0;
+    room -= TUPLE_HEADER_SIZE;
+
+    uint32_t header_size = record_varint_size(RECORD_FORMAT_VERSION);
+    for (int i = 0; i < field_count; i++)
+        header_size += record_varint_size(fields[i]);
+
+    RecordWriter writer;
+    record_writer_init(&writer, records, sizeof(records));
+    uint16_t count = 0;
+    for (; count < item_count; count++) {
+        uint16_t offset = writer.offset;
+        write_record(&writer, count, context);
+        if (writer.failed || header_size + record_varint_size(count + 1) + writer.offset > room) {
+            writer.offset = offset;
+            break;
+        }
+    }
+    if (count == 0)
+        return 0;
+
+    RecordWriter header;
+    record_writer_init(&header, packed, sizeof(packed));
+    record_write_varint(&header, RECORD_FORMAT_VERSION);
+    for (int i = 0; i < field_count; i++)
+        record_write_varint(&header, fields[i]);
+    record_write_varint(&header, count);
+    record_write_bytes(&header, records, writer.offset);
+
+    // A malformed batch is cut off part way through its last record
+    if (config.malformed_every > 0 && key == STOP_RECORDS && ++batch_count % config.malformed_every == 0)
+        header.offset--;
+    dict_write_data(reply, key, packed, header.offset);
+    return count;
+}
+
+typedef struct StopRange {
+    uint16_t section_index;
+    uint16_t first_stop_index;
+} StopRange;
+
+static void write_stop_record(RecordWriter *writer, uint16_t i, void *context) {
+    StopRange *range = context;
+    char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+    phone_stop_strings(range->section_index, range->first_stop_index + i, strings);
+    for (int f = 0; f < STOP_STRING_COUNT; f++)
+        record_write_string(writer, strings[f]);
+}
+
+static void write_section_header(RecordWriter *writer, uint16_t i, void *context) {
+    char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+    phone_section_strings(i, stop_tag, stop_title);
+    record_write_string(writer, stop_tag);
+    record_write_string(writer, stop_title);
+    record_write_varint(writer, config.stops_per_section);
+}
+
+/*
+ * Add as many stops of a section from first_stop_index on as fit to reply, in the form agreed on
+ */
+static void pack_stops(DictionaryIterator *reply, uint16_t section_index, uint16_t first_stop_index) {
+    StopRange range = { section_index, first_stop_index };
+    uint16_t stop_count = config.stops_per_section - first_stop_index;
+    if (capabilities & CAPABILITY_BINARY_RECORDS) {
+        uint32_t fields[] = { section_index, first_stop_index };
+        pack_records(reply, STOP_RECORDS, room_left(reply), fields, 2, stop_count, write_stop_record, &range);
+        return;
+    }
+
+    // Batched stops are a tuple per string, after their index and count
+    uint32_t room = room_left(reply);
+    uint32_t size = 2 * (TUPLE_HEADER_SIZE + sizeof(uint16_t));
+    uint16_t record_count = 0;
+    for (; record_count < stop_count; record_count++) {
+        char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+        phone_stop_strings(section_index, first_stop_index + record_count, strings);
+        uint32_t record_size = 0;
+        for (int f = 0; f < STOP_STRING_COUNT; f++)
+            record_size += TUPLE_HEADER_SIZE + strlen(strings[f]) + 1;
+        if (size + record_size > room)
+            break;
+        size += record_size;
+    }
+
+    // A malformed batch leaves out the index of its first stop
+    if (config.malformed_every == 0 || ++batch_count % config.malformed_every != 0)
+        dict_write_uint16(reply, SECTION_STOP_INDEX, first_stop_index);
+    dict_write_uint16(reply, STOP_RECORD_COUNT, record_count);
+    for (uint16_t i = 0; i < record_count; i++) {
+        char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+        phone_stop_strings(section_index, first_stop_index + i, strings);
+        for (int f = 0; f < STOP_STRING_COUNT; f++)
+            dict_write_cstring(reply, STOP_RECORD_BASE + i * STOP_RECORD_FIELD_COUNT + f, strings[f]);
+    }
+}
+
+static void on_request_sections_metadata(const Message *request) {
+    // Binary records are batches, which the watch only requests in batched mode
+    capabilities = (request->present & FIELD_BIT(PROTOCOL_CAPABILITIES) ? request->capabilities : 0) & config.capabilities;
+    if (!(capabilities & CAPABILITY_BATCHED_STOPS))
+        capabilities &= ~CAPABILITY_BINARY_RECORDS;
+    inbox_size = request->present & FIELD_BIT(INBOX_SIZE) ? request->inbox_size : DEFAULT_INBOX_SIZE;
+
+    DictionaryIterator *reply = begin_reply(MESSAGE_SECTIONS_METADATA, request);
+    dict_write_uint16(reply, SECTION_COUNT, config.section_count);
+    dict_write_uint16(reply, SECTION_STOP_COUNT, config.section_count * config.stops_per_section);
+    dict_write_uint32(reply, PROTOCOL_CAPABILITIES, capabilities);
+    if (capabilities & CAPABILITY_SECTION_GENERATIONS) {
+        dict_write_uint32(reply, LIST_GENERATION, config.generation);
+        // Sections with no generation are never kept; that beats overflowing the inbox
+        uint32_t size = config.section_count * sizeof(uint32_t);
+        if (TUPLE_HEADER_SIZE + size <= room_left(reply) && size <= MAX_RECORDS_SIZE) {
+            for (uint16_t i = 0; i < config.section_count; i++) {
+                uint32_t generation = section_generation(i);
+                for (int b = 0; b < 4; b++)
+                    byte_array[i * 4 + b] = generation >> (8 * b);
+            }
+            dict_write_data(reply, SECTION_GENERATIONS, byte_array, size);
+        }
+    }
+
+    // The watch already holds the sections of the list it has
+    bool has_list = (request->present & FIELD_BIT(LIST_GENERATION)) && request->generation == config.generation;
+    if ((capabilities & CAPABILITY_SECTION_HEADERS) && !has_list) {
+        uint32_t fields[] = { 0 };
+        pack_records(reply, SECTION_HEADERS, room_left(reply), fields, 1, config.section_count, write_section_header, NULL);
+    }
+    host_send_to_watch(reply);
+}
+
+static void on_request_section_data(const Message *request) {
+    uint16_t section_index = request->section_index;
+    if (section_index >= config.section_count)
+        return;
+
+    char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+    phone_section_strings(section_index, stop_tag, stop_title);
+    DictionaryIterator *reply = begin_reply(MESSAGE_SECTION_DATA, request);
+    dict_write_uint16(reply, SECTION_INDEX, section_index);
+    dict_write_cstring(reply, SECTION_STOP_TAG, stop_tag);
+    dict_write_cstring(reply, SECTION_STOP_TITLE, stop_title);
+    dict_write_uint16(reply, SECTION_STOP_COUNT, config.stops_per_section);
+    if ((capabilities & CAPABILITY_BATCHED_STOPS) && config.stops_per_section > 0)
+        pack_stops(reply, section_index, 0);
+    host_send_to_watch(reply);
+}
+
+static void on_request_stop_data(const Message *request) {
+    uint16_t section_index = request->section_index;
+    uint16_t stop_index = request->stop_index;
+    if (section_index >= config.section_count || stop_index >= config.stops_per_section)
+        return;
+
+    DictionaryIterator *reply = begin_reply(MESSAGE_STOP_DATA, request);
+    if (capabilities & CAPABILITY_BATCHED_STOPS) {
+        if (!(capabilities & CAPABILITY_BINARY_RECORDS))
+            dict_write_uint16(reply, SECTION_INDEX, section_index);
+        pack_stops(reply, section_index, stop_index);
+    } else {
+        char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+        phone_stop_strings(section_index, stop_index, strings);
+        dict_write_uint16(reply, SECTION_INDEX, section_index);
+        dict_write_uint16(reply, SECTION_STOP_INDEX, stop_index);
+        dict_write_cstring(reply, STOP_ROUTE_TAG, strings[0]);
+        dict_write_cstring(reply, STOP_ROUTE_TITLE, strings[1]);
+        dict_write_cstring(reply, STOP_DIRECTION_TAG, strings[2]);
+        dict_write_cstring(reply, STOP_DIRECTION_TITLE, strings[3]);
+    }
+    host_send_to_watch(reply);
+}
+
+/**********************************************************
+ ** PREDICTIONS
+ **********************************************************/
+
+/*
+ * Write a prediction of the given arrival time to reply, in the form agreed on
+ */
+static void write_prediction(DictionaryIterator *reply, uint32_t arrival_time, uint8_t confidence) {
+    if (capabilities & CAPABILITY_ARRIVAL_TIMES) {
+        uint8_t arrivals[16];
+        RecordWriter writer;
+        record_writer_init(&writer, arrivals, sizeof(arrivals));
+        record_write_varint(&writer, RECORD_FORMAT_VERSION);
+        record_write_varint(&writer, 1);
+        record_write_varint(&writer, arrival_time);
+        record_write_varint(&writer, confidence);
+        dict_write_data(reply, ARRIVALS, arrivals, writer.offset);
+        return;
+    }
+    char text[12];
+    uint32_t now = time(NULL);
+    uint32_t minutes = arrival_time > now ? (arrival_time - now) / 60 : 0;
+    if (minutes == 0)
+        strcpy(text, "Due");
+    else
+        snprintf(text, sizeof(text), "%u", (unsigned) minutes);
+    dict_write_cstring(reply, STOP_PREDICTION, text);
+    dict_write_cstring(reply, STOP_MINUTES_LABEL, minutes == 1 ? "minute" : "minutes");
+}
+
+static void on_request_stop_prediction(const Message *request) {
+    DictionaryIterator *reply = begin_reply(MESSAGE_STOP_PREDICTION, request);
+    write_prediction(reply, time(NULL) + 60 * (1 + strlen(request->route_tag) % 10), 90);
+    host_send_to_watch(reply);
+}
+
+void phone_push_prediction(uint32_t arrival_time, uint8_t confidence) {
+    if (!subscribed)
+        return;
+    DictionaryIterator *reply = begin_reply(MESSAGE_STOP_PREDICTION, NULL);
+    dict_write_cstring(reply, STOP_ROUTE_TAG, subscribed_route_tag);
+    dict_write_cstring(reply, SECTION_STOP_TAG, subscribed_stop_tag);
+    write_prediction(reply, arrival_time, confidence);
+    host_send_to_watch(reply);
+}
+
+static void on_subscribe(const Message *request) {
+    subscribed = true;
+    strncpy(subscribed_route_tag, request->route_tag, PHONE_STRING_LENGTH - 1);
+    strncpy(subscribed_stop_tag, request->stop_tag, PHONE_STRING_LENGTH - 1);
+
+    // A new subscriber gets the current prediction right away
+    phone_push_prediction(time(NULL) + 5 * 60, 90);
+}
+
+static void on_request_section_predictions(const Message *request) {
+    uint16_t section_index = request->section_index;
+    if (section_index >= config.section_count)
+        return;
+
+    DictionaryIterator *reply = begin_reply(MESSAGE_SECTION_PREDICTIONS, request);
+    dict_write_uint16(reply, SECTION_INDEX, section_index);
+    dict_write_cstring(reply, SECTION_STOP_TAG, request->stop_tag);
+    dict_write_uint16(reply, SECTION_STOP_INDEX, 0);
+
+    uint32_t now = time(NULL);
+    uint16_t record_count = config.stops_per_section;
+    dict_write_uint16(reply, STOP_RECORD_COUNT, record_count);
+    if (capabilities & CAPABILITY_ARRIVAL_TIMES) {
+        RecordWriter writer;
+        record_writer_init(&writer, byte_array, MAX_RECORDS_SIZE);
+        record_write_varint(&writer, RECORD_FORMAT_VERSION);
+        record_write_varint(&writer, record_count);
+        for (uint16_t i = 0; i < record_count; i++) {
+            record_write_varint(&writer, now + 60 * arrival_minutes(section_index, i));
+            record_write_varint(&writer, 90);
+        }
+        dict_write_data(reply, ARRIVALS, byte_array, writer.offset);
+    } else {
+        for (uint16_t i = 0; i < record_count; i++) {
+            char text[12];
+            uint32_t minutes = arrival_minutes(section_index, i);
+            if (minutes == 0)
+                strcpy(text, "Due");
+            else
+                snprintf(text, sizeof(text), "%u", (unsigned) minutes);
+            uint32_t key = PREDICTION_RECORD_BASE + i * PREDICTION_RECORD_FIELD_COUNT;
+            dict_write_cstring(reply, key + PREDICTION_RECORD_PREDICTION, text);
+            dict_write_cstring(reply, key + PREDICTION_RECORD_MINUTES_LABEL, minutes == 1 ? "minute" : "minutes");
+        }
+    }
+    host_send_to_watch(reply);
+}
+
+/**********************************************************
+ ** THE LINK
+ **********************************************************/
+
+static HostDelivery on_watch_message(DictionaryIterator *iter, void *context) {
+    if (chance(config.drop_percent))
+        return HOST_DROP;
+    if (chance(config.busy_percent))
+        return HOST_BUSY;
+
+    Message request;
+    if (!message_decode(iter, &request))
+        return HOST_DELIVER;
+    if (request.message_type < MESSAGE_TYPE_COUNT)
+        requests[request.message_type]++;
+
+    switch (request.message_type) {
+        case MESSAGE_REQUEST_SECTIONS_METADATA:
+            on_request_sections_metadata(&request);
+            break;
+        case MESSAGE_REQUEST_SECTION_DATA:
+            on_request_section_data(&request);
+            break;
+        case MESSAGE_REQUEST_STOP_DATA:
+            on_request_stop_data(&request);
+            break;
+        case MESSAGE_REQUEST_STOP_PREDICTION:
+            on_request_stop_prediction(&request);
+            break;
+        case MESSAGE_SUBSCRIBE_STOP_PREDICTION:
+            on_subscribe(&request);
+            break;
+        case MESSAGE_UNSUBSCRIBE_STOP_PREDICTION:
+            subscribed = false;
+            break;
+        case MESSAGE_REQUEST_SECTION_PREDICTIONS:
+            on_request_section_predictions(&request);
+            break;
+        default:
+            break;
+    }
+    return HOST_DELIVER;
+}
+
+void phone_start(const PhoneConfig *new_config) {
+    config = *new_config;
+    capabilities = 0;
+    inbox_size = DEFAULT_INBOX_SIZE;
+    memset(requests, 0, sizeof(requests));
+    random_state = config.seed != 0 ? config.seed : 1;
+    batch_count = 0;
+    subscribed = false;
+    host_set_phone(on_watch_message, NULL);
+}
+
+uint32_t phone_requests(uint8_t message_type) {
+    return message_type < MESSAGE_TYPE_COUNT ? requests[message_type] : 0;
+}
+
+uint32_t phone_capabilities(void) {
+    return capabilities;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <pebble.h>
+#include "data.h"
+
+/*
+ * A fake phone for the host harness. It serves a generated stop list of any size over the
+ * simulated link in host.h, speaking every form of the protocol in protocol.h the watch and it
+ * agree on, and answers prediction requests with generated arrivals. It can lose messages,
+ * reject them as busy, and send malformed batches, to see the watch recover.
+ */
+
+// Longest generated string, including the NUL
+#define PHONE_STRING_LENGTH 64
+
+typedef struct PhoneConfig {
+    uint16_t section_count;
+    uint16_t stops_per_section;
+    // Capabilities the phone supports; it uses those the watch supports too
+    uint32_t capabilities;
+    // Generation of the list; each section's is derived from it. Never 0.
+    uint32_t generation;
+    // Percent of the watch's messages lost on the way, or rejected as busy
+    uint8_t drop_percent;
+    uint8_t busy_percent;
+    // Send every nth batch of stops malformed, or none if 0
+    uint16_t malformed_every;
+    // Seed of the losses and rejections, so a run can be repeated
+    uint32_t seed;
+} PhoneConfig;
+
+/*
+ * Start answering the watch as configured, with no requests counted
+ */
+void phone_start(const PhoneConfig *config);
+
+/*
+ * Return the number of messages of the given type the phone has received from the watch
+ */
+uint32_t phone_requests(uint8_t message_type);
+
+/*
+ * Return the capabilities the phone agreed on with the watch, once it asked for the list
+ */
+uint32_t phone_capabilities(void);
+
+/*
+ * Write the generated stop tag and title of the section at section_index
+ */
+void phone_section_strings(uint16_t section_index, char stop_tag[PHONE_STRING_LENGTH], char stop_title[PHONE_STRING_LENGTH]);
+
+/*
+ * Write the generated route tag, route title, direction tag and direction title of a stop
+ */
+void phone_stop_strings(uint16_t section_index, uint16_t stop_index, char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH]);
+
+/*
+ * Push a prediction of the given arrival time for the stop subscribed to, as a phone with
+ * CAPABILITY_PREDICTION_SUBSCRIPTIONS does whenever it changes. Nothing is sent if the watch
+ * hasn't subscribed.
+ */
+void phone_push_prediction(uint32_t arrival_time, uint8_t confidence);
@@ -0,0 +1,43 @@
+#include <pebble.h>
+#include "record_writer.h"
+
+void record_writer_init(RecordWriter *writer, uint8_t *data, uint16_t size) {
+    *writer = (RecordWriter) {
+        .data = data,
+        .size = size,
+        .offset = 0,
+        .failed = false
+    };
+}
+
+void record_write_varint(RecordWriter *writer, uint32_t value) {
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        record_write_bytes(writer, &(uint8_t) { value != 0 ? byte | 0x80 : byte }, 1);
+    } while (value != 0);
+}
+
+void record_write_string(RecordWriter *writer, const char *string) {
+    uint16_t length = strlen(string);
+    record_write_varint(writer, length);
+    record_write_bytes(writer, (const uint8_t *) string, length);
+}
+
+void record_write_bytes(RecordWriter *writer, const uint8_t *data, uint16_t size) {
+    if (writer->failed || size > writer->size - writer->offset) {
+        writer->failed = true;
+        return;
+    }
+    memcpy(writer->data + writer->offset, data, size);
+    writer->offset += size;
+}
+
+uint16_t record_varint_size(uint32_t value) {
+    uint16_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <pebble.h>
+
+/*
+ * The phone's half of the binary record formats in records.h: a cursor which writes varints and
+ * length-prefixed strings into a byte array, as the phone packs them for the watch.
+ */
+typedef struct RecordWriter {
+    uint8_t *data;
+    uint16_t size;
+    uint16_t offset;
+    // Set once a write runs past the end of the data
+    bool failed;
+} RecordWriter;
+
+void record_writer_init(RecordWriter *writer, uint8_t *data, uint16_t size);
+
+/*
+ * Write value as an unsigned LEB128 varint
+ */
+void record_write_varint(RecordWriter *writer, uint32_t value);
+
+/*
+ * Write a string as its varint length followed by its bytes, with no NUL
+ */
+void record_write_string(RecordWriter *writer, const char *string);
+
+/*
+ * Write bytes as they are, such as records packed by another writer
+ */
+void record_write_bytes(RecordWriter *writer, const uint8_t *data, uint16_t size);
+
+/*
+ * Return the number of bytes value takes as a varint
+ */
+uint16_t record_varint_size(uint32_t value);
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <pebble.h>
+
+/*
+ * Controls of the simulated watch behind the stub SDK in pebble.h. Everything happens in one
+ * thread on a simulated clock: timers, and messages between the watch and the phone, are events
+ * which host_run plays back in order of time, moving the clock to each as it goes.
+ */
+
+/*
+ * Reset the clock, the heap statistics, the message statistics, timers and messages in flight,
+ * and persistent storage. Callbacks registered with app_message_register_* stay.
+ */
+void host_reset(void);
+
+/**********************************************************
+ ** CLOCK AND EVENT LOOP
+ **********************************************************/
+
+// UTC time the clock starts at after host_reset, in seconds
+#define HOST_EPOCH 1800000000
+
+/*
+ * Return the simulated time since host_reset, in milliseconds
+ */
+uint64_t host_now_ms(void);
+
+/*
+ * Move the clock on by ms without playing back the events due meanwhile
+ */
+void host_advance(uint32_t ms);
+
+/*
+ * Play back events in order of time until there are none left, until done returns true (if
+ * not NULL), or until timeout_ms has passed on the clock. Return true if done returned true.
+ */
+bool host_run(bool (*done)(void), uint32_t timeout_ms);
+
+/*
+ * Play back the events due by now, and no more
+ */
+void host_run_due(void);
+
+/**********************************************************
+ ** HEAP
+ **********************************************************/
+
+typedef struct HostHeapStats {
+    // Bytes allocated now, and at most since host_reset_heap_stats
+    size_t used;
+    size_t peak;
+    // Calls to malloc, calloc and realloc which returned memory
+    uint32_t allocations;
+    // Calls which found no room in the simulated heap
+    uint32_t failures;
+    // Largest number of live allocations at once, a rough measure of fragmentation
+    uint32_t blocks_peak;
+    uint32_t blocks;
+} HostHeapStats;
+
+/*
+ * Set the size of the simulated heap; allocations past it fail. The default is 64 KB.
+ */
+void host_set_heap_size(size_t size);
+
+const HostHeapStats *host_heap_stats(void);
+
+/*
+ * Start the peak and the counts over from what is allocated now
+ */
+void host_reset_heap_stats(void);
+
+/**********************************************************
+ ** MESSAGES
+ **********************************************************/
+
+/*
+ * What happens to a message the watch sends: the phone receives it, or it is lost on the way
+ * and the watch is told it timed out, or the phone is busy and rejects it.
+ */
+typedef enum {
+    HOST_DELIVER,
+    HOST_DROP,
+    HOST_BUSY
+} HostDelivery;
+
+/*
+ * Called with each message the watch sends, at the time the phone receives it. Returns what
+ * becomes of it; the phone replies with host_send_to_watch.
+ */
+typedef HostDelivery (*HostPhoneHandler)(DictionaryIterator *message, void *context);
+
+typedef struct HostLink {
+    // One-way time between watch and phone, in milliseconds
+    uint32_t latency_ms;
+    // Throughput of the link each way; 0 if messages take no longer for their size
+    uint32_t bytes_per_second;
+    // Time the watch waits for an ack before it fails a lost message with APP_MSG_SEND_TIMEOUT
+    uint32_t timeout_ms;
+    // Size of the watch's inbox, the largest message it can receive, in bytes
+    uint32_t inbox_size;
+} HostLink;
+
+typedef struct HostMessageStats {
+    uint32_t sent;
+    uint32_t sent_bytes;
+    uint32_t received;
+    uint32_t received_bytes;
+    // Messages lost on the way to the phone, and rejected by it as busy
+    uint32_t dropped;
+    uint32_t busy;
+    // Messages to the watch too large for its inbox
+    uint32_t overflowed;
+} HostMessageStats;
+
+/*
+ * Set the phone which receives the messages of the watch, and the link to it
+ */
+void host_set_phone(HostPhoneHandler handler, void *context);
+void host_set_link(HostLink link);
+
+/*
+ * Deliver the message written into iter to the watch after the latency of the link, as the
+ * phone. Messages arrive in the order they are sent.
+ */
+void host_send_to_watch(DictionaryIterator *iter);
+
+/*
+ * Start writing a message to the watch. The buffer holds the largest message the watch can
+ * receive; pass the iterator to host_send_to_watch once it is written.
+ */
+DictionaryIterator *host_begin_message(void);
+
+const HostMessageStats *host_message_stats(void);
+
+/*
+ * Log APP_LOG output at or below level to stderr; by default nothing is logged
+ */
+void host_set_log_level(AppLogLevel level);
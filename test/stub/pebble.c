@@ -0,0 +1,723 @@
+#include <pebble.h>
+#include <stdarg.h>
+#include "host.h"
+
+// The stub allocates its own bookkeeping from the host heap, outside the simulated one
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#undef time
+
+#define DEFAULT_HEAP_SIZE (64 * 1024)
+#define DEFAULT_INBOX_SIZE 2026
+#define OUTBOX_SIZE 656
+
+#define MAX_TIMERS 64
+#define MAX_PERSIST_KEYS 64
+#define PERSIST_TOTAL_SIZE 4096
+
+// Bytes of each tuple before its value
+#define TUPLE_HEADER_SIZE 7
+
+struct Dictionary {
+    uint8_t count;
+    uint8_t head[];
+} __attribute__((__packed__));
+
+/**********************************************************
+ ** LOGGING
+ **********************************************************/
+
+static AppLogLevel log_level = 0;
+
+void host_set_log_level(AppLogLevel level) {
+    log_level = level;
+}
+
+void app_log(uint8_t level, const char *filename, int line, const char *fmt, ...) {
+    if (level > log_level)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s:%d: ", filename, line);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+/**********************************************************
+ ** MEMORY
+ **********************************************************/
+
+/*
+ * Each allocation is preceded by its size, padded to keep the allocation aligned
+ */
+typedef union BlockHeader {
+    size_t size;
+    long double align;
+} BlockHeader;
+
+static size_t heap_size = DEFAULT_HEAP_SIZE;
+static HostHeapStats heap;
+
+void host_set_heap_size(size_t size) {
+    heap_size = size;
+}
+
+const HostHeapStats *host_heap_stats(void) {
+    return &heap;
+}
+
+void host_reset_heap_stats(void) {
+    heap.peak = heap.used;
+    heap.allocations = 0;
+    heap.failures = 0;
+    heap.blocks_peak = heap.blocks;
+}
+
+size_t heap_bytes_free(void) {
+    return heap_size > heap.used ? heap_size - heap.used : 0;
+}
+
+/*
+ * Count a block of size bytes going from old_size bytes (0 if new) to new_size bytes (0 if freed)
+ */
+static void heap_account(size_t old_size, size_t new_size) {
+    heap.used = heap.used - old_size + new_size;
+    if (heap.used > heap.peak)
+        heap.peak = heap.used;
+    if (old_size == 0 && new_size > 0)
+        heap.blocks++;
+    if (old_size > 0 && new_size == 0)
+        heap.blocks--;
+    if (heap.blocks > heap.blocks_peak)
+        heap.blocks_peak = heap.blocks;
+}
+
+void *host_malloc(size_t size) {
+    return host_realloc(NULL, size);
+}
+
+void *host_calloc(size_t count, size_t size) {
+    void *pointer = host_malloc(count * size);
+    if (pointer != NULL)
+        memset(pointer, 0, count * size);
+    return pointer;
+}
+
+void *host_realloc(void *pointer, size_t size) {
+    BlockHeader *block = pointer == NULL ? NULL : (BlockHeader *) pointer - 1;
+    size_t old_size = block == NULL ? 0 : block->size;
+    if (size == 0) {
+        host_free(pointer);
+        return NULL;
+    }
+    if (size > old_size && size - old_size > heap_bytes_free()) {
+        heap.failures++;
+        return NULL;
+    }
+    BlockHeader *resized = realloc(block, sizeof(BlockHeader) + size);
+    if (resized == NULL) {
+        heap.failures++;
+        return NULL;
+    }
+    resized->size = size;
+    heap.allocations++;
+    heap_account(old_size, size);
+    return resized + 1;
+}
+
+void host_free(void *pointer) {
+    if (pointer == NULL)
+        return;
+    BlockHeader *block = (BlockHeader *) pointer - 1;
+    heap_account(block->size, 0);
+    free(block);
+}
+
+/**********************************************************
+ ** EVENTS
+ **********************************************************/
+
+typedef enum {
+    EVENT_PHONE_RECEIVED,
+    EVENT_WATCH_RECEIVED,
+    EVENT_OUTBOX_SENT,
+    EVENT_OUTBOX_FAILED
+} EventType;
+
+typedef struct Event {
+    EventType type;
+    uint64_t due_ms;
+    // Events due at the same time are played back in the order they were scheduled
+    uint64_t order;
+    AppMessageResult result;
+    uint8_t *message;
+    uint16_t size;
+} Event;
+
+struct AppTimer {
+    bool in_use;
+    uint64_t due_ms;
+    uint64_t order;
+    AppTimerCallback callback;
+    void *data;
+};
+
+static uint64_t now_ms = 0;
+static uint64_t next_order = 0;
+
+static Event *events = NULL;
+static size_t event_count = 0;
+static size_t event_capacity = 0;
+
+static AppTimer timers[MAX_TIMERS];
+
+/*
+ * Schedule an event due at due_ms. Of events due at the same time, those of lower order play first.
+ */
+static void schedule_in_order(EventType type, uint64_t due_ms, uint64_t order, AppMessageResult result,
+        const uint8_t *message, uint16_t size) {
+    if (event_count == event_capacity) {
+        event_capacity = event_capacity == 0 ? 16 : event_capacity * 2;
+        events = realloc(events, event_capacity * sizeof(Event));
+    }
+    uint8_t *copy = NULL;
+    if (message != NULL) {
+        copy = malloc(size);
+        memcpy(copy, message, size);
+    }
+    events[event_count++] = (Event) {
+        .type = type,
+        .due_ms = due_ms,
+        .order = order,
+        .result = result,
+        .message = copy,
+        .size = size
+    };
+}
+
+static void schedule(EventType type, uint64_t due_ms, AppMessageResult result, const uint8_t *message, uint16_t size) {
+    schedule_in_order(type, due_ms, next_order++, result, message, size);
+}
+
+uint64_t host_now_ms(void) {
+    return now_ms;
+}
+
+void host_advance(uint32_t ms) {
+    now_ms += ms;
+}
+
+time_t host_time(time_t *tloc) {
+    time_t seconds = HOST_EPOCH + now_ms / 1000;
+    if (tloc != NULL)
+        *tloc = seconds;
+    return seconds;
+}
+
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms) {
+    host_time(tloc);
+    if (out_ms != NULL)
+        *out_ms = now_ms % 1000;
+    return now_ms % 1000;
+}
+
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data) {
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (!timers[i].in_use) {
+            timers[i] = (AppTimer) {
+                .in_use = true,
+                .due_ms = now_ms + timeout_ms,
+                .order = next_order++,
+                .callback = callback,
+                .data = callback_data
+            };
+            return &timers[i];
+        }
+    }
+    return NULL;
+}
+
+bool app_timer_reschedule(AppTimer *timer, uint32_t new_timeout_ms) {
+    if (timer == NULL || !timer->in_use)
+        return false;
+    timer->due_ms = now_ms + new_timeout_ms;
+    return true;
+}
+
+void app_timer_cancel(AppTimer *timer) {
+    if (timer != NULL)
+        timer->in_use = false;
+}
+
+/**********************************************************
+ ** DICTIONARIES
+ **********************************************************/
+
+static Tuple *tuple_next(Tuple *tuple) {
+    return (Tuple *) ((uint8_t *) tuple + TUPLE_HEADER_SIZE + tuple->length);
+}
+
+uint32_t dict_calc_buffer_size(const uint8_t tuple_count, ...) {
+    uint32_t size = sizeof(Dictionary) + tuple_count * TUPLE_HEADER_SIZE;
+    va_list args;
+    va_start(args, tuple_count);
+    for (int i = 0; i < tuple_count; i++)
+        size += va_arg(args, uint32_t);
+    va_end(args);
+    return size;
+}
+
+uint32_t dict_size(DictionaryIterator *iter) {
+    return (const uint8_t *) iter->end - (const uint8_t *) iter->dictionary;
+}
+
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t * const buffer, const uint16_t size) {
+    if (iter == NULL || buffer == NULL)
+        return DICT_INVALID_ARGS;
+    if (size < sizeof(Dictionary))
+        return DICT_NOT_ENOUGH_STORAGE;
+    iter->dictionary = (Dictionary *) buffer;
+    iter->dictionary->count = 0;
+    iter->end = buffer + size;
+    iter->cursor = (Tuple *) iter->dictionary->head;
+    return DICT_OK;
+}
+
+static DictionaryResult dict_write(DictionaryIterator *iter, uint32_t key, TupleType type, const void *value, uint16_t length) {
+    if (iter == NULL || iter->dictionary == NULL)
+        return DICT_INVALID_ARGS;
+    if ((const uint8_t *) iter->cursor + TUPLE_HEADER_SIZE + length > (const uint8_t *) iter->end)
+        return DICT_NOT_ENOUGH_STORAGE;
+    Tuple *tuple = iter->cursor;
+    tuple->key = key;
+    tuple->type = type;
+    tuple->length = length;
+    memcpy(tuple->value->data, value, length);
+    iter->dictionary->count++;
+    iter->cursor = tuple_next(tuple);
+    return DICT_OK;
+}
+
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t * const data, const uint16_t size) {
+    return dict_write(iter, key, TUPLE_BYTE_ARRAY, data, size);
+}
+
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char * const cstring) {
+    return dict_write(iter, key, TUPLE_CSTRING, cstring, cstring == NULL ? 0 : strlen(cstring) + 1);
+}
+
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed) {
+    if (width_bytes != 1 && width_bytes != 2 && width_bytes != 4)
+        return DICT_INVALID_ARGS;
+    return dict_write(iter, key, is_signed ? TUPLE_INT : TUPLE_UINT, integer, width_bytes);
+}
+
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), false);
+}
+
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value) {
+    return dict_write_int(iter, key, &value, sizeof(value), true);
+}
+
+DictionaryResult dict_write_tuplet(DictionaryIterator *iter, const Tuplet * const tuplet) {
+    switch (tuplet->type) {
+        case TUPLE_BYTE_ARRAY:
+            return dict_write_data(iter, tuplet->key, tuplet->bytes.data, tuplet->bytes.length);
+        case TUPLE_CSTRING:
+            return dict_write(iter, tuplet->key, TUPLE_CSTRING, tuplet->cstring.data, tuplet->cstring.length);
+        default:
+            // The value sits in the low bytes of the storage, as on the little-endian watch
+            return dict_write_int(iter, tuplet->key, &tuplet->integer.storage, tuplet->integer.width,
+                    tuplet->type == TUPLE_INT);
+    }
+}
+
+uint32_t dict_write_end(DictionaryIterator *iter) {
+    if (iter == NULL || iter->dictionary == NULL)
+        return 0;
+    iter->end = iter->cursor;
+    return dict_size(iter);
+}
+
+Tuple *dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t * const buffer, const uint16_t size) {
+    iter->dictionary = (Dictionary *) buffer;
+    iter->end = buffer + size;
+    return dict_read_first(iter);
+}
+
+/*
+ * Return the tuple at the cursor, or NULL if it doesn't lie wholly within the dictionary
+ */
+static Tuple *dict_read_cursor(DictionaryIterator *iter) {
+    const uint8_t *tuple = (const uint8_t *) iter->cursor;
+    const uint8_t *end = (const uint8_t *) iter->end;
+    if (tuple + TUPLE_HEADER_SIZE > end || tuple + TUPLE_HEADER_SIZE + iter->cursor->length > end)
+        return NULL;
+    return iter->cursor;
+}
+
+Tuple *dict_read_first(DictionaryIterator *iter) {
+    iter->cursor = (Tuple *) iter->dictionary->head;
+    return dict_read_cursor(iter);
+}
+
+Tuple *dict_read_next(DictionaryIterator *iter) {
+    iter->cursor = tuple_next(iter->cursor);
+    return dict_read_cursor(iter);
+}
+
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key) {
+    DictionaryIterator find = *iter;
+    for (Tuple *tuple = dict_read_first(&find); tuple != NULL; tuple = dict_read_next(&find)) {
+        if (tuple->key == key)
+            return tuple;
+    }
+    return NULL;
+}
+
+/**********************************************************
+ ** APP MESSAGE
+ **********************************************************/
+
+static AppMessageInboxReceived inbox_received = NULL;
+static AppMessageInboxDropped inbox_dropped = NULL;
+static AppMessageOutboxSent outbox_sent = NULL;
+static AppMessageOutboxFailed outbox_failed = NULL;
+
+static HostPhoneHandler phone_handler = NULL;
+static void *phone_context = NULL;
+static HostLink link = { .latency_ms = 50, .bytes_per_second = 0, .timeout_ms = 1000, .inbox_size = DEFAULT_INBOX_SIZE };
+static HostMessageStats message_stats;
+
+// The outbox holds one message, from app_message_outbox_begin until its send succeeds or fails
+static uint8_t outbox[OUTBOX_SIZE];
+static DictionaryIterator outbox_iter;
+static bool outbox_pending = false;
+
+// Messages to the watch leave the phone one after another
+static uint8_t watch_message[DEFAULT_INBOX_SIZE * 4];
+static DictionaryIterator watch_iter;
+static uint64_t watch_link_free_ms = 0;
+
+void host_set_phone(HostPhoneHandler handler, void *context) {
+    phone_handler = handler;
+    phone_context = context;
+}
+
+void host_set_link(HostLink new_link) {
+    if (new_link.inbox_size > sizeof(watch_message))
+        new_link.inbox_size = sizeof(watch_message);
+    link = new_link;
+}
+
+const HostMessageStats *host_message_stats(void) {
+    return &message_stats;
+}
+
+DictionaryIterator *host_begin_message(void) {
+    dict_write_begin(&watch_iter, watch_message, sizeof(watch_message));
+    return &watch_iter;
+}
+
+/*
+ * Return the time a message of size bytes takes from one end of the link to the other
+ */
+static uint32_t transfer_ms(uint32_t size) {
+    if (link.bytes_per_second == 0)
+        return link.latency_ms;
+    return link.latency_ms + (uint64_t) size * 1000 / link.bytes_per_second;
+}
+
+void host_send_to_watch(DictionaryIterator *iter) {
+    uint32_t size = dict_write_end(iter);
+    uint64_t due_ms = now_ms + transfer_ms(size);
+    if (due_ms < watch_link_free_ms)
+        due_ms = watch_link_free_ms;
+    watch_link_free_ms = due_ms;
+    schedule(EVENT_WATCH_RECEIVED, due_ms, APP_MSG_OK, (const uint8_t *) iter->dictionary, size);
+}
+
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback) {
+    AppMessageInboxReceived previous = inbox_received;
+    inbox_received = received_callback;
+    return previous;
+}
+
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback) {
+    AppMessageInboxDropped previous = inbox_dropped;
+    inbox_dropped = dropped_callback;
+    return previous;
+}
+
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback) {
+    AppMessageOutboxSent previous = outbox_sent;
+    outbox_sent = sent_callback;
+    return previous;
+}
+
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback) {
+    AppMessageOutboxFailed previous = outbox_failed;
+    outbox_failed = failed_callback;
+    return previous;
+}
+
+uint32_t app_message_inbox_size_maximum(void) {
+    return link.inbox_size;
+}
+
+uint32_t app_message_outbox_size_maximum(void) {
+    return OUTBOX_SIZE;
+}
+
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound) {
+    if (size_inbound > link.inbox_size || size_outbound > OUTBOX_SIZE)
+        return APP_MSG_OUT_OF_MEMORY;
+    link.inbox_size = size_inbound;
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator) {
+    if (outbox_pending)
+        return APP_MSG_BUSY;
+    dict_write_begin(&outbox_iter, outbox, sizeof(outbox));
+    *iterator = &outbox_iter;
+    return APP_MSG_OK;
+}
+
+AppMessageResult app_message_outbox_send(void) {
+    if (outbox_pending)
+        return APP_MSG_BUSY;
+    uint32_t size = dict_write_end(&outbox_iter);
+    outbox_pending = true;
+    message_stats.sent++;
+    message_stats.sent_bytes += size;
+    schedule(EVENT_PHONE_RECEIVED, now_ms + transfer_ms(size), APP_MSG_OK, outbox, size);
+    return APP_MSG_OK;
+}
+
+/*
+ * Hand a message from the watch to the phone, and answer the watch with what became of it
+ */
+static void phone_receive(const Event *event) {
+    DictionaryIterator iter;
+    dict_read_begin_from_buffer(&iter, event->message, event->size);
+
+    // The ack leaves before any reply the phone sends meanwhile
+    uint64_t ack_order = next_order++;
+    HostDelivery delivery = phone_handler == NULL ? HOST_DROP : phone_handler(&iter, phone_context);
+    switch (delivery) {
+        case HOST_DELIVER:
+            schedule_in_order(EVENT_OUTBOX_SENT, now_ms + link.latency_ms, ack_order, APP_MSG_OK, NULL, 0);
+            break;
+        case HOST_DROP:
+            // The watch gives up on the ack timeout_ms after sending
+            message_stats.dropped++;
+            schedule_in_order(EVENT_OUTBOX_FAILED, event->due_ms - transfer_ms(event->size) + link.timeout_ms,
+                    ack_order, APP_MSG_SEND_TIMEOUT, NULL, 0);
+            break;
+        case HOST_BUSY:
+            message_stats.busy++;
+            schedule_in_order(EVENT_OUTBOX_FAILED, now_ms + link.latency_ms, ack_order, APP_MSG_BUSY, NULL, 0);
+            break;
+    }
+}
+
+static void watch_receive(const Event *event) {
+    if (event->size > link.inbox_size) {
+        message_stats.overflowed++;
+        if (inbox_dropped != NULL)
+            inbox_dropped(APP_MSG_BUFFER_OVERFLOW, NULL);
+        return;
+    }
+    message_stats.received++;
+    message_stats.received_bytes += event->size;
+    DictionaryIterator iter;
+    dict_read_begin_from_buffer(&iter, event->message, event->size);
+    if (inbox_received != NULL)
+        inbox_received(&iter, NULL);
+}
+
+static void play(const Event *event) {
+    DictionaryIterator iter;
+    switch (event->type) {
+        case EVENT_PHONE_RECEIVED:
+            phone_receive(event);
+            break;
+        case EVENT_WATCH_RECEIVED:
+            watch_receive(event);
+            break;
+        case EVENT_OUTBOX_SENT:
+            outbox_pending = false;
+            dict_read_begin_from_buffer(&iter, outbox, dict_size(&outbox_iter));
+            if (outbox_sent != NULL)
+                outbox_sent(&iter, NULL);
+            break;
+        case EVENT_OUTBOX_FAILED:
+            outbox_pending = false;
+            dict_read_begin_from_buffer(&iter, outbox, dict_size(&outbox_iter));
+            if (outbox_failed != NULL)
+                outbox_failed(&iter, event->result, NULL);
+            break;
+    }
+}
+
+/*
+ * Play back the next event or timer due by deadline_ms. Return false if there is none.
+ */
+static bool play_next(uint64_t deadline_ms) {
+    Event *next_event = NULL;
+    for (size_t i = 0; i < event_count; i++) {
+        if (next_event == NULL || events[i].due_ms < next_event->due_ms ||
+                (events[i].due_ms == next_event->due_ms && events[i].order < next_event->order))
+            next_event = &events[i];
+    }
+    AppTimer *next_timer = NULL;
+    for (int i = 0; i < MAX_TIMERS; i++) {
+        if (timers[i].in_use && (next_timer == NULL || timers[i].due_ms < next_timer->due_ms ||
+                (timers[i].due_ms == next_timer->due_ms && timers[i].order < next_timer->order)))
+            next_timer = &timers[i];
+    }
+
+    bool timer_first = next_timer != NULL && (next_event == NULL || next_timer->due_ms < next_event->due_ms ||
+            (next_timer->due_ms == next_event->due_ms && next_timer->order < next_event->order));
+    if (timer_first) {
+        if (next_timer->due_ms > deadline_ms)
+            return false;
+        if (next_timer->due_ms > now_ms)
+            now_ms = next_timer->due_ms;
+        next_timer->in_use = false;
+        next_timer->callback(next_timer->data);
+        return true;
+    }
+    if (next_event == NULL || next_event->due_ms > deadline_ms)
+        return false;
+
+    // The event leaves the queue before it plays, since playing it may schedule more
+    Event event = *next_event;
+    *next_event = events[--event_count];
+    if (event.due_ms > now_ms)
+        now_ms = event.due_ms;
+    play(&event);
+    free(event.message);
+    return true;
+}
+
+bool host_run(bool (*done)(void), uint32_t timeout_ms) {
+    uint64_t deadline_ms = now_ms + timeout_ms;
+    while (done == NULL || !done()) {
+        if (!play_next(deadline_ms))
+            return false;
+    }
+    return true;
+}
+
+void host_run_due(void) {
+    while (play_next(now_ms))
+        ;
+}
+
+/**********************************************************
+ ** PERSISTENT STORAGE
+ **********************************************************/
+
+typedef struct PersistValue {
+    bool in_use;
+    uint32_t key;
+    uint16_t size;
+    uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} PersistValue;
+
+static PersistValue persist_values[MAX_PERSIST_KEYS];
+
+static PersistValue *persist_find(uint32_t key) {
+    for (int i = 0; i < MAX_PERSIST_KEYS; i++) {
+        if (persist_values[i].in_use && persist_values[i].key == key)
+            return &persist_values[i];
+    }
+    return NULL;
+}
+
+/*
+ * Return the bytes stored under every key but key
+ */
+static size_t persist_used_except(uint32_t key) {
+    size_t used = 0;
+    for (int i = 0; i < MAX_PERSIST_KEYS; i++) {
+        if (persist_values[i].in_use && persist_values[i].key != key)
+            used += persist_values[i].size;
+    }
+    return used;
+}
+
+bool persist_exists(const uint32_t key) {
+    return persist_find(key) != NULL;
+}
+
+int persist_get_size(const uint32_t key) {
+    PersistValue *value = persist_find(key);
+    return value == NULL ? E_DOES_NOT_EXIST : value->size;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size) {
+    PersistValue *value = persist_find(key);
+    if (value == NULL)
+        return E_DOES_NOT_EXIST;
+    size_t size = value->size < buffer_size ? value->size : buffer_size;
+    memcpy(buffer, value->data, size);
+    return size;
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size) {
+    size_t length = size < PERSIST_DATA_MAX_LENGTH ? size : PERSIST_DATA_MAX_LENGTH;
+    if (persist_used_except(key) + length > PERSIST_TOTAL_SIZE)
+        return E_OUT_OF_STORAGE;
+    PersistValue *value = persist_find(key);
+    for (int i = 0; value == NULL && i < MAX_PERSIST_KEYS; i++) {
+        if (!persist_values[i].in_use)
+            value = &persist_values[i];
+    }
+    if (value == NULL)
+        return E_OUT_OF_STORAGE;
+    value->in_use = true;
+    value->key = key;
+    value->size = length;
+    memcpy(value->data, data, length);
+    return length;
+}
+
+status_t persist_delete(const uint32_t key) {
+    PersistValue *value = persist_find(key);
+    if (value == NULL)
+        return E_DOES_NOT_EXIST;
+    value->in_use = false;
+    return S_SUCCESS;
+}
+
+/**********************************************************
+ ** RESET
+ **********************************************************/
+
+void host_reset(void) {
+    for (size_t i = 0; i < event_count; i++)
+        free(events[i].message);
+    event_count = 0;
+    memset(timers, 0, sizeof(timers));
+    memset(persist_values, 0, sizeof(persist_values));
+    memset(&message_stats, 0, sizeof(message_stats));
+    now_ms = 0;
+    watch_link_free_ms = 0;
+    outbox_pending = false;
+    host_reset_heap_stats();
+}
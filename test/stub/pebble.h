@@ -0,0 +1,209 @@
+#pragma once
+
+/*
+ * The part of the Pebble SDK used by the sync and data modules, for building them on a host.
+ * Types and constants match the SDK, so messages are laid out as on the watch. The functions
+ * are implemented by pebble.c on top of a simulated clock; see host.h for the controls.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**********************************************************
+ ** LOGGING
+ **********************************************************/
+
+typedef enum {
+    APP_LOG_LEVEL_ERROR = 1,
+    APP_LOG_LEVEL_WARNING = 50,
+    APP_LOG_LEVEL_INFO = 100,
+    APP_LOG_LEVEL_DEBUG = 200,
+    APP_LOG_LEVEL_DEBUG_VERBOSE = 255
+} AppLogLevel;
+
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+#define APP_LOG(level, fmt, args...) app_log(level, __FILE__, __LINE__, fmt, ## args)
+
+/**********************************************************
+ ** MEMORY
+ **********************************************************/
+
+/*
+ * The heap of the watch is small, so allocations are counted against a simulated heap; see
+ * host_set_heap_size. heap_bytes_free is what is left of it.
+ */
+void *host_malloc(size_t size);
+void *host_calloc(size_t count, size_t size);
+void *host_realloc(void *pointer, size_t size);
+void host_free(void *pointer);
+size_t heap_bytes_free(void);
+
+#define malloc(size) host_malloc(size)
+#define calloc(count, size) host_calloc(count, size)
+#define realloc(pointer, size) host_realloc(pointer, size)
+#define free(pointer) host_free(pointer)
+
+/**********************************************************
+ ** TIME
+ **********************************************************/
+
+// The watch tells the time by the simulated clock
+time_t host_time(time_t *tloc);
+#define time(tloc) host_time(tloc)
+
+uint16_t time_ms(time_t *tloc, uint16_t *out_ms);
+
+typedef struct AppTimer AppTimer;
+typedef void (*AppTimerCallback)(void *data);
+
+AppTimer *app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void *callback_data);
+bool app_timer_reschedule(AppTimer *timer, uint32_t new_timeout_ms);
+void app_timer_cancel(AppTimer *timer);
+
+/**********************************************************
+ ** DICTIONARIES
+ **********************************************************/
+
+typedef enum {
+    TUPLE_BYTE_ARRAY = 0,
+    TUPLE_CSTRING = 1,
+    TUPLE_UINT = 2,
+    TUPLE_INT = 3
+} TupleType;
+
+typedef struct __attribute__((__packed__)) Tuple {
+    uint32_t key;
+    TupleType type:8;
+    uint16_t length;
+    union {
+        uint8_t data[0];
+        char cstring[0];
+        uint8_t uint8;
+        uint16_t uint16;
+        uint32_t uint32;
+        int8_t int8;
+        int16_t int16;
+        int32_t int32;
+    } value[];
+} Tuple;
+
+struct Dictionary;
+typedef struct Dictionary Dictionary;
+
+typedef struct DictionaryIterator {
+    Dictionary *dictionary;
+    const void *end;
+    Tuple *cursor;
+} DictionaryIterator;
+
+typedef enum {
+    DICT_OK = 0,
+    DICT_NOT_ENOUGH_STORAGE = 1 << 1,
+    DICT_INVALID_ARGS = 1 << 2,
+    DICT_INTERNAL_INCONSISTENCY = 1 << 3,
+    DICT_MALLOC_FAILED = 1 << 4
+} DictionaryResult;
+
+typedef struct Tuplet {
+    TupleType type;
+    uint32_t key;
+    union {
+        struct {
+            const uint8_t *data;
+            const uint16_t length;
+        } bytes;
+        struct {
+            const char *data;
+            const uint16_t length;
+        } cstring;
+        struct {
+            uint32_t storage;
+            const uint16_t width;
+        } integer;
+    };
+} Tuplet;
+
+#define TupletBytes(_key, _data, _length) \
+    ((const Tuplet) { .type = TUPLE_BYTE_ARRAY, .key = _key, .bytes = { .data = _data, .length = _length }})
+#define TupletCString(_key, _cstring) \
+    ((const Tuplet) { .type = TUPLE_CSTRING, .key = _key, .cstring = { .data = _cstring, .length = _cstring ? strlen(_cstring) + 1 : 0 }})
+#define TupletInteger(_key, _integer) \
+    ((const Tuplet) { .type = TUPLE_UINT, .key = _key, .integer = { .storage = _integer, .width = sizeof(_integer) }})
+
+uint32_t dict_calc_buffer_size(const uint8_t tuple_count, ...);
+uint32_t dict_size(DictionaryIterator *iter);
+DictionaryResult dict_write_begin(DictionaryIterator *iter, uint8_t * const buffer, const uint16_t size);
+DictionaryResult dict_write_data(DictionaryIterator *iter, const uint32_t key, const uint8_t * const data, const uint16_t size);
+DictionaryResult dict_write_cstring(DictionaryIterator *iter, const uint32_t key, const char * const cstring);
+DictionaryResult dict_write_int(DictionaryIterator *iter, const uint32_t key, const void *integer, const uint8_t width_bytes, const bool is_signed);
+DictionaryResult dict_write_uint8(DictionaryIterator *iter, const uint32_t key, const uint8_t value);
+DictionaryResult dict_write_uint16(DictionaryIterator *iter, const uint32_t key, const uint16_t value);
+DictionaryResult dict_write_uint32(DictionaryIterator *iter, const uint32_t key, const uint32_t value);
+DictionaryResult dict_write_int32(DictionaryIterator *iter, const uint32_t key, const int32_t value);
+DictionaryResult dict_write_tuplet(DictionaryIterator *iter, const Tuplet * const tuplet);
+uint32_t dict_write_end(DictionaryIterator *iter);
+Tuple *dict_read_begin_from_buffer(DictionaryIterator *iter, const uint8_t * const buffer, const uint16_t size);
+Tuple *dict_read_first(DictionaryIterator *iter);
+Tuple *dict_read_next(DictionaryIterator *iter);
+Tuple *dict_find(const DictionaryIterator *iter, const uint32_t key);
+
+/**********************************************************
+ ** APP MESSAGE
+ **********************************************************/
+
+typedef enum {
+    APP_MSG_OK = 0,
+    APP_MSG_SEND_TIMEOUT = 1 << 1,
+    APP_MSG_SEND_REJECTED = 1 << 2,
+    APP_MSG_NOT_CONNECTED = 1 << 3,
+    APP_MSG_APP_NOT_RUNNING = 1 << 4,
+    APP_MSG_INVALID_ARGS = 1 << 5,
+    APP_MSG_BUSY = 1 << 6,
+    APP_MSG_BUFFER_OVERFLOW = 1 << 7,
+    APP_MSG_ALREADY_RELEASED = 1 << 9,
+    APP_MSG_CALLBACK_ALREADY_REGISTERED = 1 << 10,
+    APP_MSG_CALLBACK_NOT_REGISTERED = 1 << 11,
+    APP_MSG_OUT_OF_MEMORY = 1 << 12,
+    APP_MSG_CLOSED = 1 << 13,
+    APP_MSG_INTERNAL_ERROR = 1 << 14
+} AppMessageResult;
+
+typedef void (*AppMessageInboxReceived)(DictionaryIterator *iterator, void *context);
+typedef void (*AppMessageInboxDropped)(AppMessageResult reason, void *context);
+typedef void (*AppMessageOutboxSent)(DictionaryIterator *iterator, void *context);
+typedef void (*AppMessageOutboxFailed)(DictionaryIterator *iterator, AppMessageResult reason, void *context);
+
+AppMessageInboxReceived app_message_register_inbox_received(AppMessageInboxReceived received_callback);
+AppMessageInboxDropped app_message_register_inbox_dropped(AppMessageInboxDropped dropped_callback);
+AppMessageOutboxSent app_message_register_outbox_sent(AppMessageOutboxSent sent_callback);
+AppMessageOutboxFailed app_message_register_outbox_failed(AppMessageOutboxFailed failed_callback);
+uint32_t app_message_inbox_size_maximum(void);
+uint32_t app_message_outbox_size_maximum(void);
+AppMessageResult app_message_open(const uint32_t size_inbound, const uint32_t size_outbound);
+AppMessageResult app_message_outbox_begin(DictionaryIterator **iterator);
+AppMessageResult app_message_outbox_send(void);
+
+/**********************************************************
+ ** PERSISTENT STORAGE
+ **********************************************************/
+
+typedef int32_t status_t;
+
+#define S_SUCCESS 0
+#define E_OUT_OF_STORAGE -6
+#define E_DOES_NOT_EXIST -9
+
+#define PERSIST_DATA_MAX_LENGTH 256
+
+bool persist_exists(const uint32_t key);
+int persist_get_size(const uint32_t key);
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size);
+int persist_write_data(const uint32_t key, const void *data, const size_t size);
+status_t persist_delete(const uint32_t key);
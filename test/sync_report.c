@@ -0,0 +1,82 @@
+#include <pebble.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "fixture.h"
+#include "host.h"
+#include "phone.h"
+#include "protocol.h"
+#include "sync.h"
+
+/*
+ * Sync stop lists of several sizes from the fake phone, in each form of the protocol, and print
+ * what each sync cost the watch: messages and bytes each way, simulated time until the list was
+ * loaded, and the peak of the heap. Exits with 1 if any sync didn't complete.
+ */
+
+typedef struct Mode {
+    const char *name;
+    uint32_t capabilities;
+} Mode;
+
+static const Mode modes[] = {
+    { "legacy", 0 },
+    { "batched", CAPABILITY_BATCHED_STOPS },
+    { "pipelined", CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS },
+    { "binary", CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS | CAPABILITY_BINARY_RECORDS |
+                CAPABILITY_SECTION_HEADERS },
+    { "all", SUPPORTED_CAPABILITIES }
+};
+
+typedef struct Size {
+    uint16_t section_count;
+    uint16_t stops_per_section;
+} Size;
+
+static const Size sizes[] = { { 1, 1 }, { 4, 5 }, { 10, 10 }, { 30, 10 }, { 40, 12 } };
+
+/*
+ * Sync a list of the given size in the given mode, and print its row. Sync keeps its state in
+ * statics, so each row runs in a process of its own. Return false if the sync didn't complete.
+ */
+static bool report_sync(const Mode *mode, const Size *size) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        host_set_link((HostLink) { .latency_ms = 50, .bytes_per_second = 4000, .timeout_ms = 1000, .inbox_size = 2026 });
+        PhoneConfig config = {
+            .section_count = size->section_count,
+            .stops_per_section = size->stops_per_section,
+            .capabilities = mode->capabilities,
+            .generation = 1,
+            .seed = 1
+        };
+        bool loaded = sync_list(&config) != NULL && stop_list_is_complete(loaded_list);
+
+        const HostMessageStats *messages = host_message_stats();
+        const HostHeapStats *heap = host_heap_stats();
+        printf("%-10s %6u %6u %8u %6u %8u %9llu %7u %7u  %s\n", mode->name,
+               size->section_count * size->stops_per_section, messages->sent, messages->sent_bytes,
+               messages->received, messages->received_bytes, (unsigned long long) host_now_ms(),
+               (unsigned) heap->peak, heap->allocations, loaded ? "ok" : "FAILED");
+        fflush(stdout);
+        _exit(loaded ? 0 : 1);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return false;
+    if (WIFSIGNALED(status))
+        printf("%-10s %6u  crashed with signal %d\n", mode->name, size->section_count * size->stops_per_section,
+               WTERMSIG(status));
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(void) {
+    printf("%-10s %6s %6s %8s %6s %8s %9s %7s %7s\n", "mode", "stops", "sent", "bytes", "recv", "bytes",
+           "ms", "heap", "allocs");
+    bool passed = true;
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+            passed &= report_sync(&modes[m], &sizes[s]);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+#include <pebble.h>
+#include "check.h"
+#include "data.h"
+#include "host.h"
+#include "phone.h"
+
+#define SECTION_COUNT 3
+#define STOPS_PER_SECTION 4
+
+/*
+ * Return a complete list of the phone's strings
+ */
+static StopList *build_list(void) {
+    StopList *list = stop_list_create(SECTION_COUNT, SECTION_COUNT * STOPS_PER_SECTION);
+    for (uint16_t i = 0; list != NULL && i < SECTION_COUNT; i++) {
+        char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+        phone_section_strings(i, stop_tag, stop_title);
+        CHECK(stop_list_add_section(&list, i, stop_tag, stop_title, STOPS_PER_SECTION) != NULL);
+        for (uint16_t j = 0; j < STOPS_PER_SECTION; j++) {
+            char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+            phone_stop_strings(i, j, strings);
+            CHECK(section_add_stop(&list, i, j, strings[0], strings[1], strings[2], strings[3]) != NULL);
+        }
+    }
+    CHECK(list != NULL && stop_list_is_complete(list));
+    return list;
+}
+
+/*
+ * Restore a copy of list, as the cache does, with the first stop of each section replaced by
+ * first_stops. Return whether the copy was accepted.
+ */
+static bool restore_with_first_stops(StopList *list, const uint16_t first_stops[SECTION_COUNT]) {
+    StopListRegion regions[STOP_LIST_REGION_COUNT];
+    stop_list_get_regions(list, regions);
+    StopList *restored = stop_list_begin_restore(list->section_count, list->stop_count, list->string_size);
+    CHECK(restored != NULL);
+    if (restored == NULL)
+        return false;
+
+    StopListRegion restored_regions[STOP_LIST_REGION_COUNT];
+    stop_list_get_regions(restored, restored_regions);
+    for (int r = 0; r < STOP_LIST_REGION_COUNT; r++)
+        memcpy(restored_regions[r].data, regions[r].data, regions[r].size);
+    for (int i = 0; i < SECTION_COUNT; i++)
+        restored->sections[i].first_stop = first_stops[i];
+
+    bool accepted = stop_list_finish_restore(&restored);
+    stop_list_destroy(restored);
+    return accepted;
+}
+
+/**********************************************************
+ ** TESTS
+ **********************************************************/
+
+static void test_restore(void) {
+    StopList *list = build_list();
+    if (list == NULL)
+        return;
+    CHECK(restore_with_first_stops(list, (uint16_t[]) { 0, 4, 8 }));
+    // Sections may have been received in any order
+    CHECK(restore_with_first_stops(list, (uint16_t[]) { 8, 0, 4 }));
+    stop_list_destroy(list);
+}
+
+/*
+ * A corrupt list whose checksum still matches must not let two sections share stops, even
+ * though its stop counts add up
+ */
+static void test_restore_overlapping_sections(void) {
+    StopList *list = build_list();
+    if (list == NULL)
+        return;
+    CHECK(!restore_with_first_stops(list, (uint16_t[]) { 0, 0, 8 }));
+    CHECK(!restore_with_first_stops(list, (uint16_t[]) { 0, 2, 8 }));
+    CHECK(!restore_with_first_stops(list, (uint16_t[]) { 1, 4, 8 }));
+    stop_list_destroy(list);
+}
+
+int main(void) {
+    bool passed = true;
+    passed &= check_run("data: restore", test_restore);
+    passed &= check_run("data: restore overlapping sections", test_restore_overlapping_sections);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,263 @@
+#include <pebble.h>
+#include "check.h"
+#include "protocol.h"
+#include "records.h"
+#include "record_writer.h"
+
+// Large enough for any message in these tests
+#define BUFFER_SIZE 1024
+
+static bool slice_equals(StringSlice slice, const char *string) {
+    return slice.length == strlen(string) && memcmp(slice.data, string, slice.length) == 0;
+}
+
+/**********************************************************
+ ** BINARY RECORDS
+ **********************************************************/
+
+static void test_varints(void) {
+    static const uint32_t values[] = { 0, 1, 127, 128, 300, 16383, 16384, 2097151, 2097152, UINT32_MAX };
+    uint8_t data[BUFFER_SIZE];
+    RecordWriter writer;
+    record_writer_init(&writer, data, sizeof(data));
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        uint16_t offset = writer.offset;
+        record_write_varint(&writer, values[i]);
+        CHECK(writer.offset - offset == record_varint_size(values[i]));
+    }
+    CHECK(!writer.failed);
+
+    RecordReader reader;
+    record_reader_init(&reader, data, writer.offset);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        CHECK(record_read_varint(&reader) == values[i]);
+    CHECK(!reader.failed && reader.offset == writer.offset);
+
+    // Nothing is left to read
+    CHECK(record_read_varint(&reader) == 0 && reader.failed);
+
+    // A varint cut off, and one longer than a uint32_t takes, are malformed
+    record_reader_init(&reader, (const uint8_t[]) { 0x80 }, 1);
+    CHECK(record_read_varint(&reader) == 0 && reader.failed);
+    record_reader_init(&reader, (const uint8_t[]) { 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 }, 6);
+    CHECK(record_read_varint(&reader) == 0 && reader.failed);
+}
+
+static void test_strings(void) {
+    char long_string[300];
+    memset(long_string, 'x', sizeof(long_string) - 1);
+    long_string[sizeof(long_string) - 1] = '\0';
+    const char *strings[] = { "", "504", "King St West At Spadina Ave", long_string };
+
+    uint8_t data[BUFFER_SIZE];
+    RecordWriter writer;
+    record_writer_init(&writer, data, sizeof(data));
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++)
+        record_write_string(&writer, strings[i]);
+    CHECK(!writer.failed);
+
+    RecordReader reader;
+    record_reader_init(&reader, data, writer.offset);
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        StringSlice slice;
+        CHECK(record_read_string(&reader, &slice) && slice_equals(slice, strings[i]));
+    }
+    CHECK(!reader.failed && reader.offset == writer.offset);
+
+    // A string longer than the data left, and one holding a NUL, are malformed
+    StringSlice slice;
+    record_reader_init(&reader, (const uint8_t[]) { 3, 'a', 'b' }, 3);
+    CHECK(!record_read_string(&reader, &slice) && reader.failed);
+    record_reader_init(&reader, (const uint8_t[]) { 3, 'a', '\0', 'b' }, 4);
+    CHECK(!record_read_string(&reader, &slice) && reader.failed);
+
+    // A writer with no room for a string fails after its length rather than writing past its data
+    record_writer_init(&writer, data, 4);
+    record_write_string(&writer, "King St West");
+    CHECK(writer.failed && writer.offset == 1);
+}
+
+static void test_stop_records(void) {
+    static const char *stops[][STOP_STRING_COUNT] = {
+        { "504", "504-King", "504_0_504", "East - 504 King towards Broadview Station" },
+        { "510", "510-Spadina", "510_1_510", "South - 510 Spadina towards Queens Quay" },
+        { "", "", "", "" }
+    };
+    uint16_t record_count = sizeof(stops) / sizeof(stops[0]);
+
+    // The phone's side: the header, then the strings of each stop
+    uint8_t data[BUFFER_SIZE];
+    RecordWriter writer;
+    record_writer_init(&writer, data, sizeof(data));
+    record_write_varint(&writer, RECORD_FORMAT_VERSION);
+    record_write_varint(&writer, 42);
+    record_write_varint(&writer, 200);
+    record_write_varint(&writer, record_count);
+    for (uint16_t i = 0; i < record_count; i++)
+        for (int f = 0; f < STOP_STRING_COUNT; f++)
+            record_write_string(&writer, stops[i][f]);
+    CHECK(!writer.failed);
+
+    // The watch's side, as sync reads STOP_RECORDS
+    RecordReader reader;
+    record_reader_init(&reader, data, writer.offset);
+    CHECK(record_read_varint(&reader) == RECORD_FORMAT_VERSION);
+    CHECK(record_read_varint(&reader) == 42);
+    CHECK(record_read_varint(&reader) == 200);
+    CHECK(record_read_varint(&reader) == record_count);
+    for (uint16_t i = 0; i < record_count; i++) {
+        for (int f = 0; f < STOP_STRING_COUNT; f++) {
+            StringSlice slice;
+            CHECK(record_read_string(&reader, &slice) && slice_equals(slice, stops[i][f]));
+        }
+    }
+    CHECK(!reader.failed && reader.offset == writer.offset);
+}
+
+static void test_section_headers_and_arrivals(void) {
+    uint8_t data[BUFFER_SIZE];
+    RecordWriter writer;
+    record_writer_init(&writer, data, sizeof(data));
+    record_write_varint(&writer, RECORD_FORMAT_VERSION);
+    record_write_varint(&writer, 0);
+    record_write_varint(&writer, 1);
+    record_write_string(&writer, "10000");
+    record_write_string(&writer, "King St West At Spadina Ave");
+    record_write_varint(&writer, 12);
+
+    RecordReader reader;
+    StringSlice stop_tag, stop_title;
+    record_reader_init(&reader, data, writer.offset);
+    CHECK(record_read_varint(&reader) == RECORD_FORMAT_VERSION);
+    CHECK(record_read_varint(&reader) == 0);
+    CHECK(record_read_varint(&reader) == 1);
+    CHECK(record_read_string(&reader, &stop_tag) && slice_equals(stop_tag, "10000"));
+    CHECK(record_read_string(&reader, &stop_title) && slice_equals(stop_title, "King St West At Spadina Ave"));
+    CHECK(record_read_varint(&reader) == 12);
+    CHECK(!reader.failed && reader.offset == writer.offset);
+
+    uint32_t arrival_time = 1800000000;
+    record_writer_init(&writer, data, sizeof(data));
+    record_write_varint(&writer, RECORD_FORMAT_VERSION);
+    record_write_varint(&writer, 2);
+    record_write_varint(&writer, arrival_time);
+    record_write_varint(&writer, 90);
+    record_write_varint(&writer, 0);
+    record_write_varint(&writer, 0);
+
+    record_reader_init(&reader, data, writer.offset);
+    CHECK(record_read_varint(&reader) == RECORD_FORMAT_VERSION);
+    CHECK(record_read_varint(&reader) == 2);
+    CHECK(record_read_varint(&reader) == arrival_time);
+    CHECK(record_read_varint(&reader) == 90);
+    CHECK(record_read_varint(&reader) == 0);
+    CHECK(record_read_varint(&reader) == 0);
+    CHECK(!reader.failed && reader.offset == writer.offset);
+}
+
+/**********************************************************
+ ** MESSAGES
+ **********************************************************/
+
+/*
+ * Read back a dictionary written into buffer, as the watch receives it
+ */
+static DictionaryIterator *receive(uint8_t *buffer, DictionaryIterator *iter) {
+    uint32_t size = dict_write_end(iter);
+    static DictionaryIterator received;
+    dict_read_begin_from_buffer(&received, buffer, size);
+    return &received;
+}
+
+static void test_message_fields(void) {
+    uint8_t buffer[BUFFER_SIZE];
+    DictionaryIterator iter;
+    dict_write_begin(&iter, buffer, sizeof(buffer));
+    dict_write_uint8(&iter, MESSAGE_TYPE, MESSAGE_SECTION_DATA);
+    // Integers may come at any width
+    dict_write_uint32(&iter, SECTION_INDEX, 3);
+    dict_write_cstring(&iter, SECTION_STOP_TAG, "10003");
+    dict_write_cstring(&iter, SECTION_STOP_TITLE, "Bathurst St At College St");
+    dict_write_int32(&iter, SECTION_STOP_COUNT, 12);
+    dict_write_uint16(&iter, REQUEST_SEQUENCE, 200);
+    dict_write_data(&iter, STOP_RECORDS, (const uint8_t[]) { 1, 2, 3 }, 3);
+
+    Message message;
+    CHECK(message_decode(receive(buffer, &iter), &message));
+    uint32_t fields = FIELD_BIT(MESSAGE_TYPE) | FIELD_BIT(SECTION_INDEX) | FIELD_BIT(SECTION_STOP_TAG) |
+                      FIELD_BIT(SECTION_STOP_TITLE) | FIELD_BIT(SECTION_STOP_COUNT) | FIELD_BIT(REQUEST_SEQUENCE) |
+                      FIELD_BIT(STOP_RECORDS);
+    CHECK(message.present == fields);
+    CHECK(message.message_type == MESSAGE_SECTION_DATA);
+    CHECK(message.section_index == 3);
+    CHECK(strcmp(message.stop_tag, "10003") == 0);
+    CHECK(strcmp(message.stop_title, "Bathurst St At College St") == 0);
+    CHECK(message.stop_count == 12);
+    CHECK(message.sequence == 200);
+    CHECK(message.stop_records->length == 3 && message.stop_records->value->data[2] == 3);
+    CHECK(message_require(&message, FIELD_BIT(STOP_RECORDS)));
+    CHECK(!message_require(&message, FIELD_BIT(ARRIVALS)));
+}
+
+static void test_malformed_fields(void) {
+    uint8_t buffer[BUFFER_SIZE];
+    DictionaryIterator iter;
+    dict_write_begin(&iter, buffer, sizeof(buffer));
+    dict_write_uint8(&iter, MESSAGE_TYPE, MESSAGE_STOP_DATA);
+    // Out of range for a UINT8, negative, and of the wrong kind: each counts as missing
+    dict_write_uint16(&iter, REQUEST_SEQUENCE, 256);
+    dict_write_int32(&iter, SECTION_INDEX, -1);
+    dict_write_uint16(&iter, STOP_ROUTE_TAG, 504);
+    dict_write_cstring(&iter, STOP_RECORD_COUNT, "3");
+
+    Message message;
+    CHECK(message_decode(receive(buffer, &iter), &message));
+    CHECK(message.present == FIELD_BIT(MESSAGE_TYPE));
+
+    // A message lacking a field its type requires is dropped
+    dict_write_begin(&iter, buffer, sizeof(buffer));
+    dict_write_uint8(&iter, MESSAGE_TYPE, MESSAGE_SECTION_DATA);
+    dict_write_uint16(&iter, SECTION_INDEX, 0);
+    CHECK(!message_decode(receive(buffer, &iter), &message));
+
+    // So is one with no type
+    dict_write_begin(&iter, buffer, sizeof(buffer));
+    dict_write_uint16(&iter, SECTION_INDEX, 0);
+    CHECK(!message_decode(receive(buffer, &iter), &message));
+}
+
+static void test_batched_records(void) {
+    uint8_t buffer[BUFFER_SIZE];
+    DictionaryIterator iter;
+    dict_write_begin(&iter, buffer, sizeof(buffer));
+    dict_write_uint8(&iter, MESSAGE_TYPE, MESSAGE_STOP_DATA);
+    for (uint16_t i = 0; i < 2; i++) {
+        for (int f = 0; f < STOP_RECORD_FIELD_COUNT; f++) {
+            // The last field of the last record is missing
+            if (i == 1 && f == STOP_RECORD_DIRECTION_TITLE)
+                continue;
+            char string[32];
+            snprintf(string, sizeof(string), "stop %u field %d", i, f);
+            dict_write_cstring(&iter, STOP_RECORD_BASE + i * STOP_RECORD_FIELD_COUNT + f, string);
+        }
+    }
+
+    char *fields[2 * STOP_RECORD_FIELD_COUNT];
+    message_find_records(receive(buffer, &iter), STOP_RECORD_BASE, STOP_RECORD_FIELD_COUNT, 2, fields);
+    CHECK(fields[0] != NULL && strcmp(fields[0], "stop 0 field 0") == 0);
+    CHECK(fields[3] != NULL && strcmp(fields[3], "stop 0 field 3") == 0);
+    CHECK(fields[6] != NULL && strcmp(fields[6], "stop 1 field 2") == 0);
+    CHECK(fields[7] == NULL);
+}
+
+int main(void) {
+    bool passed = true;
+    passed &= check_run("records: varints", test_varints);
+    passed &= check_run("records: strings", test_strings);
+    passed &= check_run("records: stop records", test_stop_records);
+    passed &= check_run("records: section headers and arrivals", test_section_headers_and_arrivals);
+    passed &= check_run("messages: fields", test_message_fields);
+    passed &= check_run("messages: malformed fields", test_malformed_fields);
+    passed &= check_run("messages: batched records", test_batched_records);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,197 @@
+#include <pebble.h>
+#include "check.h"
+#include "fixture.h"
+#include "host.h"
+#include "phone.h"
+#include "protocol.h"
+#include "sync.h"
+
+// Predictions pushed, and passes over the sections of a list, in each soak
+#define PREDICTION_COUNT 1000
+#define VIEW_PASSES 20
+
+// Bound on the memory of stop lists in the eviction soak: room for the records of every stop,
+// but for the strings of only a few sections
+#define LIST_BUDGET (30 * 1024)
+
+static uint32_t prediction_count = 0;
+static Prediction last_prediction;
+static uint32_t section_loads = 0;
+
+static void on_prediction_loaded(const Prediction *prediction) {
+    prediction_count++;
+    last_prediction = *prediction;
+}
+
+static void on_section_predictions_loaded(StopList *stop_list, uint16_t section_index) {
+    loaded_list = stop_list;
+    section_loads++;
+}
+
+static void on_section_loaded(StopList *stop_list, uint16_t section_index) {
+    loaded_list = stop_list;
+}
+
+/**********************************************************
+ ** PREDICTIONS
+ **********************************************************/
+
+/*
+ * Subscribe to a stop, then have the phone push PREDICTION_COUNT predictions. Once the first
+ * has arrived, none may allocate.
+ */
+static void soak_pushed_predictions(uint32_t capabilities) {
+    PhoneConfig config = { .section_count = 5, .stops_per_section = 6, .capabilities = capabilities, .generation = 1 };
+    StopList *list = sync_list(&config);
+    CHECK(list != NULL);
+    if (list == NULL)
+        return;
+
+    char route_tag[PHONE_STRING_LENGTH], stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+    char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+    phone_section_strings(2, stop_tag, stop_title);
+    phone_stop_strings(2, 3, strings);
+    strcpy(route_tag, strings[0]);
+    sync_subscribe_prediction(route_tag, stop_tag, on_prediction_loaded);
+    host_run(NULL, 60 * 1000);
+    CHECK(prediction_count == 1);
+
+    host_reset_heap_stats();
+    size_t used = host_heap_stats()->used;
+    for (uint32_t i = 0; i < PREDICTION_COUNT; i++) {
+        host_advance(15 * 1000);
+        phone_push_prediction(time(NULL) + 60 * (i % 30), 90);
+        host_run(NULL, 60 * 1000);
+    }
+    CHECK(prediction_count == 1 + PREDICTION_COUNT);
+    CHECK(host_heap_stats()->allocations == 0);
+    CHECK(host_heap_stats()->used == used);
+    CHECK(host_heap_stats()->peak == used);
+
+    // The stop in the list holds the last prediction pushed
+    uint16_t section_index, stop_index;
+    CHECK(stop_list_find_stop(list, stop_tag, route_tag, &section_index, &stop_index));
+    Stop *stop = stop_list_get_stop(list, section_index, stop_index);
+    CHECK(stop != NULL && stop->prediction.arrival_time == last_prediction.arrival_time);
+}
+
+static void test_pushed_arrivals(void) {
+    soak_pushed_predictions(SUPPORTED_CAPABILITIES);
+}
+
+static void test_pushed_text_predictions(void) {
+    soak_pushed_predictions(SUPPORTED_CAPABILITIES & ~CAPABILITY_ARRIVAL_TIMES);
+}
+
+/*
+ * Request the predictions of every section over and over. Once each has been loaded once, none
+ * may allocate. Sections are longer than a chunk of text predictions, so every stop of a
+ * section must still receive its prediction.
+ */
+static void soak_section_predictions(uint32_t capabilities) {
+    PhoneConfig config = { .section_count = 8, .stops_per_section = 20, .capabilities = capabilities, .generation = 1 };
+    StopList *list = sync_list(&config);
+    CHECK(list != NULL);
+    if (list == NULL)
+        return;
+
+    for (uint32_t pass = 0; pass < VIEW_PASSES; pass++) {
+        if (pass == 1) {
+            host_reset_heap_stats();
+            section_loads = 0;
+        }
+        for (uint16_t i = 0; i < config.section_count; i++) {
+            sync_get_section_predictions(i, on_section_predictions_loaded);
+            host_run(NULL, 60 * 1000);
+        }
+    }
+    CHECK(section_loads == (VIEW_PASSES - 1) * config.section_count);
+    CHECK(host_heap_stats()->allocations == 0);
+
+    for (uint16_t i = 0; i < config.section_count; i++) {
+        for (uint16_t j = 0; j < config.stops_per_section; j++) {
+            Stop *stop = stop_list_get_stop(loaded_list, i, j);
+            CHECK(stop != NULL && stop->prediction.predicted_time != 0);
+        }
+    }
+}
+
+static void test_section_arrivals(void) {
+    soak_section_predictions(SUPPORTED_CAPABILITIES);
+}
+
+static void test_section_text_predictions(void) {
+    soak_section_predictions(SUPPORTED_CAPABILITIES & ~CAPABILITY_ARRIVAL_TIMES);
+}
+
+/**********************************************************
+ ** EVICTION
+ **********************************************************/
+
+/*
+ * Check that the stops of the section at section_index hold the strings the phone sent, which
+ * compacting the strings of the list after an eviction must not disturb
+ */
+static void check_section_strings(StopList *list, uint16_t section_index) {
+    char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+    phone_section_strings(section_index, stop_tag, stop_title);
+    StopSection *section = stop_list_get_section(list, section_index);
+    if (section == NULL)
+        return;
+    CHECK(strcmp(stop_list_string(list, section->stop_tag), stop_tag) == 0);
+    for (uint16_t j = 0; j < section->loaded_count; j++) {
+        char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+        phone_stop_strings(section_index, j, strings);
+        Stop *stop = stop_list_get_stop(list, section_index, j);
+        CHECK(stop != NULL && strcmp(stop_list_string(list, stop->route_tag), strings[0]) == 0 &&
+              strcmp(stop_list_string(list, stop->direction_title), strings[3]) == 0);
+    }
+}
+
+/*
+ * In lazy mode, view every section of a list too large for the memory budget, pass after pass.
+ * Each viewed section must load in full by evicting the least recently viewed, the stop lists
+ * must stay within the budget, and the heap must not grow from one pass to the next.
+ */
+static void test_eviction(void) {
+    PhoneConfig config = { .section_count = 40, .stops_per_section = 12, .capabilities = SUPPORTED_CAPABILITIES, .generation = 1 };
+    stop_list_set_memory_budget(LIST_BUDGET, 1024);
+    sync_set_lazy_loading(on_section_loaded);
+    StopList *list = sync_list(&config);
+    CHECK(list != NULL);
+    if (list == NULL)
+        return;
+
+    size_t used_after_first_pass = 0;
+    size_t peak_after_first_pass = 0;
+    for (uint32_t pass = 0; pass < VIEW_PASSES; pass++) {
+        for (uint16_t i = 0; i < config.section_count; i++) {
+            sync_load_section(i);
+            host_run(NULL, 60 * 1000);
+            StopSection *section = stop_list_get_section(loaded_list, i);
+            CHECK(section != NULL && section->loaded_count == section->stop_count);
+            check_section_strings(loaded_list, i);
+        }
+        if (pass == 0) {
+            used_after_first_pass = host_heap_stats()->used;
+            peak_after_first_pass = host_heap_stats()->peak;
+        }
+    }
+
+    const StopListMemory *memory = stop_list_memory();
+    CHECK(memory->allocated_peak <= LIST_BUDGET);
+    CHECK(memory->evictions >= (VIEW_PASSES - 1) * config.section_count);
+    CHECK(host_heap_stats()->used <= used_after_first_pass);
+    CHECK(host_heap_stats()->peak == peak_after_first_pass);
+    CHECK(host_heap_stats()->failures == 0);
+}
+
+int main(void) {
+    bool passed = true;
+    passed &= check_run("soak: pushed arrivals", test_pushed_arrivals);
+    passed &= check_run("soak: pushed text predictions", test_pushed_text_predictions);
+    passed &= check_run("soak: section arrivals", test_section_arrivals);
+    passed &= check_run("soak: section text predictions", test_section_text_predictions);
+    passed &= check_run("soak: eviction within the memory budget", test_eviction);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include <pebble.h>
+#include "check.h"
+#include "fixture.h"
+#include "host.h"
+#include "phone.h"
+#include "protocol.h"
+#include "sync.h"
+
+/*
+ * Check that list holds every section and stop the phone is configured with
+ */
+static void check_list(StopList *list, const PhoneConfig *config) {
+    CHECK(list != NULL);
+    if (list == NULL)
+        return;
+    CHECK(stop_list_is_complete(list));
+    CHECK(list->section_count == config->section_count);
+    for (uint16_t i = 0; i < list->section_count; i++) {
+        char stop_tag[PHONE_STRING_LENGTH], stop_title[PHONE_STRING_LENGTH];
+        phone_section_strings(i, stop_tag, stop_title);
+        StopSection *section = stop_list_get_section(list, i);
+        CHECK(section != NULL && section->stop_count == config->stops_per_section);
+        if (section == NULL)
+            continue;
+        CHECK(strcmp(stop_list_string(list, section->stop_tag), stop_tag) == 0);
+        CHECK(strcmp(stop_list_string(list, section->stop_title), stop_title) == 0);
+
+        for (uint16_t j = 0; j < section->stop_count; j++) {
+            char strings[STOP_STRING_COUNT][PHONE_STRING_LENGTH];
+            phone_stop_strings(i, j, strings);
+            Stop *stop = stop_list_get_stop(list, i, j);
+            CHECK(stop != NULL);
+            if (stop == NULL)
+                continue;
+            CHECK(strcmp(stop_list_string(list, stop->route_tag), strings[0]) == 0);
+            CHECK(strcmp(stop_list_string(list, stop->route_title), strings[1]) == 0);
+            CHECK(strcmp(stop_list_string(list, stop->direction_tag), strings[2]) == 0);
+            CHECK(strcmp(stop_list_string(list, stop->direction_title), strings[3]) == 0);
+        }
+    }
+}
+
+static void check_sync(uint32_t capabilities, uint8_t drop_percent, uint16_t malformed_every) {
+    PhoneConfig config = {
+        .section_count = 12,
+        .stops_per_section = 9,
+        .capabilities = capabilities,
+        .generation = 1,
+        .drop_percent = drop_percent,
+        .busy_percent = drop_percent,
+        .malformed_every = malformed_every,
+        .seed = 7
+    };
+    check_list(sync_list(&config), &config);
+}
+
+/**********************************************************
+ ** TESTS
+ **********************************************************/
+
+static void test_legacy_sync(void) {
+    check_sync(0, 0, 0);
+}
+
+static void test_batched_sync(void) {
+    check_sync(CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS, 0, 0);
+}
+
+static void test_binary_sync(void) {
+    check_sync(SUPPORTED_CAPABILITIES, 0, 0);
+}
+
+static void test_lossy_sync(void) {
+    check_sync(0, 10, 0);
+    check_sync(SUPPORTED_CAPABILITIES, 10, 0);
+}
+
+/*
+ * A batch without the index of its first stop, or cut off part way, must not move the cursor
+ * of its section past stops which never arrived; they are requested again.
+ */
+static void test_malformed_batches(void) {
+    check_sync(CAPABILITY_BATCHED_STOPS, 0, 2);
+    check_sync(CAPABILITY_BATCHED_STOPS | CAPABILITY_SEQUENCED_REQUESTS, 0, 3);
+    check_sync(SUPPORTED_CAPABILITIES, 0, 2);
+}
+
+/*
+ * A phone which can't fetch its stops answers with an empty list, without generations or
+ * headers, which must complete the sync
+ */
+static void test_empty_list(void) {
+    uint32_t capabilities = SUPPORTED_CAPABILITIES & ~(CAPABILITY_SECTION_GENERATIONS | CAPABILITY_SECTION_HEADERS);
+    PhoneConfig config = { .section_count = 0, .capabilities = capabilities };
+    check_list(sync_list(&config), &config);
+}
+
+int main(void) {
+    bool passed = true;
+    passed &= check_run("sync: legacy", test_legacy_sync);
+    passed &= check_run("sync: batched", test_batched_sync);
+    passed &= check_run("sync: binary", test_binary_sync);
+    passed &= check_run("sync: lossy link", test_lossy_sync);
+    passed &= check_run("sync: malformed batches", test_malformed_batches);
+    passed &= check_run("sync: empty list", test_empty_list);
+    return passed ? 0 : 1;
+}